@@ -0,0 +1,451 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * bench
+ *
+ * Microbenchmarks for the library's hot paths.  The library runs
+ * in-process on the loopback transport, with this program playing
+ * Polyglot, so only the library's own cost is measured.  Each
+ * benchmark is run with 10 up to 100k nodes and reports ops/sec, p50/p99 latency per operation
+ * and heap allocations per operation.
+ *
+ *   bench [-i iterations] [-m max nodes] [benchmark ...]
+ *
+ * Allocations are counted by wrapping malloc, calloc, realloc and
+ * strdup at link time, so they include work done for the operation
+ * by the library's own threads (sending, dispatch lanes).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define DEFAULT_ITERATIONS 100000
+#define DEFAULT_MAX_NODES  100000
+#define ADDR_LEN           16
+
+static unsigned long allocs;
+static unsigned long published;
+static unsigned long published_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_strdup(s);
+}
+
+static struct node **nodes;
+static char (*addrs)[ADDR_LEN];
+static char **keys;
+static char **commands;
+static int node_cnt;
+static unsigned int rnd = 2463534242u;
+
+/* xorshift, cheap enough not to show up in the results */
+static int pick(void)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 17;
+	rnd ^= rnd << 5;
+	return (int)(rnd % (unsigned int)node_cnt);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void cmd_nop(struct node *n, char *cmd, char *value, int uom)
+{
+	(void)n;
+	(void)cmd;
+	(void)value;
+	(void)uom;
+}
+
+/* Find s in the len bytes at p, which aren't nul terminated */
+static const char *find(const char *p, const char *end, const char *s)
+{
+	size_t n = strlen(s);
+
+	for (; p + n <= end; p++)
+		if (*p == *s && memcmp(p, s, n) == 0)
+			return p;
+
+	return NULL;
+}
+
+/*
+ * Answer an addnode message the way Polyglot does, one result per
+ * node, so addNodes() registration finishes.
+ */
+static void answer_addnode(const char *msg, int len)
+{
+	const char *end = msg + len;
+	const char *p = msg;
+	const char *q;
+	char buf[128];
+
+	while ((p = find(p, end, "\"address\":\"")) != NULL) {
+		p += 11;
+		for (q = p; q < end && *q != '"'; q++)
+			;
+		if (q - p >= ADDR_LEN)
+			continue;
+		snprintf(buf, sizeof(buf),
+				"{\"node\":\"polyglot\",\"result\":{\"addnode\":"
+				"{\"address\":\"%.*s\",\"success\":true}}}",
+				(int)(q - p), p);
+		loopbackSend(buf);
+	}
+}
+
+/* Polyglot's side of the loopback, count and drop */
+static void receive(const char *topic, const char *msg, int len, void *arg)
+{
+	(void)topic;
+	(void)arg;
+
+	__atomic_add_fetch(&published, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&published_bytes, (unsigned long)len,
+			__ATOMIC_RELAXED);
+
+	if (len > 12 && memcmp(msg, "{\"addnode\":", 11) == 0)
+		answer_addnode(msg, len);
+}
+
+static cJSON *status_msg;
+
+static void op_poly_send(int i)
+{
+	(void)i;
+	poly_send(status_msg);
+}
+
+static void op_set_driver(int i)
+{
+	struct node *n = nodes[pick()];
+
+	n->ops.setDriver(n, "ST", (i & 1) ? "1" : "0", 1, 0, 2);
+}
+
+static void op_report_drivers(int i)
+{
+	struct node *n = nodes[pick()];
+
+	(void)i;
+	n->ops.reportDrivers(n);
+}
+
+static void op_get_node(int i)
+{
+	struct node *n;
+
+	(void)i;
+	n = getNode(addrs[pick()]);
+	if (n == NULL)
+		abort();
+	putNode(n);
+}
+
+static void op_get_custom_param(int i)
+{
+	(void)i;
+	free(getCustomParam(keys[pick()]));
+}
+
+static void op_on_message(int i)
+{
+	int n = pick();
+
+	(void)i;
+	loopbackSend(commands[n]);
+}
+
+struct benchmark {
+	const char *name;
+	void (*op)(int i);
+};
+
+static struct benchmark benchmarks[] = {
+	{ "poly_send", op_poly_send },
+	{ "setDriver", op_set_driver },
+	{ "reportDrivers", op_report_drivers },
+	{ "getNode", op_get_node },
+	{ "getCustomParam", op_get_custom_param },
+	{ "on_message", op_on_message },
+};
+#define BENCH_CNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*
+ * Wait for the library to send everything it has queued so one
+ * benchmark's backlog isn't charged to the next.
+ */
+static void drain(void)
+{
+	int depth;
+	int tries;
+
+	for (tries = 0; tries < 5000; tries++) {
+		getSendQueue(&depth, NULL);
+		if (depth == 0)
+			break;
+		usleep(1000);
+	}
+	usleep(10000);
+}
+
+/*
+ * Grow the node list, the custom parameters and the command messages
+ * to cnt entries.
+ */
+static void grow(int cnt)
+{
+	struct node **batch;
+	cJSON *msg;
+	cJSON *config;
+	cJSON *params;
+	char *text;
+	char buf[128];
+	int queued, sent, added, failed;
+	int i;
+
+	nodes = realloc(nodes, sizeof(*nodes) * cnt);
+	addrs = realloc(addrs, sizeof(*addrs) * cnt);
+	keys = realloc(keys, sizeof(*keys) * cnt);
+	commands = realloc(commands, sizeof(*commands) * cnt);
+	if (!nodes || !addrs || !keys || !commands) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+
+	for (i = node_cnt; i < cnt; i++) {
+		snprintf(addrs[i], ADDR_LEN, "b%06d", i);
+		nodes[i] = allocNode("benchnode", addrs[0], addrs[i], addrs[i]);
+		addDriver(nodes[i], "ST", "0", 2);
+		addCommand(nodes[i], "DON", cmd_nop);
+
+		snprintf(buf, sizeof(buf), "param%d", i);
+		keys[i] = strdup(buf);
+
+		snprintf(buf, sizeof(buf),
+				"{\"node\":\"polyglot\",\"command\":"
+				"{\"address\":\"%s\",\"cmd\":\"DON\"}}", addrs[i]);
+		commands[i] = strdup(buf);
+	}
+
+	batch = nodes + node_cnt;
+	addNodes(batch, cnt - node_cnt);
+	node_cnt = cnt;
+
+	/* Let registration finish so it isn't timed with the benchmarks */
+	for (i = 0; i < 10000; i++) {
+		getAddNodesProgress(&queued, &sent, &added, &failed);
+		if (queued == 0 && added + failed == sent)
+			break;
+		usleep(1000);
+	}
+
+	/* Polyglot sends the whole config each time */
+	params = cJSON_CreateObject();
+	for (i = 0; i < cnt; i++)
+		cJSON_AddStringToObject(params, keys[i], addrs[i]);
+	config = cJSON_CreateObject();
+	cJSON_AddItemToObject(config, "customParams", params);
+	msg = cJSON_CreateObject();
+	cJSON_AddStringToObject(msg, "node", "polyglot");
+	cJSON_AddItemToObject(msg, "config", config);
+	text = cJSON_PrintUnformatted(msg);
+	loopbackSend(text);
+	cJSON_free(text);
+	cJSON_Delete(msg);
+
+	drain();
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Time each call of the operation separately for the percentiles and
+ * the whole run for the rate.
+ */
+static void run(struct benchmark *b, int iterations, unsigned int *lat)
+{
+	unsigned long a0;
+	unsigned long a1;
+	long long start;
+	long long t0;
+	long long t1;
+	double secs;
+	int i;
+
+	/* warm up */
+	for (i = 0; i < iterations / 10; i++)
+		b->op(i);
+	drain();
+
+	a0 = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		t0 = now_ns();
+		b->op(i);
+		t1 = now_ns();
+		lat[i] = (unsigned int)(t1 - t0);
+	}
+	secs = (double)(now_ns() - start) / 1e9;
+	drain();
+	a1 = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+
+	qsort(lat, iterations, sizeof(*lat), cmp_ns);
+	printf("%-16s %8d %12.0f %9u %9u %9.2f\n", b->name, node_cnt,
+			iterations / secs, lat[iterations / 2],
+			lat[(int)(iterations * 0.99)],
+			(double)(a1 - a0) / iterations);
+	fflush(stdout);
+}
+
+static int selected(char **names, int cnt, const char *name)
+{
+	int i;
+
+	if (cnt == 0)
+		return 1;
+	for (i = 0; i < cnt; i++)
+		if (strcmp(names[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct iface_options opts;
+	struct iface_ops ops;
+	struct cmdline cmd;
+	cJSON *status;
+	unsigned int *lat;
+	int iterations = DEFAULT_ITERATIONS;
+	int max_nodes = DEFAULT_MAX_NODES;
+	int cnt;
+	int ch;
+	int i;
+
+	while ((ch = getopt(argc, argv, "i:m:")) != -1) {
+		switch (ch) {
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'm':
+				max_nodes = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr,
+						"usage: bench [-i iterations] [-m max nodes] "
+						"[benchmark ...]\n");
+				return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (iterations < 100)
+		iterations = 100;
+
+	lat = malloc(sizeof(*lat) * iterations);
+	if (lat == NULL)
+		return 1;
+
+	memset(&ops, 0, sizeof(ops));
+	cmd.host = "localhost";
+	cmd.port = 1883;
+	cmd.profile = 1;
+
+	/* Big enough that the sender keeps up without dropping */
+	getDefaultOptions(&opts);
+	opts.send_queue_bytes = 16 * 1024 * 1024;
+	opts.lane_queue = 4096;
+	opts.transport = loopbackTransport();
+	loopbackReceiver(receive, NULL);
+	if (initWithOptions(&ops, &cmd, &opts) != 0 ||
+			loopbackConnected(5000) != 0) {
+		fprintf(stderr, "bench: failed to initialize the library\n");
+		return 1;
+	}
+	logger_set_level(CRITICAL);
+
+	status_msg = cJSON_CreateObject();
+	status = cJSON_AddObjectToObject(status_msg, "status");
+	cJSON_AddStringToObject(status, "address", "b000000");
+	cJSON_AddStringToObject(status, "driver", "ST");
+	cJSON_AddStringToObject(status, "value", "1");
+	cJSON_AddNumberToObject(status, "uom", 2);
+
+	printf("%-16s %8s %12s %9s %9s %9s\n", "benchmark", "nodes",
+			"ops/sec", "p50 ns", "p99 ns", "allocs/op");
+
+	for (cnt = 10; cnt <= max_nodes; cnt *= 10) {
+		grow(cnt);
+		for (i = 0; i < BENCH_CNT; i++)
+			if (selected(argv, argc, benchmarks[i].name))
+				run(&benchmarks[i], iterations, lat);
+	}
+
+	printf("published %lu messages, %lu bytes\n", published,
+			published_bytes);
+	return 0;
+}
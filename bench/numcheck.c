@@ -0,0 +1,225 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * numcheck
+ *
+ * Differential check of cJSON's number printing against the way it
+ * used to print numbers: "%1.15g", read back with sscanf, and "%1.17g"
+ * if that didn't give the same double.  Checks integers, short
+ * decimals, neighbours of powers of two and ten, subnormals and random
+ * bit patterns, then times both.
+ *
+ *   numcheck [-n count] [-s seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+#include "cJSON.h"
+
+#define DEFAULT_COUNT 10000000
+#define BAD_SHOWN     20
+#define TIMED         1000000
+
+static uint64_t rnd = 88172645463325252ULL;
+static unsigned long checked;
+static unsigned long bad;
+
+static uint64_t next(void)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return rnd;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The number printing cJSON had before, without the locale fixup */
+static int reference(char *buf, double d)
+{
+	double test;
+	int len;
+
+	if ((d * 0) != 0)
+		return sprintf(buf, "null");
+
+	len = sprintf(buf, "%1.15g", d);
+	if (sscanf(buf, "%lg", &test) != 1 || test != d)
+		len = sprintf(buf, "%1.17g", d);
+	return len;
+}
+
+static void check(cJSON *num, double d)
+{
+	char want[32];
+	char got[32];
+
+	cJSON_SetNumberValue(num, d);
+	reference(want, d);
+	if (!cJSON_PrintPreallocated(num, got, sizeof(got), 0)) {
+		strcpy(got, "(failed)");
+	}
+
+	checked++;
+	if (strcmp(want, got) != 0 && ++bad <= BAD_SHOWN)
+		printf("%a: want %s got %s\n", d, want, got);
+}
+
+static double from_bits(uint64_t bits)
+{
+	double d;
+
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+/* A decimal with up to 17 digits, as it would be read from JSON */
+static double short_decimal(void)
+{
+	char buf[64];
+	int digits = 1 + (int)(next() % 17);
+	int exp = (int)(next() % 61) - 30;
+	uint64_t m = next() % 100000000000000000ULL;
+	int i;
+
+	for (i = digits; i < 17; i++)
+		m /= 10;
+	snprintf(buf, sizeof(buf), "%llue%d", (unsigned long long)m, exp);
+	return strtod(buf, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	cJSON *num = cJSON_CreateNumber(0);
+	double *values;
+	char buf[32];
+	long long start;
+	long long ref_ns;
+	long long new_ns;
+	double d;
+	long count = DEFAULT_COUNT;
+	long i;
+	int ch;
+	int e;
+
+	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+		switch (ch) {
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 's':
+				rnd = strtoull(optarg, NULL, 0) | 1;
+				break;
+			default:
+				fprintf(stderr, "usage: numcheck [-n count] [-s seed]\n");
+				return 1;
+		}
+	}
+
+	/* edges */
+	check(num, 0.0);
+	check(num, -0.0);
+	check(num, DBL_MAX);
+	check(num, -DBL_MAX);
+	check(num, DBL_MIN);
+	check(num, from_bits(1));
+	check(num, nextafter(DBL_MIN, 0));
+	check(num, 1e15);
+	check(num, 1e15 - 1);
+	check(num, 9007199254740993.0);
+	check(num, 0.1 + 0.2);
+
+	/* neighbours of powers of two and ten */
+	for (e = -1074; e <= 1023; e++) {
+		d = ldexp(1.0, e);
+		check(num, d);
+		check(num, nextafter(d, 0));
+		check(num, nextafter(d, INFINITY));
+	}
+	for (e = -323; e <= 308; e++) {
+		d = strtod((snprintf(buf, sizeof(buf), "1e%d", e), buf), NULL);
+		check(num, d);
+		check(num, nextafter(d, 0));
+		check(num, nextafter(d, INFINITY));
+	}
+
+	for (i = 0; i < count; i++) {
+		switch (i % 4) {
+			case 0:
+				/* any finite double */
+				do {
+					d = from_bits(next());
+				} while ((d * 0) != 0);
+				break;
+			case 1:
+				d = (double)(int64_t)(next() >> (next() % 64));
+				break;
+			case 2:
+				d = short_decimal();
+				break;
+			default:
+				/* subnormals and small integers */
+				d = (i & 4) ? from_bits(next() >> 12) :
+					(double)(int)(next() % 100000) - 50000;
+				break;
+		}
+		check(num, (i & 8) ? -d : d);
+	}
+
+	printf("%lu numbers checked, %lu differ\n", checked, bad);
+
+	/* time the two on short decimals */
+	values = malloc(sizeof(*values) * TIMED);
+	if (values == NULL)
+		return 1;
+	for (i = 0; i < TIMED; i++)
+		values[i] = short_decimal();
+	start = now_ns();
+	for (i = 0; i < TIMED; i++)
+		reference(buf, values[i]);
+	ref_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < TIMED; i++) {
+		cJSON_SetNumberValue(num, values[i]);
+		cJSON_PrintPreallocated(num, buf, sizeof(buf), 0);
+	}
+	new_ns = now_ns() - start;
+	printf("printf: %lld ns/number, cJSON: %lld ns/number\n",
+			ref_ns / TIMED, new_ns / TIMED);
+	free(values);
+
+	cJSON_Delete(num);
+	return bad != 0;
+}
@@ -44,6 +44,15 @@
 #include <float.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stdint.h>
+
+#if !defined(CJSON_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define CJSON_SCAN_X86
+#include <immintrin.h>
+#elif !defined(CJSON_NO_SIMD) && defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define CJSON_SCAN_NEON
+#include <arm_neon.h>
+#endif
 
 #ifdef ENABLE_LOCALES
 #include <locale.h>
@@ -471,66 +480,938 @@ static void update_offset(printbuffer * const buffer)
     buffer->offset += strlen((const char*)buffer_pointer);
 }
 
-/* Render the number nicely from the given item into a string. */
-static cJSON_bool print_number(const cJSON * const item, printbuffer * const output_buffer)
+/*
+ * Numbers are printed without stdio or the locale. The output is what
+ * "%1.15g" gives when that reads back as the same double, otherwise
+ * what "%1.17g" gives. Integers are printed directly. For everything
+ * else Grisu3 finds the shortest digits, which for a normal double are
+ * the "%1.15g" digits when there are 15 or fewer of them, otherwise
+ * Grisu3's counted mode gives 17 digits. Subnormals and the numbers
+ * Grisu3 can't decide are done exactly with big integers.
+ */
+typedef struct
 {
-    unsigned char *output_pointer = NULL;
-    double d = item->valuedouble;
-    int length = 0;
-    size_t i = 0;
-    unsigned char number_buffer[26]; /* temporary buffer to print the number into */
-    unsigned char decimal_point = get_decimal_point();
-    double test;
+    uint64_t f;
+    int e;
+} diy_fp;
+
+/* 10^k as f * 2^e, for k = -348 to 340 in steps of 8 */
+static const struct
+{
+    uint64_t f;
+    short e;
+    short k;
+} cached_powers[] =
+{
+    { 0xfa8fd5a0081c0288ULL, -1220, -348 },
+    { 0xbaaee17fa23ebf76ULL, -1193, -340 },
+    { 0x8b16fb203055ac76ULL, -1166, -332 },
+    { 0xcf42894a5dce35eaULL, -1140, -324 },
+    { 0x9a6bb0aa55653b2dULL, -1113, -316 },
+    { 0xe61acf033d1a45dfULL, -1087, -308 },
+    { 0xab70fe17c79ac6caULL, -1060, -300 },
+    { 0xff77b1fcbebcdc4fULL, -1034, -292 },
+    { 0xbe5691ef416bd60cULL, -1007, -284 },
+    { 0x8dd01fad907ffc3cULL, -980, -276 },
+    { 0xd3515c2831559a83ULL, -954, -268 },
+    { 0x9d71ac8fada6c9b5ULL, -927, -260 },
+    { 0xea9c227723ee8bcbULL, -901, -252 },
+    { 0xaecc49914078536dULL, -874, -244 },
+    { 0x823c12795db6ce57ULL, -847, -236 },
+    { 0xc21094364dfb5637ULL, -821, -228 },
+    { 0x9096ea6f3848984fULL, -794, -220 },
+    { 0xd77485cb25823ac7ULL, -768, -212 },
+    { 0xa086cfcd97bf97f4ULL, -741, -204 },
+    { 0xef340a98172aace5ULL, -715, -196 },
+    { 0xb23867fb2a35b28eULL, -688, -188 },
+    { 0x84c8d4dfd2c63f3bULL, -661, -180 },
+    { 0xc5dd44271ad3cdbaULL, -635, -172 },
+    { 0x936b9fcebb25c996ULL, -608, -164 },
+    { 0xdbac6c247d62a584ULL, -582, -156 },
+    { 0xa3ab66580d5fdaf6ULL, -555, -148 },
+    { 0xf3e2f893dec3f126ULL, -529, -140 },
+    { 0xb5b5ada8aaff80b8ULL, -502, -132 },
+    { 0x87625f056c7c4a8bULL, -475, -124 },
+    { 0xc9bcff6034c13053ULL, -449, -116 },
+    { 0x964e858c91ba2655ULL, -422, -108 },
+    { 0xdff9772470297ebdULL, -396, -100 },
+    { 0xa6dfbd9fb8e5b88fULL, -369, -92 },
+    { 0xf8a95fcf88747d94ULL, -343, -84 },
+    { 0xb94470938fa89bcfULL, -316, -76 },
+    { 0x8a08f0f8bf0f156bULL, -289, -68 },
+    { 0xcdb02555653131b6ULL, -263, -60 },
+    { 0x993fe2c6d07b7facULL, -236, -52 },
+    { 0xe45c10c42a2b3b06ULL, -210, -44 },
+    { 0xaa242499697392d3ULL, -183, -36 },
+    { 0xfd87b5f28300ca0eULL, -157, -28 },
+    { 0xbce5086492111aebULL, -130, -20 },
+    { 0x8cbccc096f5088ccULL, -103, -12 },
+    { 0xd1b71758e219652cULL, -77, -4 },
+    { 0x9c40000000000000ULL, -50, 4 },
+    { 0xe8d4a51000000000ULL, -24, 12 },
+    { 0xad78ebc5ac620000ULL, 3, 20 },
+    { 0x813f3978f8940984ULL, 30, 28 },
+    { 0xc097ce7bc90715b3ULL, 56, 36 },
+    { 0x8f7e32ce7bea5c70ULL, 83, 44 },
+    { 0xd5d238a4abe98068ULL, 109, 52 },
+    { 0x9f4f2726179a2245ULL, 136, 60 },
+    { 0xed63a231d4c4fb27ULL, 162, 68 },
+    { 0xb0de65388cc8ada8ULL, 189, 76 },
+    { 0x83c7088e1aab65dbULL, 216, 84 },
+    { 0xc45d1df942711d9aULL, 242, 92 },
+    { 0x924d692ca61be758ULL, 269, 100 },
+    { 0xda01ee641a708deaULL, 295, 108 },
+    { 0xa26da3999aef774aULL, 322, 116 },
+    { 0xf209787bb47d6b85ULL, 348, 124 },
+    { 0xb454e4a179dd1877ULL, 375, 132 },
+    { 0x865b86925b9bc5c2ULL, 402, 140 },
+    { 0xc83553c5c8965d3dULL, 428, 148 },
+    { 0x952ab45cfa97a0b3ULL, 455, 156 },
+    { 0xde469fbd99a05fe3ULL, 481, 164 },
+    { 0xa59bc234db398c25ULL, 508, 172 },
+    { 0xf6c69a72a3989f5cULL, 534, 180 },
+    { 0xb7dcbf5354e9beceULL, 561, 188 },
+    { 0x88fcf317f22241e2ULL, 588, 196 },
+    { 0xcc20ce9bd35c78a5ULL, 614, 204 },
+    { 0x98165af37b2153dfULL, 641, 212 },
+    { 0xe2a0b5dc971f303aULL, 667, 220 },
+    { 0xa8d9d1535ce3b396ULL, 694, 228 },
+    { 0xfb9b7cd9a4a7443cULL, 720, 236 },
+    { 0xbb764c4ca7a44410ULL, 747, 244 },
+    { 0x8bab8eefb6409c1aULL, 774, 252 },
+    { 0xd01fef10a657842cULL, 800, 260 },
+    { 0x9b10a4e5e9913129ULL, 827, 268 },
+    { 0xe7109bfba19c0c9dULL, 853, 276 },
+    { 0xac2820d9623bf429ULL, 880, 284 },
+    { 0x80444b5e7aa7cf85ULL, 907, 292 },
+    { 0xbf21e44003acdd2dULL, 933, 300 },
+    { 0x8e679c2f5e44ff8fULL, 960, 308 },
+    { 0xd433179d9c8cb841ULL, 986, 316 },
+    { 0x9e19db92b4e31ba9ULL, 1013, 324 },
+    { 0xeb96bf6ebadf77d9ULL, 1039, 332 },
+    { 0xaf87023b9bf0ee6bULL, 1066, 340 }
+};
+#define CACHED_POWERS_OFFSET 348
+#define CACHED_POWERS_STEP 8
+
+static diy_fp diy_fp_make(uint64_t f, int e)
+{
+    diy_fp x;
+
+    x.f = f;
+    x.e = e;
+
+    return x;
+}
+
+static diy_fp diy_fp_normalize(diy_fp x)
+{
+#if defined(__GNUC__)
+    int shift = __builtin_clzll(x.f);
+
+    x.f <<= shift;
+    x.e -= shift;
+#else
+    while ((x.f & ((uint64_t)1 << 63)) == 0)
+    {
+        x.f <<= 1;
+        x.e--;
+    }
+#endif
 
-    if (output_buffer == NULL)
+    return x;
+}
+
+/* product of x and y, rounded to the upper 64 bits */
+static diy_fp diy_fp_multiply(diy_fp x, diy_fp y)
+{
+    const uint64_t mask = 0xffffffffU;
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & mask;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & mask;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t tmp = ((b * d) >> 32) + (ad & mask) + (bc & mask) + ((uint64_t)1 << 31);
+
+    return diy_fp_make((a * c) + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+/* split a finite, positive double into significand and binary exponent */
+static uint64_t double_parts(double d, int * const e, cJSON_bool * const lower_closer)
+{
+    uint64_t bits = 0;
+    uint64_t fraction = 0;
+    int biased = 0;
+
+    memcpy(&bits, &d, sizeof(bits));
+    fraction = bits & (((uint64_t)1 << 52) - 1);
+    biased = (int)((bits >> 52) & 0x7ff);
+
+    /* the next double down is closer at a power of two */
+    *lower_closer = (fraction == 0) && (biased > 1);
+    if (biased == 0)
+    {
+        *e = -1074;
+        return fraction;
+    }
+    *e = biased - 1075;
+
+    return fraction | ((uint64_t)1 << 52);
+}
+
+/* Move the last digit of the shortest number towards the exact value. */
+static cJSON_bool grisu_round_weed(char * const buffer, int length, uint64_t distance_too_high_w, uint64_t unsafe_interval, uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+
+    while ((rest < small_distance) && ((unsafe_interval - rest) >= ten_kappa) &&
+            (((rest + ten_kappa) < small_distance) || ((small_distance - rest) >= (rest + ten_kappa - small_distance))))
+    {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+
+    /* too close to tell which digit is right */
+    if ((rest < big_distance) && ((unsafe_interval - rest) >= ten_kappa) &&
+            (((rest + ten_kappa) < big_distance) || ((big_distance - rest) > (rest + ten_kappa - big_distance))))
     {
         return false;
     }
 
-    /* This checks for NaN and Infinity */
-    if ((d * 0) != 0)
+    return ((2 * unit) <= rest) && (rest <= (unsafe_interval - (4 * unit)));
+}
+
+/* Generate the shortest digits between the scaled boundaries low and high. */
+static cJSON_bool grisu_digit_gen(diy_fp low, diy_fp w, diy_fp high, char * const buffer, int * const length, int * const kappa)
+{
+    uint64_t unit = 1;
+    uint64_t too_low = low.f - unit;
+    uint64_t too_high = high.f + unit;
+    uint64_t unsafe_interval = too_high - too_low;
+    uint64_t one = (uint64_t)1 << -w.e;
+    uint32_t integrals = (uint32_t)(too_high >> -w.e);
+    uint64_t fractionals = too_high & (one - 1);
+    uint64_t rest = 0;
+    uint32_t divisor = 0;
+
+    *kappa = 0;
+    if (integrals != 0)
+    {
+        divisor = 1;
+        *kappa = 1;
+        while ((integrals / divisor) >= 10)
+        {
+            divisor *= 10;
+            (*kappa)++;
+        }
+    }
+
+    *length = 0;
+    while (*kappa > 0)
+    {
+        buffer[(*length)++] = (char)('0' + (integrals / divisor));
+        integrals %= divisor;
+        (*kappa)--;
+        rest = ((uint64_t)integrals << -w.e) + fractionals;
+        if (rest < unsafe_interval)
+        {
+            return grisu_round_weed(buffer, *length, too_high - w.f, unsafe_interval, rest, (uint64_t)divisor << -w.e, unit);
+        }
+        divisor /= 10;
+    }
+
+    for (;;)
     {
-        length = sprintf((char*)number_buffer, "null");
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        buffer[(*length)++] = (char)('0' + (fractionals >> -w.e));
+        fractionals &= one - 1;
+        (*kappa)--;
+        if (fractionals < unsafe_interval)
+        {
+            return grisu_round_weed(buffer, *length, (too_high - w.f) * unit, unsafe_interval, fractionals, one, unit);
+        }
+    }
+}
+
+/* A power of ten 10^-k that scales 2^e to a binary exponent of -60 to -32. */
+static diy_fp grisu_cached_power(int e, int * const k)
+{
+    int index = (CACHED_POWERS_OFFSET + (int)ceil((-60 - (e + 64) + 63) * 0.30102999566398114) - 1) / CACHED_POWERS_STEP + 1;
+
+    *k = -cached_powers[index].k;
+
+    return diy_fp_make(cached_powers[index].f, cached_powers[index].e);
+}
+
+/*
+ * Shortest digits of a finite, positive double, so that d is
+ * buffer * 10^decimal_exponent. Returns false for the few numbers
+ * Grisu3 can't be sure about.
+ */
+static cJSON_bool grisu3(double d, char * const buffer, int * const length, int * const decimal_exponent)
+{
+    cJSON_bool lower_closer = false;
+    int e = 0;
+    uint64_t f = double_parts(d, &e, &lower_closer);
+    diy_fp w = diy_fp_normalize(diy_fp_make(f, e));
+    diy_fp plus = diy_fp_normalize(diy_fp_make((f << 1) + 1, e - 1));
+    diy_fp minus;
+    diy_fp ten_mk;
+    int k = 0;
+    int kappa = 0;
+
+    if (lower_closer)
+    {
+        minus = diy_fp_make((f << 2) - 1, e - 2);
     }
     else
     {
-        /* Try 15 decimal places of precision to avoid nonsignificant nonzero digits */
-        length = sprintf((char*)number_buffer, "%1.15g", d);
+        minus = diy_fp_make((f << 1) - 1, e - 1);
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    ten_mk = grisu_cached_power(w.e, &k);
+    if (!grisu_digit_gen(diy_fp_multiply(minus, ten_mk), diy_fp_multiply(w, ten_mk), diy_fp_multiply(plus, ten_mk), buffer, length, &kappa))
+    {
+        return false;
+    }
+    *decimal_exponent = k + kappa;
+
+    return true;
+}
+
+/* Round the last of a fixed number of digits, if it is clear which way. */
+static cJSON_bool grisu_round_weed_counted(char * const buffer, int length, uint64_t rest, uint64_t ten_kappa, uint64_t unit, int * const kappa)
+{
+    int i = 0;
+
+    if ((unit >= ten_kappa) || ((ten_kappa - unit) <= unit))
+    {
+        return false;
+    }
+
+    /* round down when 2 * (rest + unit) <= 10^kappa */
+    if (((ten_kappa - rest) > rest) && ((ten_kappa - (2 * rest)) >= (2 * unit)))
+    {
+        return true;
+    }
+
+    /* round up when 2 * (rest - unit) >= 10^kappa */
+    if ((rest > unit) && ((ten_kappa - (rest - unit)) <= (rest - unit)))
+    {
+        buffer[length - 1]++;
+        for (i = length - 1; (i > 0) && (buffer[i] == ('0' + 10)); i--)
+        {
+            buffer[i] = '0';
+            buffer[i - 1]++;
+        }
+        if (buffer[0] == ('0' + 10))
+        {
+            buffer[0] = '1';
+            (*kappa)++;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/* Generate count digits of the scaled w. */
+static cJSON_bool grisu_digit_gen_counted(diy_fp w, int count, char * const buffer, int * const kappa)
+{
+    uint64_t w_error = 1;
+    uint64_t one = (uint64_t)1 << -w.e;
+    uint32_t integrals = (uint32_t)(w.f >> -w.e);
+    uint64_t fractionals = w.f & (one - 1);
+    uint32_t divisor = 1;
+    int length = 0;
+
+    /* w is at least 8, so there is always an integral digit */
+    *kappa = 1;
+    while ((integrals / divisor) >= 10)
+    {
+        divisor *= 10;
+        (*kappa)++;
+    }
 
-        /* Check whether the original double can be recovered */
-        if ((sscanf((char*)number_buffer, "%lg", &test) != 1) || ((double)test != d))
+    while (*kappa > 0)
+    {
+        buffer[length++] = (char)('0' + (integrals / divisor));
+        integrals %= divisor;
+        (*kappa)--;
+        if (length == count)
         {
-            /* If not, print with 17 decimal places of precision */
-            length = sprintf((char*)number_buffer, "%1.17g", d);
+            return grisu_round_weed_counted(buffer, length, ((uint64_t)integrals << -w.e) + fractionals, (uint64_t)divisor << -w.e, w_error, kappa);
         }
+        divisor /= 10;
     }
 
-    /* sprintf failed or buffer overrun occured */
-    if ((length < 0) || (length > (int)(sizeof(number_buffer) - 1)))
+    while ((length < count) && (fractionals > w_error))
+    {
+        fractionals *= 10;
+        w_error *= 10;
+        buffer[length++] = (char)('0' + (fractionals >> -w.e));
+        fractionals &= one - 1;
+        (*kappa)--;
+    }
+    if (length < count)
     {
         return false;
     }
 
-    /* reserve appropriate space in the output */
-    output_pointer = ensure(output_buffer, (size_t)length + sizeof(""));
-    if (output_pointer == NULL)
+    return grisu_round_weed_counted(buffer, length, fractionals, one, w_error, kappa);
+}
+
+/*
+ * count correctly rounded digits of a finite, positive double, so that
+ * d is close to buffer * 10^decimal_exponent. Returns false when the
+ * rounding is too close to call.
+ */
+static cJSON_bool grisu3_counted(double d, int count, char * const buffer, int * const decimal_exponent)
+{
+    cJSON_bool lower_closer = false;
+    int e = 0;
+    uint64_t f = double_parts(d, &e, &lower_closer);
+    diy_fp w = diy_fp_normalize(diy_fp_make(f, e));
+    diy_fp ten_mk;
+    int k = 0;
+    int kappa = 0;
+
+    ten_mk = grisu_cached_power(w.e, &k);
+    if (!grisu_digit_gen_counted(diy_fp_multiply(w, ten_mk), count, buffer, &kappa))
     {
         return false;
     }
+    *decimal_exponent = k + kappa;
+
+    return true;
+}
+
+/* big enough for a double times a power of ten that gives it 17 digits */
+#define BIGNUM_LIMBS 40
+
+typedef struct
+{
+    uint32_t limb[BIGNUM_LIMBS];
+    int used;
+} bignum;
+
+static void bignum_set(bignum * const b, uint64_t value)
+{
+    b->used = 0;
+    while (value != 0)
+    {
+        b->limb[b->used++] = (uint32_t)value;
+        value >>= 32;
+    }
+}
+
+static cJSON_bool bignum_is_zero(const bignum * const b)
+{
+    return b->used == 0;
+}
+
+static void bignum_mul_small(bignum * const b, uint32_t factor)
+{
+    uint64_t carry = 0;
+    int i = 0;
+
+    for (i = 0; i < b->used; i++)
+    {
+        carry += (uint64_t)b->limb[i] * factor;
+        b->limb[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry != 0)
+    {
+        b->limb[b->used++] = (uint32_t)carry;
+    }
+}
+
+static void bignum_mul_pow10(bignum * const b, int exponent)
+{
+    static const uint32_t pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+    for (; exponent >= 9; exponent -= 9)
+    {
+        bignum_mul_small(b, pow10[9]);
+    }
+    bignum_mul_small(b, pow10[exponent]);
+}
+
+static void bignum_shift_left(bignum * const b, int shift)
+{
+    int limbs = shift / 32;
+    int bits = shift % 32;
+    int i = 0;
+
+    if (bignum_is_zero(b))
+    {
+        return;
+    }
+    if (bits != 0)
+    {
+        b->limb[b->used] = 0;
+        for (i = b->used; i > 0; i--)
+        {
+            b->limb[i] = (b->limb[i] << bits) | (b->limb[i - 1] >> (32 - bits));
+        }
+        b->limb[0] <<= bits;
+        if (b->limb[b->used] != 0)
+        {
+            b->used++;
+        }
+    }
+    if (limbs != 0)
+    {
+        memmove(b->limb + limbs, b->limb, (size_t)b->used * sizeof(b->limb[0]));
+        memset(b->limb, 0, (size_t)limbs * sizeof(b->limb[0]));
+        b->used += limbs;
+    }
+}
+
+static int bignum_compare(const bignum * const a, const bignum * const b)
+{
+    int i = 0;
+
+    if (a->used != b->used)
+    {
+        return (a->used > b->used) ? 1 : -1;
+    }
+    for (i = a->used - 1; i >= 0; i--)
+    {
+        if (a->limb[i] != b->limb[i])
+        {
+            return (a->limb[i] > b->limb[i]) ? 1 : -1;
+        }
+    }
+
+    return 0;
+}
+
+/* a += b */
+static void bignum_add(bignum * const a, const bignum * const b)
+{
+    uint64_t carry = 0;
+    int i = 0;
+
+    for (i = 0; (i < b->used) || (carry != 0); i++)
+    {
+        if (i == a->used)
+        {
+            a->limb[a->used++] = 0;
+        }
+        carry += (uint64_t)a->limb[i] + ((i < b->used) ? b->limb[i] : 0);
+        a->limb[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+}
+
+/* a -= b, where a >= b */
+static void bignum_subtract(bignum * const a, const bignum * const b)
+{
+    uint64_t borrow = 0;
+    uint64_t limb = 0;
+    int i = 0;
+
+    for (i = 0; i < a->used; i++)
+    {
+        limb = (uint64_t)a->limb[i] - ((i < b->used) ? b->limb[i] : 0) - borrow;
+        a->limb[i] = (uint32_t)limb;
+        borrow = (limb >> 32) & 1;
+    }
+    while ((a->used > 0) && (a->limb[a->used - 1] == 0))
+    {
+        a->used--;
+    }
+}
+
+/* r = r mod 2^shift, returning r / 2^shift, which has to fit in 64 bits */
+static uint64_t bignum_split(bignum * const r, int shift)
+{
+    int limbs = shift / 32;
+    int bits = shift % 32;
+    uint64_t quotient = 0;
+    int at = 0;
+    int i = 0;
+
+    for (i = limbs; i < r->used; i++)
+    {
+        at = (32 * (i - limbs)) - bits;
+        if (at < 0)
+        {
+            quotient |= (uint64_t)r->limb[i] >> -at;
+        }
+        else if (at < 64)
+        {
+            quotient |= (uint64_t)r->limb[i] << at;
+        }
+    }
+
+    if (r->used > limbs)
+    {
+        r->used = limbs + 1;
+        r->limb[limbs] &= ((uint32_t)1 << bits) - 1;
+        while ((r->used > 0) && (r->limb[r->used - 1] == 0))
+        {
+            r->used--;
+        }
+    }
+
+    return quotient;
+}
+
+/* r = r mod s, returning r / s, where s is 10^exponent */
+static uint64_t bignum_divide_pow10(bignum * const r, const bignum * const s, int exponent)
+{
+    bignum quotient = *r;
+    bignum product;
+    bignum low;
+    uint64_t remainder = 0;
+    uint64_t q = 0;
+    uint32_t divisor = 0;
+    int i = 0;
+
+    for (; exponent > 0; exponent -= 9)
+    {
+        divisor = (exponent >= 9) ? 1000000000 : 1;
+        for (i = 0; (exponent < 9) && (i < exponent); i++)
+        {
+            divisor *= 10;
+        }
+        remainder = 0;
+        for (i = quotient.used - 1; i >= 0; i--)
+        {
+            remainder = (remainder << 32) | quotient.limb[i];
+            quotient.limb[i] = (uint32_t)(remainder / divisor);
+            remainder %= divisor;
+        }
+        while ((quotient.used > 0) && (quotient.limb[quotient.used - 1] == 0))
+        {
+            quotient.used--;
+        }
+    }
+    for (i = quotient.used - 1; i >= 0; i--)
+    {
+        q = (q << 32) | quotient.limb[i];
+    }
+
+    /* r -= s * q */
+    product = *s;
+    bignum_mul_small(&product, (uint32_t)(q >> 32));
+    bignum_shift_left(&product, 32);
+    low = *s;
+    bignum_mul_small(&low, (uint32_t)q);
+    bignum_add(&product, &low);
+    bignum_subtract(r, &product);
+
+    return q;
+}
+
+static void print_digits(char * const buffer, uint64_t value, int count)
+{
+    while (count > 0)
+    {
+        buffer[--count] = (char)('0' + (value % 10));
+        value /= 10;
+    }
+}
+
+/*
+ * Correctly rounded digits of a finite, positive double: 15 of them if
+ * try_short is set and those read back as d, otherwise 17. Returns the
+ * number of digits, and the decimal exponent of the first one.
+ */
+static int exact_digits(double d, char * const buffer, int * const exponent, cJSON_bool try_short)
+{
+    const uint64_t ten16 = (uint64_t)100000000 * 100000000;
+    cJSON_bool lower_closer = false;
+    bignum r;
+    bignum s;
+    bignum unit;
+    bignum diff;
+    uint64_t quotient = 0;
+    uint64_t digits = 0;
+    int delta = 0;
+    int scale = 0;
+    int low = 0;
+    int e = 0;
+    uint64_t m = double_parts(d, &e, &lower_closer);
+
+    /*
+     * d * 10^scale = r / s, scaled to 17 digits before the point.
+     * unit is one step of the significand in the same terms.
+     */
+    *exponent = (int)floor(log10(d));
+    for (;;)
+    {
+        scale = 16 - *exponent;
+        bignum_set(&unit, 1);
+        bignum_set(&s, 1);
+        if (e > 0)
+        {
+            bignum_shift_left(&unit, e);
+        }
+        else
+        {
+            bignum_shift_left(&s, -e);
+        }
+        if (scale > 0)
+        {
+            bignum_mul_pow10(&unit, scale);
+        }
+        else
+        {
+            bignum_mul_pow10(&s, -scale);
+        }
+        bignum_set(&r, m);
+        if (e > 0)
+        {
+            bignum_shift_left(&r, e);
+        }
+        if (scale > 0)
+        {
+            bignum_mul_pow10(&r, scale);
+        }
+
+        /* e < 0 only for numbers below 2^53, which have a scale > 0 */
+        if (scale > 0)
+        {
+            quotient = bignum_split(&r, (e < 0) ? -e : 0);
+        }
+        else
+        {
+            quotient = bignum_divide_pow10(&r, &s, -scale);
+        }
+        if (quotient >= (ten16 * 10))
+        {
+            (*exponent)++;
+        }
+        else if (quotient < ten16)
+        {
+            (*exponent)--;
+        }
+        else
+        {
+            break;
+        }
+    }
 
-    /* copy the printed number to the output and replace locale
-     * dependent decimal point with '.' */
-    for (i = 0; i < ((size_t)length); i++)
+    if (try_short)
     {
-        if (number_buffer[i] == decimal_point)
+        /* round to 15 digits, half to even */
+        digits = quotient / 100;
+        low = (int)(quotient % 100);
+        if ((low > 50) || ((low == 50) && (!bignum_is_zero(&r) || ((digits & 1) != 0))))
         {
-            output_pointer[i] = '.';
-            continue;
+            digits++;
         }
 
-        output_pointer[i] = number_buffer[i];
+        /* reads back as d when it is less than half a step away */
+        delta = (int)((digits * 100) - quotient);
+        bignum_set(&diff, 0);
+        if (delta > 0)
+        {
+            diff = s;
+            bignum_mul_small(&diff, (uint32_t)delta);
+            bignum_subtract(&diff, &r);
+            bignum_shift_left(&diff, 1);
+        }
+        else
+        {
+            if (delta < 0)
+            {
+                diff = s;
+                bignum_mul_small(&diff, (uint32_t)-delta);
+            }
+            bignum_add(&diff, &r);
+            bignum_shift_left(&diff, lower_closer ? 2 : 1);
+        }
+        delta = bignum_compare(&diff, &unit);
+        if ((delta < 0) || ((delta == 0) && ((m & 1) == 0)))
+        {
+            if (digits == (ten16 / 10))
+            {
+                digits /= 10;
+                (*exponent)++;
+            }
+            print_digits(buffer, digits, 15);
+            return 15;
+        }
+    }
+
+    /* round to 17 digits, half to even */
+    bignum_shift_left(&r, 1);
+    delta = bignum_compare(&r, &s);
+    if ((delta > 0) || ((delta == 0) && ((quotient & 1) != 0)))
+    {
+        quotient++;
+    }
+    if (quotient == (ten16 * 10))
+    {
+        quotient /= 10;
+        (*exponent)++;
+    }
+    print_digits(buffer, quotient, 17);
+
+    return 17;
+}
+
+/* Lay out count digits with exponent the way printf's %g does. */
+static unsigned char *format_digits(unsigned char *output, const char * const digits, int count, int exponent, int precision)
+{
+    int i = 0;
+
+    /* %g drops trailing zeros */
+    while ((count > 1) && (digits[count - 1] == '0'))
+    {
+        count--;
     }
-    output_pointer[i] = '\0';
+
+    if ((exponent < -4) || (exponent >= precision))
+    {
+        *output++ = (unsigned char)digits[0];
+        if (count > 1)
+        {
+            *output++ = '.';
+            memcpy(output, digits + 1, (size_t)count - 1);
+            output += count - 1;
+        }
+        *output++ = 'e';
+        *output++ = (exponent < 0) ? '-' : '+';
+        if (exponent < 0)
+        {
+            exponent = -exponent;
+        }
+        if (exponent >= 100)
+        {
+            *output++ = (unsigned char)('0' + (exponent / 100));
+            exponent %= 100;
+        }
+        *output++ = (unsigned char)('0' + (exponent / 10));
+        *output++ = (unsigned char)('0' + (exponent % 10));
+    }
+    else if (exponent >= 0)
+    {
+        for (i = 0; i <= exponent; i++)
+        {
+            *output++ = (i < count) ? (unsigned char)digits[i] : '0';
+        }
+        if (count > (exponent + 1))
+        {
+            *output++ = '.';
+            memcpy(output, digits + exponent + 1, (size_t)(count - exponent - 1));
+            output += count - exponent - 1;
+        }
+    }
+    else
+    {
+        *output++ = '0';
+        *output++ = '.';
+        for (i = -1; i > exponent; i--)
+        {
+            *output++ = '0';
+        }
+        memcpy(output, digits, (size_t)count);
+        output += count;
+    }
+
+    return output;
+}
+
+/* Print a finite double into output, returning the length. */
+static int format_number(unsigned char * const output, double d)
+{
+    unsigned char *output_pointer = output;
+    char digits[20];
+    uint64_t bits = 0;
+    uint64_t integer = 0;
+    uint64_t power = 0;
+    int count = 0;
+    int exponent = 0;
+
+    memcpy(&bits, &d, sizeof(bits));
+    if ((bits >> 63) != 0)
+    {
+        *output_pointer++ = '-';
+        d = -d;
+    }
+
+    if ((d < 1e15) && (d == (double)(uint64_t)d))
+    {
+        /* integers with up to 15 digits are printed as they are */
+        integer = (uint64_t)d;
+        for (count = 1, power = 10; (count < 15) && (integer >= power); count++, power *= 10)
+        {
+        }
+        print_digits((char*)output_pointer, integer, count);
+        output_pointer += count;
+    }
+    else if ((d < DBL_MIN) || !grisu3(d, digits, &count, &exponent))
+    {
+        /*
+         * Grisu3 couldn't decide, or d is subnormal and too imprecise
+         * for the shortest digits to be the "%1.15g" ones, so work it
+         * out exactly
+         */
+        count = exact_digits(d, digits, &exponent, true);
+        output_pointer = format_digits(output_pointer, digits, count, exponent, count);
+    }
+    else if (count <= 15)
+    {
+        output_pointer = format_digits(output_pointer, digits, count, exponent + count - 1, 15);
+    }
+    else if (grisu3_counted(d, 17, digits, &exponent))
+    {
+        /* the shortest digits don't fit in 15, so it takes 17 */
+        output_pointer = format_digits(output_pointer, digits, 17, exponent + 16, 17);
+    }
+    else
+    {
+        count = exact_digits(d, digits, &exponent, false);
+        output_pointer = format_digits(output_pointer, digits, count, exponent, 17);
+    }
+    *output_pointer = '\0';
+
+    return (int)(output_pointer - output);
+}
+
+/* Render the number nicely from the given item into a string. */
+static cJSON_bool print_number(const cJSON * const item, printbuffer * const output_buffer)
+{
+    unsigned char *output_pointer = NULL;
+    double d = item->valuedouble;
+    int length = 0;
+    unsigned char number_buffer[26]; /* temporary buffer to print the number into */
+
+    if (output_buffer == NULL)
+    {
+        return false;
+    }
+
+    /* This checks for NaN and Infinity */
+    if ((d * 0) != 0)
+    {
+        strcpy((char*)number_buffer, "null");
+        length = 4;
+    }
+    else
+    {
+        length = format_number(number_buffer, d);
+    }
+
+    /* reserve appropriate space in the output */
+    output_pointer = ensure(output_buffer, (size_t)length + sizeof(""));
+    if (output_pointer == NULL)
+    {
+        return false;
+    }
+    memcpy(output_pointer, number_buffer, (size_t)length + sizeof(""));
 
     output_buffer->offset += (size_t)length;
 
@@ -695,6 +1576,165 @@ fail:
     return 0;
 }
 
+/*
+ * Byte scanning kernels for the parser and printer. Each one returns a
+ * pointer to the first byte in [p, end) it is looking for, or end.
+ * SSE2/AVX2 (picked at runtime) and NEON look at a block of bytes at a
+ * time; everything else, and the tail of the input, is done a byte at
+ * a time. Define CJSON_NO_SIMD to always use the byte loop.
+ */
+#define SCAN_SPACE  0 /* first byte that isn't whitespace (> 32) */
+#define SCAN_STRING 1 /* first quote or backslash */
+#define SCAN_ESCAPE 2 /* first byte print_string_ptr has to escape */
+
+static const unsigned char *scan_bytes(const unsigned char *p, const unsigned char * const end, const int kind)
+{
+    switch (kind)
+    {
+        case SCAN_SPACE:
+            while ((p < end) && (*p <= 32))
+            {
+                p++;
+            }
+            break;
+        case SCAN_STRING:
+            while ((p < end) && (*p != '\"') && (*p != '\\'))
+            {
+                p++;
+            }
+            break;
+        default:
+            while ((p < end) && (*p > 31) && (*p != '\"') && (*p != '\\'))
+            {
+                p++;
+            }
+            break;
+    }
+
+    return p;
+}
+
+#if defined(CJSON_SCAN_X86)
+static const unsigned char *scan_sse2(const unsigned char *p, const unsigned char * const end, const int kind)
+{
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(32);
+    const __m128i control = _mm_set1_epi8(31);
+    __m128i v;
+    int mask;
+
+    for (; (end - p) >= 16; p += 16)
+    {
+        v = _mm_loadu_si128((const __m128i*)p);
+        switch (kind)
+        {
+            case SCAN_SPACE:
+                /* v <= 32 when min(v, 32) == v */
+                mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, space), v)) & 0xffff;
+                break;
+            case SCAN_STRING:
+                mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+                break;
+            default:
+                mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                            _mm_cmpeq_epi8(_mm_min_epu8(v, control), v)));
+                break;
+        }
+        if (mask != 0)
+        {
+            return p + __builtin_ctz((unsigned int)mask);
+        }
+    }
+
+    return scan_bytes(p, end, kind);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *scan_avx2(const unsigned char *p, const unsigned char * const end, const int kind)
+{
+    const __m256i quote = _mm256_set1_epi8('\"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(32);
+    const __m256i control = _mm256_set1_epi8(31);
+    __m256i v;
+    unsigned int mask;
+
+    for (; (end - p) >= 32; p += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i*)p);
+        switch (kind)
+        {
+            case SCAN_SPACE:
+                mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v));
+                break;
+            case SCAN_STRING:
+                mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+                break;
+            default:
+                mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v)));
+                break;
+        }
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_sse2(p, end, kind);
+}
+#elif defined(CJSON_SCAN_NEON)
+static const unsigned char *scan_neon(const unsigned char *p, const unsigned char * const end, const int kind)
+{
+    const uint8x16_t quote = vdupq_n_u8('\"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(32);
+    const uint8x16_t control = vdupq_n_u8(31);
+    uint8x16_t v;
+    uint8x16_t hit;
+
+    for (; (end - p) >= 16; p += 16)
+    {
+        v = vld1q_u8(p);
+        switch (kind)
+        {
+            case SCAN_SPACE:
+                hit = vcgtq_u8(v, space);
+                break;
+            case SCAN_STRING:
+                hit = vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash));
+                break;
+            default:
+                hit = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)), vcleq_u8(v, control));
+                break;
+        }
+        /* no movemask on NEON, find the byte in the block one at a time */
+        if (vmaxvq_u8(hit) != 0)
+        {
+            return scan_bytes(p, p + 16, kind);
+        }
+    }
+
+    return scan_bytes(p, end, kind);
+}
+#endif
+
+static const unsigned char *scan(const unsigned char *p, const unsigned char * const end, const int kind)
+{
+#if defined(CJSON_SCAN_X86)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return scan_avx2(p, end, kind);
+    }
+    return scan_sse2(p, end, kind);
+#elif defined(CJSON_SCAN_NEON)
+    return scan_neon(p, end, kind);
+#else
+    return scan_bytes(p, end, kind);
+#endif
+}
+
 /* Parse the input text into an unescaped cinput, and populate item. */
 static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -713,20 +1753,22 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
         /* calculate approximate size of the output (overestimate) */
         size_t allocation_length = 0;
         size_t skipped_bytes = 0;
-        while (((size_t)(input_end - input_buffer->content) < input_buffer->length) && (*input_end != '\"'))
+        const unsigned char * const content_end = input_buffer->content + input_buffer->length;
+        for (;;)
         {
+            input_end = scan(input_end, content_end, SCAN_STRING);
+            if ((input_end == content_end) || (*input_end == '\"'))
+            {
+                break;
+            }
             /* is escape sequence */
-            if (input_end[0] == '\\')
+            if ((input_end + 1) >= content_end)
             {
-                if ((size_t)(input_end + 1 - input_buffer->content) >= input_buffer->length)
-                {
-                    /* prevent buffer overflow when last input character is a backslash */
-                    goto fail;
-                }
-                skipped_bytes++;
-                input_end++;
+                /* prevent buffer overflow when last input character is a backslash */
+                goto fail;
             }
-            input_end++;
+            skipped_bytes++;
+            input_end += 2;
         }
         if (((size_t)(input_end - input_buffer->content) >= input_buffer->length) || (*input_end != '\"'))
         {
@@ -748,7 +1790,11 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     {
         if (*input_pointer != '\\')
         {
-            *output_pointer++ = *input_pointer++;
+            /* copy everything up to the next escape sequence */
+            const unsigned char *run_end = scan(input_pointer, input_end, SCAN_STRING);
+            memcpy(output_pointer, input_pointer, (size_t)(run_end - input_pointer));
+            output_pointer += run_end - input_pointer;
+            input_pointer = run_end;
         }
         /* escape sequence */
         else
@@ -828,6 +1874,8 @@ fail:
 static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffer * const output_buffer)
 {
     const unsigned char *input_pointer = NULL;
+    const unsigned char *input_end = NULL;
+    const unsigned char *run_end = NULL;
     unsigned char *output = NULL;
     unsigned char *output_pointer = NULL;
     size_t output_length = 0;
@@ -852,8 +1900,9 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
         return true;
     }
 
-    /* set "flag" to 1 if something needs to be escaped */
-    for (input_pointer = input; *input_pointer; input_pointer++)
+    /* count the additional characters needed for escaping */
+    input_end = input + strlen((const char*)input);
+    for (input_pointer = scan(input, input_end, SCAN_ESCAPE); input_pointer < input_end; input_pointer = scan(input_pointer + 1, input_end, SCAN_ESCAPE))
     {
         switch (*input_pointer)
         {
@@ -868,15 +1917,12 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
                 escape_characters++;
                 break;
             default:
-                if (*input_pointer < 32)
-                {
-                    /* UTF-16 escape sequence uXXXX */
-                    escape_characters += 5;
-                }
+                /* UTF-16 escape sequence uXXXX */
+                escape_characters += 5;
                 break;
         }
     }
-    output_length = (size_t)(input_pointer - input) + escape_characters;
+    output_length = (size_t)(input_end - input) + escape_characters;
 
     output = ensure(output_buffer, output_length + sizeof("\"\""));
     if (output == NULL)
@@ -898,47 +1944,52 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
     output[0] = '\"';
     output_pointer = output + 1;
     /* copy the string */
-    for (input_pointer = input; *input_pointer != '\0'; (void)input_pointer++, output_pointer++)
+    input_pointer = input;
+    while (input_pointer < input_end)
     {
-        if ((*input_pointer > 31) && (*input_pointer != '\"') && (*input_pointer != '\\'))
+        /* copy the run of normal characters in one go */
+        run_end = scan(input_pointer, input_end, SCAN_ESCAPE);
+        memcpy(output_pointer, input_pointer, (size_t)(run_end - input_pointer));
+        output_pointer += run_end - input_pointer;
+        input_pointer = run_end;
+        if (input_pointer == input_end)
         {
-            /* normal character, copy */
-            *output_pointer = *input_pointer;
+            break;
         }
-        else
+
+        /* character needs to be escaped */
+        *output_pointer++ = '\\';
+        switch (*input_pointer)
         {
-            /* character needs to be escaped */
-            *output_pointer++ = '\\';
-            switch (*input_pointer)
-            {
-                case '\\':
-                    *output_pointer = '\\';
-                    break;
-                case '\"':
-                    *output_pointer = '\"';
-                    break;
-                case '\b':
-                    *output_pointer = 'b';
-                    break;
-                case '\f':
-                    *output_pointer = 'f';
-                    break;
-                case '\n':
-                    *output_pointer = 'n';
-                    break;
-                case '\r':
-                    *output_pointer = 'r';
-                    break;
-                case '\t':
-                    *output_pointer = 't';
-                    break;
-                default:
-                    /* escape and print as unicode codepoint */
-                    sprintf((char*)output_pointer, "u%04x", *input_pointer);
-                    output_pointer += 4;
-                    break;
-            }
+            case '\\':
+                *output_pointer = '\\';
+                break;
+            case '\"':
+                *output_pointer = '\"';
+                break;
+            case '\b':
+                *output_pointer = 'b';
+                break;
+            case '\f':
+                *output_pointer = 'f';
+                break;
+            case '\n':
+                *output_pointer = 'n';
+                break;
+            case '\r':
+                *output_pointer = 'r';
+                break;
+            case '\t':
+                *output_pointer = 't';
+                break;
+            default:
+                /* escape and print as unicode codepoint */
+                sprintf((char*)output_pointer, "u%04x", *input_pointer);
+                output_pointer += 4;
+                break;
         }
+        output_pointer++;
+        input_pointer++;
     }
     output[output_length + 1] = '\"';
     output[output_length + 2] = '\0';
@@ -968,9 +2019,9 @@ static parse_buffer *buffer_skip_whitespace(parse_buffer * const buffer)
         return NULL;
     }
 
-    while (can_access_at_index(buffer, 0) && (buffer_at_offset(buffer)[0] <= 32))
+    if (buffer->offset < buffer->length)
     {
-       buffer->offset++;
+        buffer->offset = (size_t)(scan(buffer_at_offset(buffer), buffer->content + buffer->length, SCAN_SPACE) - buffer->content);
     }
 
     if (buffer->offset == buffer->length)
@@ -29,6 +29,9 @@
 #ifndef c_int_interface__h
 #define c_int_interface__h
 
+#include <stdarg.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -43,19 +46,230 @@ struct mqtt_priv {
 	void *(*onConfig)(void *args);
 };
 
+struct workq;
+struct config;
+struct config_map;
+
 struct profile {
 	int num;
-	char *config;
 	int connected;
 	int custom_config_doc_sent;
 	struct mqtt_priv mqtt_info;
 	struct node *nodelist;
+	struct iface_options options;
+	char topic[32];
+	char node_suffix[24];
+	int node_suffix_len;
+	struct workq *workers;
+	struct workq **lanes;
+	int lane_cnt;
+	struct workq *config_lane;
+	int reconnects;
+	long offline_ms;     /* length of the last outage */
+	long resync_ms;      /* time to resync after the last reconnect */
+};
+
+/*
+ * Per node map from a name handle to the index + 1 of the driver,
+ * command and send with that name (0 = none).
+ */
+struct node_slot {
+	unsigned short driver;
+	unsigned short command;
+	unsigned short send;
+};
+
+struct msgbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+	int error;
+};
+
+/* A command for node_cmd_exec(), allocated in the message's arena */
+struct cmd_work {
+	struct jtape *msg;    /* detached command message */
+	long long rx;         /* metrics_now() when it was received */
 };
 
-void poly_send(cJSON *msg);
+int poly_send(cJSON *msg);
+int poly_send_raw(const char *msg, size_t len);
+int poly_send_status(const char *msg, size_t len, const char *address,
+		const char *driver);
 void *node_cmd_exec(void *args);
 void *node_query_exec(void *args);
 void *node_status_exec(void *args);
+int node_resync(void);
+int node_add_batch(char **addresses, int cnt);
+struct node *node_find(const char *address);
+void node_put(struct node *n);
+struct node **node_list_get(int *cnt);
+void node_list_put(struct node **nodes, int cnt);
+void status_send(const char *address, const char *driver,
+		const char *value, int uom);
+
+struct workq *workq_create(int thread_cnt, int depth);
+int workq_submit(struct workq *q, void *(*fn)(void *), void *arg,
+		void (*release)(void *), void *release_arg);
+void workq_destroy(struct workq *q);
+int workq_pending(struct workq *q);
+
+/* Trace of the command being handled, see pg_c_spans.c */
+struct span_ctx {
+	unsigned int id;      /* 0 = none */
+	long long rx;         /* when the command was received */
+};
+
+int span_start(int spans);
+int span_enabled(void);
+void span_new(long long rx);
+struct span_ctx span_get(void);
+void span_set(struct span_ctx ctx);
+void span_record(unsigned int id, const char *name, const char *label,
+		long long start, long long end);
+
+int metrics_start(void);
+long long metrics_now(void);
+void metrics_msg_in(int type, size_t bytes);
+void metrics_sent(size_t bytes, int ok);
+void metrics_dropped(void);
+void metrics_time(int hist, long long ns);
+void metrics_running(int delta);
+
+void msg_init(int profile);
+struct msgbuf *msg_buffer(void);
+void msg_append(struct msgbuf *mb, const char *s, size_t len);
+#define msg_literal(mb, s) msg_append(mb, s, sizeof(s) - 1)
+void msg_append_string(struct msgbuf *mb, const char *s);
+void msg_append_int(struct msgbuf *mb, int value);
+void msg_append_status(struct msgbuf *mb, const char *address,
+		const char *driver, const char *value, int uom);
+void msg_append_node(struct msgbuf *mb, struct node *n);
+int msg_finish(struct msgbuf *mb);
+int msg_send(struct msgbuf *mb);
+int msg_status(const char *address, const char *driver,
+		const char *value, int uom);
+void msg_command(const char *address, const char *command,
+		const char *value, int uom);
+void msg_addnode(struct node *n);
+
+int outq_start(size_t bytes);
+int outq_put(const char *msg, size_t len, const char *address,
+		const char *driver);
+void outq_wake(void);
+unsigned long outq_mark(void);
+int outq_wait(unsigned long mark, int timeout_ms);
+
+int conn_start(void);
+void conn_up(void);
+void conn_down(void);
+
+/* config sections */
+enum {
+	CFG_PARAMS,
+	CFG_DATA,
+	CFG_NOTICES,
+	CFG_NODES,
+	CFG_SECTIONS
+};
+
+int config_set(cJSON *tree);
+struct config *config_get(void);
+void config_put(struct config *c);
+void config_release(void *args);
+const char *config_text(struct config *c);
+cJSON *config_tree(struct config *c);
+struct config_map *config_section(struct config *c, int section);
+const char *config_find(struct config_map *m, const char *key);
+char *config_lookup(int section, const char *key);
+struct pair *config_pairs(int section);
+void config_keys(int section, void (*fn)(char *key));
+struct config_delta *config_diff(struct config *old, struct config *c);
+void config_delta_free(void *args);
+
+int intern_find(const char *name);
+int intern_id(const char *name);
+
+int rate_start(void);
+int rate_status(struct node *n, struct driver *d);
+void rate_defer(struct node *n, struct driver *d, long ms);
+void rate_forget(struct node *n);
+
+extern int trace_level;
+void logger_update_gates(void);
+void trace_vrecord(enum LOGLEVELS level, const char *fmt, va_list args);
+void trace_record(enum LOGLEVELS level, const char *fmt, ...);
+
+struct json_arena;
+void json_arena_init(void);
+struct json_arena *json_arena_new(void);
+struct json_arena *json_arena_begin(void);
+void *json_arena_alloc(struct json_arena *a, size_t size);
+void json_arena_leave(struct json_arena *a);
+void json_arena_release(void *args);
+void json_arena_end(struct json_arena *a);
+
+enum tape_types {
+	TAPE_NULL,
+	TAPE_FALSE,
+	TAPE_TRUE,
+	TAPE_NUMBER,
+	TAPE_STRING,
+	TAPE_ARRAY,
+	TAPE_OBJECT,
+};
+#define TAPE_ESCAPED 0x01
+#define TAPE_ROOT    0
+
+struct tape_ent {
+	uint32_t off;       /* offset of the value in the text */
+	uint32_t len;       /* string without quotes, container with brackets */
+	uint32_t next;      /* index of the entry after this value */
+	uint8_t type;
+	uint8_t flags;
+};
+
+struct jtape {
+	struct tape_ent *ent;
+	int cnt;
+	int cap;
+	const char *text;
+	size_t len;
+	int detached;
+};
+
+struct jview {
+	const char *ptr;
+	size_t len;
+};
+
+/* Step through the elements of an array */
+#define TAPE_FOREACH(t, arr, i) \
+	for ((i) = (arr) + 1; (i) < (int)(t)->ent[arr].next; \
+			(i) = (int)(t)->ent[i].next)
+
+/* Step through the members of an object, k is the key, k + 1 the value */
+#define TAPE_FOREACH_KEY(t, obj, k) \
+	for ((k) = (obj) + 1; (k) < (int)(t)->ent[obj].next; \
+			(k) = (int)(t)->ent[(k) + 1].next)
+
+int tape_parse(struct jtape *t, const char *text, size_t len);
+struct jtape *tape_thread(void);
+int tape_get(const struct jtape *t, int obj, const char *key);
+int tape_type(const struct jtape *t, int i);
+int tape_streq(const struct jtape *t, int i, const char *s);
+struct jview tape_view(const struct jtape *t, int i);
+int tape_string(const struct jtape *t, int i, char *buf, size_t size);
+struct jtape *tape_detach(const struct jtape *t, struct json_arena *a);
+const char *tape_cstr(const struct jtape *t, int i);
+
+int reg_start(void);
+int reg_queue(struct node **nodes, int cnt);
+void reg_result(const char *address, int success);
+
+int coalesce_start(void);
+int coalesce_status(const char *address, const char *driver,
+		const char *value, int uom);
 
 #ifdef __cplusplus
 }
@@ -38,6 +38,8 @@ extern "C"
 #endif
 
 struct node;
+struct rate_limit;
+struct node_slot;
 
 enum LOGLEVELS {
 	CRITICAL,
@@ -52,6 +54,34 @@ void logger(enum LOGLEVELS level, const char *msg);
 void loggerf(enum LOGLEVELS level, const char *fmt, ...);
 void logger_set_level(enum LOGLEVELS new_level);
 
+/*
+ * Subsystems with their own log level.  LOGF() checks the level
+ * before anything else, so when a level is off none of the arguments
+ * are evaluated.
+ */
+enum LOGSUBSYS {
+	LOGSYS_GENERAL,
+	LOGSYS_MQTT,
+	LOGSYS_NODES,
+	LOGSYS_CONFIG,
+	LOGSYS_NOTICES,
+	LOGSYS_CNT
+};
+extern int log_gate[LOGSYS_CNT];
+void logger_set_subsys_level(enum LOGSUBSYS subsys, enum LOGLEVELS level);
+void loggerf_sub(enum LOGSUBSYS subsys, enum LOGLEVELS level,
+		const char *fmt, ...);
+#define logger_on(subsys, level) ((int)(level) <= log_gate[subsys])
+#define LOGF(subsys, level, ...) \
+	do { \
+		if (logger_on(subsys, level)) \
+			loggerf_sub(subsys, level, __VA_ARGS__); \
+	} while (0)
+int logger_set_async(int bytes);
+void logger_flush(void);
+int logger_set_trace(enum LOGLEVELS level);
+void logger_trace_flush(void);
+
 /* Use this to initialize NS with fixed parameters */
 struct cmdline {
 	char *host;
@@ -59,7 +89,60 @@ struct cmdline {
 	int profile;
 };
 
+/*
+ * The link to Polyglot.  The library uses an MQTT client unless a
+ * different transport is set in iface_options.  The transport fills
+ * in the functions and the library sets the on_* callbacks before it
+ * calls connect().  The functions return 0 or an error that strerror()
+ * describes.  loop() is called over and over from the library's
+ * network thread; it returns an error while the connection is down
+ * and the library then calls reconnect() with a backoff.  Payloads
+ * passed to on_message() must be nul terminated.
+ */
+struct iface_transport {
+	int (*connect)(struct iface_transport *t, const char *host, int port);
+	int (*reconnect)(struct iface_transport *t);
+	int (*loop)(struct iface_transport *t, int timeout);
+	int (*subscribe)(struct iface_transport *t, const char *topic);
+	int (*publish)(struct iface_transport *t, const char *topic,
+			const void *payload, int len);
+	const char *(*strerror)(int err);
+
+	void (*on_connect)(struct iface_transport *t);
+	void (*on_disconnect)(struct iface_transport *t);
+	void (*on_message)(struct iface_transport *t, const char *topic,
+			const void *payload, int len);
+	void *priv;
+};
+
+/*
+ * Library tuning options. Use getDefaultOptions() to fill in the
+ * defaults and then change only what is needed before passing this
+ * to initWithOptions().
+ */
+struct iface_options {
+	int worker_threads;     /* threads that run node server callbacks */
+	int worker_queue;       /* callbacks waiting before MQTT input blocks */
+	int dispatch_lanes;     /* per node serial lanes, 0 = one per CPU */
+	int lane_queue;         /* node callbacks waiting in each lane */
+	int status_window;      /* ms to coalesce driver reports, 0 = off */
+	int status_batch;       /* max driver reports per status message */
+	int send_queue_bytes;   /* memory for messages waiting to be sent */
+	int reconnect_min;      /* ms before the first reconnect attempt */
+	int reconnect_max;      /* max ms between reconnect attempts */
+	int rate_limit;         /* driver reports per second, 0 = no limit */
+	int rate_burst;         /* driver reports allowed in a burst */
+	int add_batch;          /* nodes per addnode message from addNodes() */
+	int add_window;         /* addnode messages waiting for results */
+	int log_buffer;         /* bytes for async logging, 0 = synchronous */
+	int stats_interval;     /* seconds between stats.log lines, 0 = off */
+	int trace_spans;        /* command trace spans kept, 0 = off */
+	struct iface_transport *transport;  /* NULL = MQTT */
+};
+
 #define PARAMETER_CHANGED 0x01
+#define PARAMETER_ADDED   0x02
+#define PARAMETER_REMOVED 0x04
 struct pair {
 	char *key;
 	char *value;
@@ -67,20 +150,108 @@ struct pair {
 	struct pair *next;
 };
 
+/*
+ * What changed between two configs, passed to onConfigChange.  Each
+ * list holds only the keys that were added, changed or removed, with
+ * flags set to say which.  For nodes the key is the node address and
+ * the value is the node's JSON from the config.  Removed entries
+ * have the old value.
+ */
+struct config_delta {
+	struct pair *customParams;
+	struct pair *customData;
+	struct pair *notices;
+	struct pair *nodes;
+	const char *config;    /* the new config, as passed to onConfig */
+};
+
+/*
+ * Optional filtering of driver reports, see addDriverFiltered().
+ */
+#define DEADBAND_PERCENT 0x01
+struct driver_filter {
+	double deadband;      /* change needed before reporting, 0 = any change */
+	int flags;            /* DEADBAND_PERCENT: deadband is % of last report */
+	int min_interval;     /* minimum ms between reports, 0 = none */
+};
+
+/*
+ * Library metrics, see getStats().
+ */
+enum STAT_MSGS {        /* messages received, by type */
+	STAT_MSG_CONNECTED,
+	STAT_MSG_CONFIG,
+	STAT_MSG_SHORTPOLL,
+	STAT_MSG_LONGPOLL,
+	STAT_MSG_COMMAND,
+	STAT_MSG_QUERY,
+	STAT_MSG_STATUS,
+	STAT_MSG_DELETE,
+	STAT_MSG_RESULT,
+	STAT_MSG_OTHER,
+	STAT_MSG_CNT
+};
+
+enum STAT_HISTS {
+	STAT_CMD_LATENCY,     /* command received until its callback returned */
+	STAT_CMD_RUN,         /* time in the command callback */
+	STAT_QUEUE_WAIT,      /* time callbacks wait for a worker or lane */
+	STAT_HIST_CNT
+};
+
+#define STAT_BUCKETS 24
+struct stat_hist {
+	unsigned long count;
+	unsigned long long total_us;
+	unsigned long max_us;
+	unsigned long buckets[STAT_BUCKETS];   /* < 1us, < 2us, < 4us, ... */
+};
+
+struct iface_stats {
+	unsigned long msgs_in[STAT_MSG_CNT];
+	unsigned long bytes_in;
+	unsigned long sent;           /* messages published */
+	unsigned long send_errors;    /* publish failures (retried) */
+	unsigned long dropped;        /* messages that could not be queued */
+	unsigned long bytes_out;
+	int callbacks_running;
+	int worker_queue;             /* callbacks waiting for a worker */
+	int lane_queue;               /* node callbacks waiting in the lanes */
+	int send_queue;
+	int send_queue_bytes;
+	int reconnects;
+	long offline_ms;
+	long resync_ms;
+	unsigned long rate_delayed;
+	unsigned long rate_suppressed;
+	struct stat_hist hists[STAT_HIST_CNT];
+};
+
 struct driver {
 	char *driver;
 	char *value;
 	int uom;
+	struct driver_filter filter;
+	int filtered;         /* filter is set */
+	int has_reported;     /* reported/reported_at are valid */
+	double reported;      /* last numeric value reported */
+	char *reported_value; /* copy of the last value reported */
+	int reported_uom;
+	long long reported_at;
+	int handle;
 };
 
 struct command {
 	char *id;
 	void (*callback)(struct node *n, char *cmd, char *value, int uom);
+	int handle;
+	int next;             /* next command with the same id, index + 1 */
 };
 
 struct send {
 	char *id;
 	void (*callback)(struct node *n, char *cmd, char *value, int uom);
+	int handle;
 };
 
 
@@ -117,7 +288,13 @@ struct node {
 	int send_cnt;
 	unsigned char hint[4];
 	struct node_ops ops;
+	struct rate_limit *limit;
+	struct node_slot *slots;  /* handle -> driver/command/send */
+	int slot_cnt;
 	struct node *next;
+	struct node *prev;
+	struct node *hnext;     /* address index chain */
+	int refs;               /* node list and in-flight work */
 };
 
 struct iface_ops {
@@ -126,10 +303,15 @@ struct iface_ops {
 	void *(*longPoll)(void *args);
 	void *(*onConfig)(void *args);
 	void *(*delete)(void *args);
+	void *(*onConfigChange)(void *args);   /* args is struct config_delta * */
 };
 
 int init(struct iface_ops *ns_ops, struct cmdline *cmdln);
+void getDefaultOptions(struct iface_options *opts);
+int initWithOptions(struct iface_ops *ns_ops, struct cmdline *cmdln,
+		struct iface_options *opts);
 int isConnected(void);
+int getSendQueue(int *depth, int *bytes);
 char *getConfig(void);
 struct pair *getCustomParams(void);
 char *getCustomParam(char *key);
@@ -143,12 +325,34 @@ int removeCustomData(char *key);
 void freeCustomPairs(struct pair *params);
 struct node *allocNode(char *id, char *primary, char *address, char *name);
 void addDriver(struct node *n, char *driver, char *init, int uom);
+void addDriverFiltered(struct node *n, char *driver, char *init, int uom,
+		struct driver_filter *filter);
 void addCommand(struct node *n, char *cmd_id, void (*callback)(struct node *, char *, char *, int));
 void addSend(struct node *n, char *cmd_id, void (*callback)(struct node *, char *, char *, int));
 void addNode(struct node *n);
+int addNodes(struct node **nodes, int cnt);
+void getAddNodesProgress(int *queued, int *sent, int *added, int *failed);
+int getHandle(char *name);
+void setDriverH(struct node *n, int handle, char *value, int report, int force, int uom);
+char *getDriverH(struct node *n, int handle);
+void reportDriverH(struct node *n, int handle, int changed, int force);
+void reportCmdH(struct node *n, int handle, char *value, int uom);
 void delNode(char *address);
 struct node *getNode(char * address);
+void putNode(struct node *n);
 struct node *getNodes(void);
+int setRateLimit(struct node *n, char *driver, int rate, int burst);
+void getRateLimitStats(unsigned long *delayed, unsigned long *suppressed);
+void getStats(struct iface_stats *stats);
+unsigned long statPercentile(struct stat_hist *h, double pct);
+int exportTrace(const char *file);
+struct iface_transport *mqttTransport(void);
+struct iface_transport *loopbackTransport(void);
+void loopbackReceiver(void (*fn)(const char *topic, const char *msg,
+			int len, void *arg), void *arg);
+int loopbackSend(const char *msg);
+int loopbackConnected(int timeout);
+void loopbackDisconnect(void);
 void setNodeHint(struct node *n, unsigned char one, unsigned char two,
 		unsigned char three, unsigned char four);
 void addNotice(char *key, char *text);
@@ -0,0 +1,320 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_arena.c
+ *
+ * Arena allocation for cJSON.  Building or parsing a message creates
+ * dozens of small cJSON nodes and strings that all go away together
+ * once the message is sent or handled.  Between json_arena_begin()
+ * and json_arena_end(), every cJSON allocation on the thread is
+ * carved from an arena and the whole lot is dropped at the end, so
+ * the message path doesn't go through malloc and free at all.
+ *
+ * The library installs these as cJSON's allocation hooks.  Outside an
+ * arena scope they are plain malloc() and free(), so memory cJSON
+ * hands out there, or handed out before the hooks were installed, can
+ * be freed with free() as usual.  cJSON_Delete() and cJSON_free()
+ * inside a scope do nothing for a block that falls within the chunks
+ * of one of the thread's arenas.  json_arena_leave() stops allocating
+ * from the arena without dropping it and json_arena_release() drops
+ * it later, from any thread, when the handler that owns it is done.
+ *
+ * Nothing allocated from an arena may be kept, or freed with
+ * cJSON_free(), after its scope ends.  Anything that is, like the
+ * config tree, must be allocated outside the arena scope.
+ *
+ * Arenas are reused from a small pool, keeping their first chunk, so
+ * a steady stream of messages needs no new memory at all.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define ARENA_CHUNK  8192          /* first chunk size */
+#define ARENA_KEEP   (64 * 1024)   /* largest chunk kept for reuse */
+#define ARENA_POOL   16            /* idle arenas kept */
+#define ARENA_ALIGN  16
+#define ARENA_ROUND(size) \
+	(((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+#define CHUNK_HDR ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & \
+		~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HDR)
+
+struct json_arena {
+	struct arena_chunk *chunks;    /* newest (and largest) first */
+	size_t total;
+	struct json_arena *prev;       /* scope this one was begun in */
+	struct json_arena *next;       /* pool list */
+};
+
+static pthread_mutex_t ja_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct json_arena *ja_pool;
+static int ja_pool_cnt;
+
+static __thread struct json_arena *ja_current;
+
+static struct arena_chunk *chunk_add(struct json_arena *a, size_t need)
+{
+	struct arena_chunk *c;
+	size_t size = ARENA_CHUNK;
+
+	/* Double up so a big message needs only a few chunks */
+	if (size < a->total)
+		size = a->total;
+	if (size < need)
+		size = need;
+
+	c = malloc(CHUNK_HDR + size);
+	if (c == NULL)
+		return NULL;
+	c->size = size;
+	c->used = 0;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->total += size;
+
+	return c;
+}
+
+static void *arena_alloc(struct json_arena *a, size_t need)
+{
+	struct arena_chunk *c;
+	void *p;
+
+	c = a->chunks;
+	if (c == NULL || c->size - c->used < need) {
+		c = chunk_add(a, need);
+		if (c == NULL)
+			return NULL;
+	}
+	p = CHUNK_DATA(c) + c->used;
+	c->used += need;
+
+	return p;
+}
+
+/*
+ * Is ptr inside one of the arenas in scope on this thread?
+ */
+static int arena_owns(const char *ptr)
+{
+	struct arena_chunk *c;
+	struct json_arena *a;
+
+	for (a = ja_current; a; a = a->prev)
+		for (c = a->chunks; c; c = c->next)
+			if (ptr >= CHUNK_DATA(c) && ptr < CHUNK_DATA(c) + c->size)
+				return 1;
+
+	return 0;
+}
+
+static void *json_malloc(size_t size)
+{
+	struct json_arena *a = ja_current;
+
+	if (a == NULL)
+		return malloc(size);
+
+	return arena_alloc(a, ARENA_ROUND(size));
+}
+
+static void json_free(void *ptr)
+{
+	if (ptr == NULL || (ja_current && arena_owns(ptr)))
+		return;
+
+	free(ptr);
+}
+
+/*
+ * Drop everything allocated from the arena, keeping the newest chunk
+ * for reuse if it isn't too big.
+ */
+static void arena_reset(struct json_arena *a)
+{
+	struct arena_chunk *c;
+	struct arena_chunk *next;
+
+	c = a->chunks;
+	if (c && c->size > ARENA_KEEP) {
+		next = c;
+		c = NULL;
+	} else {
+		next = c ? c->next : NULL;
+	}
+
+	while (next) {
+		struct arena_chunk *tmp = next->next;
+
+		free(next);
+		next = tmp;
+	}
+
+	a->chunks = c;
+	a->total = 0;
+	if (c) {
+		c->next = NULL;
+		c->used = 0;
+		a->total = c->size;
+	}
+}
+
+/*
+ * json_arena_init
+ *
+ * Install the arena allocator as cJSON's allocation hooks.  Memory
+ * cJSON allocated before this is still freed with free().
+ */
+void json_arena_init(void)
+{
+	cJSON_Hooks hooks;
+
+	hooks.malloc_fn = json_malloc;
+	hooks.free_fn = json_free;
+	cJSON_InitHooks(&hooks);
+}
+
+/*
+ * json_arena_new
+ *
+ * Return an empty arena, not in use on any thread.  Returns NULL if
+ * none could be allocated.
+ */
+struct json_arena *json_arena_new(void)
+{
+	struct json_arena *a;
+
+	pthread_mutex_lock(&ja_lock);
+	a = ja_pool;
+	if (a) {
+		ja_pool = a->next;
+		ja_pool_cnt--;
+	}
+	pthread_mutex_unlock(&ja_lock);
+
+	if (a == NULL)
+		a = calloc(1, sizeof(struct json_arena));
+
+	return a;
+}
+
+/*
+ * json_arena_begin
+ *
+ * Start allocating cJSON memory on this thread from an arena.  Scopes
+ * may be nested.  Returns the arena, or NULL if none could be
+ * allocated, in which case cJSON memory comes from the heap as usual.
+ */
+struct json_arena *json_arena_begin(void)
+{
+	struct json_arena *a;
+
+	a = json_arena_new();
+	if (a == NULL)
+		return NULL;
+
+	a->prev = ja_current;
+	ja_current = a;
+
+	return a;
+}
+
+/*
+ * json_arena_alloc
+ *
+ * Allocate size bytes from an arena, whether or not it is the
+ * current one.  The memory goes away when the arena is released.
+ */
+void *json_arena_alloc(struct json_arena *a, size_t size)
+{
+	return arena_alloc(a, ARENA_ROUND(size));
+}
+
+/*
+ * json_arena_leave
+ *
+ * Stop allocating from the arena but keep its memory.  Release it
+ * with json_arena_release().
+ */
+void json_arena_leave(struct json_arena *a)
+{
+	if (a == NULL)
+		return;
+
+	ja_current = a->prev;
+	a->prev = NULL;
+}
+
+/*
+ * json_arena_release
+ *
+ * Drop everything allocated from an arena that has been left.  This
+ * is a workq release function so it can be passed along with a
+ * message to the handler that owns it.
+ */
+void json_arena_release(void *args)
+{
+	struct json_arena *a = (struct json_arena *)args;
+
+	if (a == NULL)
+		return;
+
+	arena_reset(a);
+
+	pthread_mutex_lock(&ja_lock);
+	if (ja_pool_cnt < ARENA_POOL) {
+		a->next = ja_pool;
+		ja_pool = a;
+		ja_pool_cnt++;
+		a = NULL;
+	}
+	pthread_mutex_unlock(&ja_lock);
+
+	if (a) {
+		free(a->chunks);
+		free(a);
+	}
+}
+
+/*
+ * json_arena_end
+ *
+ * Leave the arena scope and drop everything allocated in it.
+ */
+void json_arena_end(struct json_arena *a)
+{
+	json_arena_leave(a);
+	json_arena_release(a);
+}
@@ -0,0 +1,245 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_coalesce.c
+ *
+ * Optional status coalescing.  When enabled (status_window > 0),
+ * driver status reports are held for up to status_window milliseconds.
+ * Only the latest value for each address/driver pair is kept and
+ * the pending reports are then sent to Polyglot in batches of up to
+ * status_batch entries as
+ *
+ *    {"status": [{"address": .., "driver": .., "value": .., "uom": ..}, ..]}
+ *
+ * A batch of one is sent using the normal single status message.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+#define COALESCE_BUCKETS 256
+
+struct pending_status {
+	char *address;
+	char *driver;
+	char *value;
+	int uom;
+	struct pending_status *hnext;   /* hash chain */
+	struct pending_status *next;    /* send order */
+};
+
+static pthread_mutex_t co_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t co_cond = PTHREAD_COND_INITIALIZER;
+static struct pending_status *co_table[COALESCE_BUCKETS];
+static struct pending_status *co_head;
+static struct pending_status *co_tail;
+static int co_running;
+
+static unsigned int co_hash(const char *address, const char *driver)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*address) {
+		hash ^= (unsigned char)*address++;
+		hash *= 16777619u;
+	}
+	hash ^= '/';
+	hash *= 16777619u;
+	while (*driver) {
+		hash ^= (unsigned char)*driver++;
+		hash *= 16777619u;
+	}
+
+	return hash % COALESCE_BUCKETS;
+}
+
+static void free_pending(struct pending_status *p)
+{
+	free(p->address);
+	free(p->driver);
+	free(p->value);
+	free(p);
+}
+
+/*
+ * Send a list of pending status reports in batches and free them.
+ */
+static void send_pending(struct pending_status *list)
+{
+	struct pending_status *p;
+	struct msgbuf *mb;
+	int cnt;
+
+	while (list) {
+		if (list->next == NULL || poly->options.status_batch <= 1) {
+			p = list;
+			list = list->next;
+			msg_status(p->address, p->driver, p->value, p->uom);
+			free_pending(p);
+			continue;
+		}
+
+		mb = msg_buffer();
+		msg_literal(mb, "{\"status\":[");
+		for (cnt = 0; list && cnt < poly->options.status_batch; cnt++) {
+			p = list;
+			list = list->next;
+			if (cnt)
+				msg_literal(mb, ",");
+			msg_append_status(mb, p->address, p->driver, p->value, p->uom);
+			free_pending(p);
+		}
+		msg_literal(mb, "]");
+		msg_send(mb);
+	}
+}
+
+static void *coalesce_thread(void *args)
+{
+	struct pending_status *list;
+	struct timespec deadline;
+	long window = poly->options.status_window;
+	(void)args;
+
+	pthread_mutex_lock(&co_lock);
+	for (;;) {
+		while (co_head == NULL)
+			pthread_cond_wait(&co_cond, &co_lock);
+
+		/* Collect updates for one window, then send them all */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += window / 1000;
+		deadline.tv_nsec += (window % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (pthread_cond_timedwait(&co_cond, &co_lock, &deadline) != ETIMEDOUT)
+			;
+
+		list = co_head;
+		co_head = NULL;
+		co_tail = NULL;
+		memset(co_table, 0, sizeof(co_table));
+		pthread_mutex_unlock(&co_lock);
+
+		send_pending(list);
+
+		pthread_mutex_lock(&co_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * coalesce_start
+ *
+ * Start the coalescing thread if status_window is set.
+ */
+int coalesce_start(void)
+{
+	pthread_t thread;
+
+	if (poly->options.status_window <= 0)
+		return 0;
+
+	if (pthread_create(&thread, NULL, coalesce_thread, NULL) != 0) {
+		loggerf(ERROR, "Failed to start status coalescing thread (%d)\n", errno);
+		return -1;
+	}
+	pthread_detach(thread);
+	co_running = 1;
+
+	return 0;
+}
+
+/*
+ * coalesce_status
+ *
+ * Queue a driver status report.  If there is already a pending
+ * report for the same address and driver, its value is replaced.
+ *
+ * Returns 0 if the report was queued or -1 if coalescing is not
+ * enabled and the caller should send the report itself.
+ */
+int coalesce_status(const char *address, const char *driver,
+		const char *value, int uom)
+{
+	struct pending_status *p;
+	unsigned int h;
+	char *v;
+
+	if (!co_running)
+		return -1;
+
+	v = strdup(value);
+	if (v == NULL)
+		return -1;
+
+	h = co_hash(address, driver);
+
+	pthread_mutex_lock(&co_lock);
+	for (p = co_table[h]; p; p = p->hnext) {
+		if (strcmp(p->address, address) == 0 &&
+				strcmp(p->driver, driver) == 0) {
+			free(p->value);
+			p->value = v;
+			p->uom = uom;
+			pthread_mutex_unlock(&co_lock);
+			return 0;
+		}
+	}
+
+	p = calloc(1, sizeof(struct pending_status));
+	if (p == NULL || (p->address = strdup(address)) == NULL ||
+			(p->driver = strdup(driver)) == NULL) {
+		pthread_mutex_unlock(&co_lock);
+		if (p)
+			free_pending(p);
+		free(v);
+		return -1;
+	}
+	p->value = v;
+	p->uom = uom;
+
+	p->hnext = co_table[h];
+	co_table[h] = p;
+	if (co_tail)
+		co_tail->next = p;
+	else
+		co_head = p;
+	co_tail = p;
+
+	pthread_cond_signal(&co_cond);
+	pthread_mutex_unlock(&co_lock);
+
+	return 0;
+}
@@ -0,0 +1,460 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_config.c
+ *
+ * The config from Polyglot is parsed once, when the config message
+ * arrives, into a snapshot.  The snapshot holds the parsed tree, the
+ * config text handed to onConfig and getConfig, and a hash index for
+ * each of customParams, customData, notices and nodes (by address).
+ *
+ * A snapshot never changes once it is published.  Readers take a
+ * reference with config_get() and drop it with config_put(); a new
+ * config replaces the current snapshot and the old one is freed when
+ * its last reader is done with it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+static const char *section_names[CFG_SECTIONS] = {
+	"customParams",
+	"customData",
+	"notices",
+	"nodes",
+};
+
+struct config_entry {
+	const char *key;
+	const char *value;
+	char *printed;        /* value of a non-string item, owned */
+};
+
+struct config_map {
+	struct config_entry *entries;
+	int count;
+	int *index;           /* open addressed, entry + 1, 0 = empty */
+	unsigned int size;
+};
+
+struct config {
+	int refs;
+	cJSON *tree;
+	char *text;
+	struct config_map maps[CFG_SECTIONS];
+};
+
+static pthread_rwlock_t cfg_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct config *cfg_current;
+
+static unsigned int key_hash(const char *key)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void map_free(struct config_map *m)
+{
+	int i;
+
+	for (i = 0; i < m->count; i++)
+		cJSON_free(m->entries[i].printed);
+	free(m->entries);
+	free(m->index);
+}
+
+/*
+ * Index the members of a config object.  Duplicate keys keep the
+ * first one, which is what a scan of the object would find.
+ */
+static int map_build(struct config_map *m, cJSON *obj)
+{
+	struct config_entry *e;
+	unsigned int i;
+	cJSON *item;
+	int cnt = 0;
+
+	cJSON_ArrayForEach(item, obj)
+		cnt++;
+	if (cnt == 0)
+		return 0;
+
+	m->size = 8;
+	while (m->size < (unsigned int)cnt * 2)
+		m->size *= 2;
+	m->entries = calloc(cnt, sizeof(struct config_entry));
+	m->index = calloc(m->size, sizeof(int));
+	if (m->entries == NULL || m->index == NULL)
+		return -1;
+
+	cJSON_ArrayForEach(item, obj) {
+		e = &m->entries[m->count];
+		if (cJSON_IsArray(obj)) {
+			/* nodes, keyed by address */
+			e->key = cJSON_GetStringValue(
+					cJSON_GetObjectItemCaseSensitive(item, "address"));
+		} else {
+			e->key = item->string;
+		}
+		if (e->key == NULL || config_find(m, e->key)) {
+			e->key = NULL;
+			continue;
+		}
+
+		if (cJSON_IsString(item)) {
+			e->value = item->valuestring;
+		} else {
+			e->printed = cJSON_PrintUnformatted(item);
+			e->value = e->printed;
+		}
+
+		i = key_hash(e->key) & (m->size - 1);
+		while (m->index[i])
+			i = (i + 1) & (m->size - 1);
+		m->index[i] = ++m->count;
+	}
+
+	return 0;
+}
+
+static void config_free(struct config *c)
+{
+	int s;
+
+	for (s = 0; s < CFG_SECTIONS; s++)
+		map_free(&c->maps[s]);
+	cJSON_Delete(c->tree);
+	cJSON_free(c->text);
+	free(c);
+}
+
+/*
+ * config_set
+ *
+ * Publish a new config snapshot built from tree.  The snapshot takes
+ * ownership of tree.  Returns 0 on success or -1 on failure, in which
+ * case tree has been freed and the previous config is kept.
+ */
+int config_set(cJSON *tree)
+{
+	struct config *c, *old;
+	int s;
+
+	c = calloc(1, sizeof(struct config));
+	if (c == NULL) {
+		cJSON_Delete(tree);
+		return -1;
+	}
+	c->refs = 1;
+	c->tree = tree;
+	c->text = cJSON_Print(tree);
+	if (c->text == NULL)
+		goto fail;
+
+	for (s = 0; s < CFG_SECTIONS; s++) {
+		if (map_build(&c->maps[s],
+				cJSON_GetObjectItemCaseSensitive(tree, section_names[s])) != 0)
+			goto fail;
+	}
+
+	pthread_rwlock_wrlock(&cfg_lock);
+	old = cfg_current;
+	cfg_current = c;
+	pthread_rwlock_unlock(&cfg_lock);
+
+	if (old)
+		config_put(old);
+
+	return 0;
+
+fail:
+	logger(ERROR, "Failed to allocate memory for config\n");
+	config_free(c);
+	return -1;
+}
+
+/*
+ * config_get
+ *
+ * Return a reference to the current config snapshot, or NULL if no
+ * config has been received.  Release it with config_put().
+ */
+struct config *config_get(void)
+{
+	struct config *c;
+
+	pthread_rwlock_rdlock(&cfg_lock);
+	c = cfg_current;
+	if (c)
+		__sync_fetch_and_add(&c->refs, 1);
+	pthread_rwlock_unlock(&cfg_lock);
+
+	return c;
+}
+
+void config_put(struct config *c)
+{
+	if (c && __sync_sub_and_fetch(&c->refs, 1) == 0)
+		config_free(c);
+}
+
+/*
+ * workq release function for a config reference.
+ */
+void config_release(void *args)
+{
+	config_put((struct config *)args);
+}
+
+const char *config_text(struct config *c)
+{
+	return c->text;
+}
+
+cJSON *config_tree(struct config *c)
+{
+	return c->tree;
+}
+
+struct config_map *config_section(struct config *c, int section)
+{
+	return &c->maps[section];
+}
+
+/*
+ * config_find
+ *
+ * Look up a key in one section of the config.  Returns the value or
+ * NULL.  The value belongs to the snapshot.
+ */
+const char *config_find(struct config_map *m, const char *key)
+{
+	unsigned int i;
+	int e;
+
+	if (m->count == 0)
+		return NULL;
+
+	for (i = key_hash(key) & (m->size - 1); (e = m->index[i]) != 0;
+			i = (i + 1) & (m->size - 1)) {
+		if (strcmp(m->entries[e - 1].key, key) == 0)
+			return m->entries[e - 1].value;
+	}
+
+	return NULL;
+}
+
+/*
+ * config_lookup
+ *
+ * Return a copy of the value for key in a section of the current
+ * config, or NULL.  The caller frees the copy.
+ */
+char *config_lookup(int section, const char *key)
+{
+	struct config *c;
+	const char *v;
+	char *value = NULL;
+
+	c = config_get();
+	if (c == NULL)
+		return NULL;
+
+	v = config_find(&c->maps[section], key);
+	if (v)
+		value = strdup(v);
+	config_put(c);
+
+	return value;
+}
+
+/*
+ * config_pairs
+ *
+ * Return a section of the current config as a list of pairs.  The
+ * caller frees the list with freeCustomPairs().
+ */
+struct pair *config_pairs(int section)
+{
+	struct config_map *m;
+	struct config *c;
+	struct pair *p = NULL;
+	struct pair *tmp;
+	int i;
+
+	c = config_get();
+	if (c == NULL)
+		return NULL;
+
+	m = &c->maps[section];
+	for (i = 0; i < m->count; i++) {
+		tmp = malloc(sizeof(struct pair));
+		if (tmp == NULL)
+			break;
+		tmp->key = strdup(m->entries[i].key);
+		tmp->value = strdup(m->entries[i].value ? m->entries[i].value : "");
+		tmp->flags = 0;
+		tmp->next = p;
+		p = tmp;
+	}
+	config_put(c);
+
+	return p;
+}
+
+static int add_pair(struct pair **list, const char *key,
+		const char *value, int flags)
+{
+	struct pair *p;
+
+	p = malloc(sizeof(struct pair));
+	if (p == NULL)
+		return -1;
+	p->key = strdup(key);
+	p->value = strdup(value ? value : "");
+	p->flags = flags;
+	p->next = *list;
+	*list = p;
+
+	return 0;
+}
+
+/*
+ * Compare a section of two snapshots and list the differences.
+ */
+static void map_diff(struct config_map *old, struct config_map *m,
+		struct pair **list, int *cnt)
+{
+	const char *v;
+	int i;
+
+	for (i = m->count - 1; i >= 0; i--) {
+		v = old ? config_find(old, m->entries[i].key) : NULL;
+		if (v == NULL) {
+			add_pair(list, m->entries[i].key, m->entries[i].value,
+					PARAMETER_ADDED);
+			(*cnt)++;
+		} else if (strcmp(v, m->entries[i].value ? m->entries[i].value : "") != 0) {
+			add_pair(list, m->entries[i].key, m->entries[i].value,
+					PARAMETER_CHANGED);
+			(*cnt)++;
+		}
+	}
+
+	for (i = old ? old->count - 1 : -1; i >= 0; i--) {
+		if (config_find(m, old->entries[i].key) == NULL) {
+			add_pair(list, old->entries[i].key, old->entries[i].value,
+					PARAMETER_REMOVED);
+			(*cnt)++;
+		}
+	}
+}
+
+/* A delta and the reference to the config it points at */
+struct delta_ref {
+	struct config_delta delta;
+	struct config *c;
+};
+
+/*
+ * config_diff
+ *
+ * Build the list of differences between old (which may be NULL) and
+ * c.  Returns NULL if nothing changed.  The delta holds a reference
+ * to c; free it with config_delta_free().
+ */
+struct config_delta *config_diff(struct config *old, struct config *c)
+{
+	struct delta_ref *dr;
+	int cnt = 0;
+
+	dr = calloc(1, sizeof(struct delta_ref));
+	if (dr == NULL)
+		return NULL;
+
+	map_diff(old ? &old->maps[CFG_PARAMS] : NULL, &c->maps[CFG_PARAMS],
+			&dr->delta.customParams, &cnt);
+	map_diff(old ? &old->maps[CFG_DATA] : NULL, &c->maps[CFG_DATA],
+			&dr->delta.customData, &cnt);
+	map_diff(old ? &old->maps[CFG_NOTICES] : NULL, &c->maps[CFG_NOTICES],
+			&dr->delta.notices, &cnt);
+	map_diff(old ? &old->maps[CFG_NODES] : NULL, &c->maps[CFG_NODES],
+			&dr->delta.nodes, &cnt);
+
+	if (cnt == 0) {
+		free(dr);
+		return NULL;
+	}
+
+	__sync_fetch_and_add(&c->refs, 1);
+	dr->c = c;
+	dr->delta.config = c->text;
+
+	return &dr->delta;
+}
+
+/*
+ * workq release function for a config delta.
+ */
+void config_delta_free(void *args)
+{
+	struct delta_ref *dr = (struct delta_ref *)args;
+
+	freeCustomPairs(dr->delta.customParams);
+	freeCustomPairs(dr->delta.customData);
+	freeCustomPairs(dr->delta.notices);
+	freeCustomPairs(dr->delta.nodes);
+	config_put(dr->c);
+	free(dr);
+}
+
+/*
+ * config_keys
+ *
+ * Call fn for every key in a section of the current config.
+ */
+void config_keys(int section, void (*fn)(char *key))
+{
+	struct config_map *m;
+	struct config *c;
+	int i;
+
+	c = config_get();
+	if (c == NULL)
+		return;
+
+	m = &c->maps[section];
+	for (i = 0; i < m->count; i++)
+		fn((char *)m->entries[i].key);
+	config_put(c);
+}
@@ -0,0 +1,183 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_connect.c
+ *
+ * Connection manager.  This runs the transport's network loop in its
+ * own thread (instead of mosquitto_loop_start) so that a dropped
+ * connection can be retried with a jittered exponential backoff: the
+ * delay doubles on each failed attempt from reconnect_min up to
+ * reconnect_max and a random amount of up to half the delay is taken
+ * off so a group of node servers don't all hit the broker at the same
+ * moment.
+ *
+ * After a reconnect, all nodes are registered with Polyglot again and
+ * their current driver values re-sent.  The time from the reconnect
+ * until all of that has been published is logged as the resync time.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+#define RESYNC_TIMEOUT 60000   /* ms to wait for the resync to be sent */
+
+/* Only used from the network thread */
+static int conn_attempt;
+static int conn_count;
+static unsigned int conn_seed;
+
+static struct timespec conn_lost_at;
+static struct timespec conn_up_at;
+
+static long elapsed_ms(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * Delay before the next connection attempt.
+ */
+static long backoff_delay(int attempt)
+{
+	long delay = poly->options.reconnect_min;
+
+	while (attempt-- > 0 && delay < poly->options.reconnect_max)
+		delay *= 2;
+	if (delay > poly->options.reconnect_max)
+		delay = poly->options.reconnect_max;
+
+	return delay - (rand_r(&conn_seed) % (delay / 2 + 1));
+}
+
+static void *conn_thread(void *args)
+{
+	struct iface_transport *t = poly->options.transport;
+	long delay;
+	int ret;
+	(void)args;
+
+	for (;;) {
+		ret = t->loop(t, 1000);
+		if (ret == 0)
+			continue;
+
+		delay = backoff_delay(conn_attempt++);
+		loggerf(WARNING, "MQTT connection down (%s), retry %d in %ld ms\n",
+				t->strerror(ret), conn_attempt, delay);
+		usleep(delay * 1000);
+
+		ret = t->reconnect(t);
+		if (ret != 0)
+			loggerf(ERROR, "MQTT reconnect failed: %s\n",
+					t->strerror(ret));
+	}
+
+	return NULL;
+}
+
+/*
+ * Re-register all nodes and send their driver values, then wait
+ * for it all to be published and log how long it took.
+ */
+static void *conn_resync(void *args)
+{
+	struct timespec done;
+	unsigned long mark;
+	int cnt;
+	(void)args;
+
+	cnt = node_resync();
+	mark = outq_mark();
+	if (outq_wait(mark, RESYNC_TIMEOUT) != 0) {
+		loggerf(WARNING, "Resync of %d nodes not sent after %d ms\n",
+				cnt, RESYNC_TIMEOUT);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &done);
+	poly->resync_ms = elapsed_ms(&conn_up_at, &done);
+	loggerf(INFO, "Resync of %d nodes took %ld ms (offline %ld ms)\n",
+			cnt, poly->resync_ms, poly->offline_ms);
+
+	return NULL;
+}
+
+/*
+ * conn_start
+ *
+ * Start the thread that runs the MQTT network loop.
+ */
+int conn_start(void)
+{
+	pthread_t thread;
+
+	conn_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+	if (pthread_create(&thread, NULL, conn_thread, NULL) != 0) {
+		loggerf(ERROR, "Failed to start MQTT network thread (%d)\n", errno);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * conn_up
+ *
+ * Called once the connection to the broker is established.  If this
+ * is a reconnect, start the node resync.
+ */
+void conn_up(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &conn_up_at);
+	conn_attempt = 0;
+
+	if (conn_count++ == 0)
+		return;
+
+	poly->reconnects++;
+	poly->offline_ms = elapsed_ms(&conn_lost_at, &conn_up_at);
+	if (workq_submit(poly->workers, conn_resync, NULL, NULL, NULL) != 0)
+		logger(ERROR, "Failed to queue node resync\n");
+}
+
+/*
+ * conn_down
+ *
+ * Called when the connection to the broker is lost.
+ */
+void conn_down(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &conn_lost_at);
+}
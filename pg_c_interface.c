@@ -33,12 +33,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <mosquitto.h>
 #include "cJSON.h"
 #include "c_interface.h"
 #include "c_int_interface.h"
 
-extern struct mosquitto *mosq;
 extern struct profile *poly;
 
 /*
@@ -63,10 +61,16 @@ int isConnected(void)
  */
 char *getConfig(void)
 {
-	// Need to store the config somewhere. We've been storing it in profile,
-	// but that's just something we're passing around the mqtt functions
-	// should we maintain a global pointer to this also?
-	return strdup(poly->config);
+	struct config *c;
+	char *text;
+
+	c = config_get();
+	if (c == NULL)
+		return NULL;
+	text = strdup(config_text(c));
+	config_put(c);
+
+	return text;
 }
 
 /*
@@ -85,21 +89,30 @@ char *getConfig(void)
 
 static int _save_data(const char *key, struct pair *params, int add)
 {
-	cJSON *cfg;
-	cJSON *c_params;
+	struct json_arena *arena;
+	struct config *cfg = NULL;
+	cJSON *c_params = NULL;
 	cJSON *obj;
 	int i;
 
-	if (add) {
-		cfg = cJSON_Parse(poly->config);
-		c_params = cJSON_DetachItemFromObject(cfg, "customParams");
-	} else {
+	arena = json_arena_begin();
+	if (add && (cfg = config_get()) != NULL) {
+		c_params = cJSON_Duplicate(
+				cJSON_GetObjectItemCaseSensitive(config_tree(cfg), key), 1);
+		config_put(cfg);
+	}
+	if (!cJSON_IsObject(c_params)) {
+		cJSON_Delete(c_params);
 		c_params = cJSON_CreateObject();
 	}
 
 	while (params) {
-		// Create a new object and add it to c_params?
-		cJSON_AddStringToObject(c_params, params->key, params->value);
+		// Replace the value if the key is already there
+		if (cJSON_HasObjectItem(c_params, params->key))
+			cJSON_ReplaceItemInObjectCaseSensitive(c_params, params->key,
+					cJSON_CreateString(params->value));
+		else
+			cJSON_AddStringToObject(c_params, params->key, params->value);
 		params = params->next;
 	}
 
@@ -113,60 +126,42 @@ static int _save_data(const char *key, struct pair *params, int add)
 	/* Send new c_params object to Polyglot */
 	obj = cJSON_CreateObject();
 	cJSON_AddItemToObject(obj, key, c_params);
-	loggerf(DEBUG, "Sending %s\n", cJSON_Print(obj));
+	if (logger_on(LOGSYS_CONFIG, DEBUG)) {
+		char *text = cJSON_Print(obj);
+
+		loggerf_sub(LOGSYS_CONFIG, DEBUG, "Sending %s\n", text);
+		cJSON_free(text);
+	}
 	poly_send(obj);
 	cJSON_Delete(obj);
-
-	if (add)
-		cJSON_Delete(cfg);
+	json_arena_end(arena);
 
 	return 0;
 }
 
-static char *_get_data(const char *dtype, char *key)
-{
-	cJSON *cfg;
-	cJSON *params;
-	cJSON *item;
-	char *value = NULL;
-	int i;
-
-	cfg = cJSON_Parse(poly->config);
-	params = cJSON_GetObjectItem(cfg, dtype);
-	if (cJSON_IsObject(params)) {
-		for (i = 0; i < cJSON_GetArraySize(params); i++) {
-			item = cJSON_GetArrayItem(params, i);
-			if (strcmp(item->string, key) == 0) {
-				value = strdup(item->valuestring);
-			}
-		}
-	}
-
-	cJSON_Delete(cfg);
-
-	return value;
-}
-
 static int _remove_data(const char *dtype, char *key)
 {
-	cJSON *cfg;
+	struct json_arena *arena;
+	struct config *cfg;
 	cJSON *item;
 	cJSON *update;
 	cJSON *params;
 	cJSON *obj;
 	int i;
 
-	cfg = cJSON_Parse(poly->config);
+	cfg = config_get();
 
+	arena = json_arena_begin();
 	update = cJSON_CreateObject();
-	params = cJSON_DetachItemFromObject(cfg, dtype);
+	params = cfg ? cJSON_GetObjectItemCaseSensitive(config_tree(cfg), dtype) : NULL;
 	if (cJSON_IsObject(params)) {
-		for (i = 0; i < cJSON_GetArraySize(params); i++) {
-			item = cJSON_GetArrayItem(params, i);
+		cJSON_ArrayForEach(item, params) {
 			if (strcmp(item->string, key) != 0)
-				cJSON_AddStringToObject(update, item->string, item->valuestring);
+				cJSON_AddItemToObject(update, item->string,
+						cJSON_Duplicate(item, 1));
 		}
 	}
+	config_put(cfg);
 
 	i = 0;
 	while (dtype[i]) {
@@ -177,11 +172,15 @@ static int _remove_data(const char *dtype, char *key)
 	/* Send updated object to Polyglot */
 	obj = cJSON_CreateObject();
 	cJSON_AddItemToObject(obj, dtype, update);
-	loggerf(DEBUG, "Updating %s = %s\n", dtype, cJSON_Print(obj));
+	if (logger_on(LOGSYS_CONFIG, DEBUG)) {
+		char *text = cJSON_Print(obj);
+
+		loggerf_sub(LOGSYS_CONFIG, DEBUG, "Updating %s = %s\n", dtype, text);
+		cJSON_free(text);
+	}
 	poly_send(obj);
 	cJSON_Delete(obj);
-	cJSON_Delete(update);
-	cJSON_Delete(cfg);
+	json_arena_end(arena);
 
 	return 0;
 }
@@ -201,33 +200,12 @@ void freeCustomPairs(struct pair *params)
 
 struct pair *getCustomParams(void)
 {
-	cJSON *cfg;
-	cJSON *params;
-	cJSON *item;
-	struct pair *p = NULL;
-	struct pair *tmp;
-	int i;
+	struct pair *p;
 
 	// Pull this from existing config structure
-	cfg = cJSON_Parse(poly->config);
-	params = cJSON_GetObjectItem(cfg, "customParams");
-
-	// params is a list of objects, not an array, how do we iterate this?
-	if (cJSON_IsObject(params)) {
-		for (i = 0; i < cJSON_GetArraySize(params); i++) {
-			item = cJSON_GetArrayItem(params, i);
-			tmp = malloc(sizeof(struct pair));
-			tmp->key = strdup(item->string);
-			tmp->value = strdup(item->valuestring);
-			tmp->flags = 0;
-			tmp->next = p;
-			p = tmp;
-		}
-	} else {
+	p = config_pairs(CFG_PARAMS);
+	if (p == NULL)
 		logger(ERROR, "No customParams available.\n");
-	}
-
-	cJSON_Delete(cfg);
 
 	return p;
 }
@@ -239,7 +217,7 @@ struct pair *getCustomParams(void)
  */
 char *getCustomParam(char *key)
 {
-	return _get_data("customParams", key);
+	return config_lookup(CFG_PARAMS, key);
 }
 
 /*
@@ -304,7 +282,7 @@ int addCustomData(struct pair *params)
  */
 char *getCustomData(char *key)
 {
-	return _get_data("customData", key);
+	return config_lookup(CFG_DATA, key);
 }
 
 /*
@@ -0,0 +1,180 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_intern.c
+ *
+ * Interned driver and command names.  Each distinct name (ST, GV1,
+ * DON, ...) gets a small integer handle the first time it is seen.
+ * Handles are shared by all nodes, so a node server can look up the
+ * handle for a driver once and use it for every node.
+ *
+ * Names are never removed, so a handle stays valid for the life of
+ * the process.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define INTERN_MIN 64
+
+static pthread_rwlock_t in_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char **in_names;       /* handle -> name */
+static int in_cnt;
+static int in_alloc;
+static int *in_table;         /* open addressed, handle + 1, 0 = empty */
+static unsigned int in_size;
+
+static unsigned int name_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Caller must hold in_lock */
+static int lookup(const char *name)
+{
+	unsigned int i;
+
+	if (in_size == 0)
+		return -1;
+
+	for (i = name_hash(name) & (in_size - 1); in_table[i];
+			i = (i + 1) & (in_size - 1)) {
+		if (strcmp(in_names[in_table[i] - 1], name) == 0)
+			return in_table[i] - 1;
+	}
+
+	return -1;
+}
+
+/* Caller must hold in_lock for writing */
+static int table_grow(void)
+{
+	unsigned int size;
+	unsigned int i;
+	int *t;
+	int id;
+
+	size = in_size ? in_size * 2 : INTERN_MIN;
+	t = calloc(size, sizeof(int));
+	if (t == NULL)
+		return -1;
+
+	for (id = 0; id < in_cnt; id++) {
+		i = name_hash(in_names[id]) & (size - 1);
+		while (t[i])
+			i = (i + 1) & (size - 1);
+		t[i] = id + 1;
+	}
+
+	free(in_table);
+	in_table = t;
+	in_size = size;
+
+	return 0;
+}
+
+/*
+ * intern_find
+ *
+ * Return the handle for a name, or -1 if the name hasn't been seen.
+ */
+int intern_find(const char *name)
+{
+	int id;
+
+	pthread_rwlock_rdlock(&in_lock);
+	id = lookup(name);
+	pthread_rwlock_unlock(&in_lock);
+
+	return id;
+}
+
+/*
+ * intern_id
+ *
+ * Return the handle for a name, adding it if it is new.  Returns -1
+ * if memory could not be allocated.
+ */
+int intern_id(const char *name)
+{
+	unsigned int i;
+	char **names;
+	int id;
+
+	id = intern_find(name);
+	if (id >= 0)
+		return id;
+
+	pthread_rwlock_wrlock(&in_lock);
+	id = lookup(name);
+	if (id >= 0)
+		goto out;
+
+	if ((unsigned int)(in_cnt + 1) * 2 > in_size && table_grow() != 0)
+		goto out;
+
+	if (in_cnt == in_alloc) {
+		names = realloc(in_names, (in_alloc ? in_alloc * 2 : INTERN_MIN) *
+				sizeof(char *));
+		if (names == NULL)
+			goto out;
+		in_names = names;
+		in_alloc = in_alloc ? in_alloc * 2 : INTERN_MIN;
+	}
+
+	in_names[in_cnt] = strdup(name);
+	if (in_names[in_cnt] == NULL)
+		goto out;
+
+	i = name_hash(name) & (in_size - 1);
+	while (in_table[i])
+		i = (i + 1) & (in_size - 1);
+	in_table[i] = in_cnt + 1;
+	id = in_cnt++;
+
+out:
+	pthread_rwlock_unlock(&in_lock);
+	return id;
+}
+
+/*
+ * getHandle
+ *
+ * Return the handle for a driver or command name, for use with
+ * setDriverH() and the other handle based functions.
+ */
+int getHandle(char *name)
+{
+	return intern_id(name);
+}
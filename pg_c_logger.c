@@ -27,6 +27,14 @@
  * messages to the node server's log/debug.log file.  If it is
  * not able to open the log file, messages will be sent to stderr
  * instead.
+ *
+ * In async mode (logger_set_async) the calling thread only formats
+ * the message into a slot of a lock-free ring and a writer thread
+ * does the file I/O, in batches.  The ring is a bounded multi
+ * producer queue: each slot has a sequence number that says whether
+ * it is free for the producer at that position or holds a message
+ * for the writer.  When the ring is full, messages are dropped and
+ * counted rather than making the caller wait.
  */
 #include <stdio.h>
 #include <errno.h>
@@ -38,17 +46,40 @@
 #include <sys/time.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <mosquitto.h>
 #include "cJSON.h"
 #include "c_interface.h"
+#include "c_int_interface.h"
 
 static FILE *log;
 static int debuglog = 1;
 static struct tm _logging_day;
 
+#define LOG_SLOT   512     /* bytes per ring slot, longer lines are cut */
+#define LOG_BATCH  (64 * 1024)
+#define LOG_IDLE   100     /* max ms a message waits for the writer */
+
+struct log_slot {
+	unsigned long seq;
+	int len;
+	char text[LOG_SLOT - sizeof(unsigned long) - sizeof(int)];
+};
+
+static struct log_slot *lg_ring;    /* NULL = synchronous logging */
+static unsigned long lg_mask;
+static unsigned long lg_head;       /* next slot for a producer */
+static unsigned long lg_tail;       /* next slot for the writer */
+static unsigned long lg_dropped;
+static int lg_sleeping;
+static struct sigaction lg_old[5];
+static const int lg_signals[5] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+static pthread_mutex_t lg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lg_cond = PTHREAD_COND_INITIALIZER;
+
 static void _rotate_log(void)
 {
 	struct tm *now;
@@ -98,7 +129,7 @@ void initialize_logging(void)
 	struct stat logs;
 	time_t t;
 
-	log_level = INFO;
+	logger_set_level(INFO);
 
 	/* Check for existance of "logs" subdirectory */
 	if (stat("logs", &logs) != 0) {
@@ -124,23 +155,333 @@ void initialize_logging(void)
 }
 
 /*
- * Output a simple log message to the log. The message is only
- * output if the messages level is at or below the currently set
- * log_level.
+ * Claim a ring slot.  Returns NULL if the ring is full.
  */
-void logger(enum LOGLEVELS level, const char *msg)
+static struct log_slot *log_claim(unsigned long *pos)
 {
-	if (log && (level <= log_level)) {
-		_rotate_log();
-		fprintf(log, "%s", msg);
+	struct log_slot *s;
+	unsigned long p, seq;
+
+	p = __atomic_load_n(&lg_head, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &lg_ring[p & lg_mask];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq == p) {
+			if (__atomic_compare_exchange_n(&lg_head, &p, p + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - p) < 0) {
+			__atomic_fetch_add(&lg_dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			p = __atomic_load_n(&lg_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	*pos = p;
+	return s;
+}
+
+/*
+ * Hand a filled slot to the writer.
+ */
+static void log_publish(struct log_slot *s, unsigned long pos, int len)
+{
+	if (len < 0)
+		len = 0;
+	if (len >= (int)sizeof(s->text)) {
+		/* cut, but keep the line ending */
+		len = sizeof(s->text) - 1;
+		s->text[len - 1] = '\n';
+	}
+	s->len = len;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&lg_sleeping, __ATOMIC_RELAXED))
+		pthread_cond_signal(&lg_cond);
+}
+
+/*
+ * Take the next message from the ring, if there is one.  Only the
+ * writer (or the crash handler, once the writer can't run) does this.
+ */
+static struct log_slot *log_next(void)
+{
+	struct log_slot *s = &lg_ring[lg_tail & lg_mask];
+
+	if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != lg_tail + 1)
+		return NULL;
+	return s;
+}
+
+static void log_release(struct log_slot *s)
+{
+	__atomic_store_n(&s->seq, lg_tail + lg_mask + 1, __ATOMIC_RELEASE);
+	lg_tail++;
+}
+
+static void log_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Write everything in the ring.  Returns the number of messages
+ * written.
+ */
+static int log_drain(char *batch)
+{
+	static unsigned long reported;
+	struct log_slot *s;
+	unsigned long dropped;
+	size_t len = 0;
+	int cnt = 0;
+	int fd;
+
+	_rotate_log();
+	fd = log ? fileno(log) : STDERR_FILENO;
+
+	dropped = __atomic_load_n(&lg_dropped, __ATOMIC_RELAXED);
+	if (dropped != reported) {
+		len = snprintf(batch, LOG_BATCH, "[%lu log messages dropped]\n",
+				dropped - reported);
+		reported = dropped;
+	}
+
+	while ((s = log_next()) != NULL) {
+		if (len + s->len > LOG_BATCH) {
+			log_write(fd, batch, len);
+			if (debuglog && fd != STDERR_FILENO)
+				log_write(STDERR_FILENO, batch, len);
+			len = 0;
+		}
+		memcpy(batch + len, s->text, s->len);
+		len += s->len;
+		log_release(s);
+		cnt++;
+	}
+
+	if (len) {
+		log_write(fd, batch, len);
+		if (debuglog && fd != STDERR_FILENO)
+			log_write(STDERR_FILENO, batch, len);
+	}
+
+	return cnt;
+}
+
+static void *log_thread(void *args)
+{
+	struct timespec deadline;
+	char *batch;
+	(void)args;
+
+	batch = malloc(LOG_BATCH);
+	if (batch == NULL)
+		return NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&lg_lock);
+		if (log_drain(batch) == 0) {
+			__atomic_store_n(&lg_sleeping, 1, __ATOMIC_SEQ_CST);
+			if (log_next() == NULL) {
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_nsec += LOG_IDLE * 1000000L;
+				if (deadline.tv_nsec >= 1000000000) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&lg_cond, &lg_lock, &deadline);
+			}
+			__atomic_store_n(&lg_sleeping, 0, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&lg_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * On a crash, write out what is still in the ring with plain write()
+ * calls and then let the signal take its normal course.
+ */
+static void log_crash(int sig)
+{
+	struct log_slot *s;
+	int fd = log ? fileno(log) : STDERR_FILENO;
+	int i;
+
+	while ((s = log_next()) != NULL) {
+		log_write(fd, s->text, s->len);
+		log_release(s);
+	}
+
+	for (i = 0; i < 5; i++) {
+		if (lg_signals[i] == sig)
+			sigaction(sig, &lg_old[i], NULL);
+	}
+	raise(sig);
+}
+
+/*
+ * logger_flush
+ *
+ * Write out any log messages waiting in the async ring.
+ */
+void logger_flush(void)
+{
+	char *batch;
+
+	if (lg_ring == NULL)
+		return;
+
+	batch = malloc(LOG_BATCH);
+	if (batch == NULL)
+		return;
+	pthread_mutex_lock(&lg_lock);
+	log_drain(batch);
+	pthread_mutex_unlock(&lg_lock);
+	free(batch);
+}
+
+/*
+ * logger_set_async
+ *
+ * Switch to async logging with a ring of about bytes in size.  Log
+ * messages are written by a background thread; anything still in the
+ * ring is written at exit or when the process crashes.  Returns 0 on
+ * success or -1 if async logging could not be started.
+ */
+int logger_set_async(int bytes)
+{
+	struct log_slot *ring;
+	struct sigaction sa;
+	pthread_t thread;
+	unsigned long cnt = 16;
+	unsigned long i;
+
+	if (lg_ring)
+		return 0;
+
+	while (cnt * 2 * sizeof(struct log_slot) <= (unsigned long)bytes)
+		cnt *= 2;
+
+	ring = calloc(cnt, sizeof(struct log_slot));
+	if (ring == NULL)
+		return -1;
+	for (i = 0; i < cnt; i++)
+		ring[i].seq = i;
+	lg_mask = cnt - 1;
+
+	/* anything written so far is sent before the writer starts */
+	if (log)
 		fflush(log);
+	lg_ring = ring;
+
+	if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+		lg_ring = NULL;
+		free(ring);
+		fprintf(stderr, "Failed to start log writer thread (%d)\n", errno);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	atexit(logger_flush);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = log_crash;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < 5; i++)
+		sigaction(lg_signals[i], &sa, &lg_old[i]);
+
+	return 0;
+}
+
+/* Text log level for each subsystem */
+static int sub_level[LOGSYS_CNT] = { INFO, INFO, INFO, INFO, INFO };
+
+/* Highest level logged or traced for each subsystem, see logger_on() */
+int log_gate[LOGSYS_CNT] = { INFO, INFO, INFO, INFO, INFO };
+
+/*
+ * Recompute log_gate after a log or trace level change.
+ */
+void logger_update_gates(void)
+{
+	int s;
+
+	for (s = 0; s < LOGSYS_CNT; s++)
+		log_gate[s] = sub_level[s] > trace_level ? sub_level[s] : trace_level;
+}
+
+/*
+ * Write a message that is at or below limit to the log.  Messages
+ * above limit go to the trace log if it wants them and are otherwise
+ * dropped.
+ */
+static void log_vwrite(enum LOGLEVELS level, int limit, const char *fmt,
+		va_list args)
+{
+	struct log_slot *s;
+	unsigned long pos;
+	va_list copy;
+	int len;
+
+	if ((int)level > limit) {
+		if ((int)level <= trace_level)
+			trace_vrecord(level, fmt, args);
+		return;
+	}
+
+	if (lg_ring) {
+		if ((s = log_claim(&pos)) != NULL) {
+			len = vsnprintf(s->text, sizeof(s->text), fmt, args);
+			log_publish(s, pos, len);
+		}
+		return;
+	}
+
+	if (log) {
+		_rotate_log();
 		if (debuglog)
-			fprintf(stderr, "%s", msg);
+			va_copy(copy, args);
+		vfprintf(log, fmt, args);
+		fflush(log);
+		if (debuglog) {
+			vfprintf(stderr, fmt, copy);
+			va_end(copy);
+		}
 	} else {
-		fprintf(stderr, "%s", msg);
+		vfprintf(stderr, fmt, args);
 	}
 }
 
+static void log_print(enum LOGLEVELS level, int limit, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	log_vwrite(level, limit, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Output a simple log message to the log. The message is only
+ * output if the messages level is at or below the currently set
+ * log_level.
+ */
+void logger(enum LOGLEVELS level, const char *msg)
+{
+	log_print(level, log_level, "%s", msg);
+}
+
 /*
  * Output a formatted log message to the log. The message is only
  * output if the messages level is at or below the currently set
@@ -151,26 +492,44 @@ void loggerf(enum LOGLEVELS level, const char *fmt, ...)
 	va_list args;
 
 	va_start(args, fmt);
-	if (log && (level <= log_level)) {
-		_rotate_log();
-		vfprintf(log, fmt, args);
-		fflush(log);
-	} else {
-		vfprintf(stderr, fmt, args);
-	}
+	log_vwrite(level, log_level, fmt, args);
 	va_end(args);
+}
 
-	if (debuglog) {
-		va_start(args, fmt);
-		vfprintf(stderr, fmt, args);
-		va_end(args);
-	}
+/*
+ * Output a formatted log message for one subsystem.  The message is
+ * only output if its level is at or below the subsystem's level.
+ * Normally called through the LOGF() macro.
+ */
+void loggerf_sub(enum LOGSUBSYS subsys, enum LOGLEVELS level,
+		const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	log_vwrite(level, sub_level[subsys], fmt, args);
+	va_end(args);
 }
 
 /*
- * Change the log_level to a new level.
+ * Change the log_level to a new level.  This also sets the level of
+ * every subsystem.
  */
 void logger_set_level(enum LOGLEVELS new_level)
 {
+	int s;
+
 	log_level = new_level;
+	for (s = 0; s < LOGSYS_CNT; s++)
+		sub_level[s] = new_level;
+	logger_update_gates();
+}
+
+/*
+ * Change the log level of one subsystem.
+ */
+void logger_set_subsys_level(enum LOGSUBSYS subsys, enum LOGLEVELS level)
+{
+	sub_level[subsys] = level;
+	logger_update_gates();
 }
@@ -0,0 +1,270 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_loopback.c
+ *
+ * An in-process transport.  Instead of a broker, the program using
+ * the library plays the part of Polyglot: loopbackSend() delivers a
+ * message to the library on the caller's thread and everything the
+ * library publishes is handed to the function set with
+ * loopbackReceiver() on the library's sending thread.  Nothing is
+ * copied and there is no network, so tests are deterministic and
+ * load tests measure only the node server and the library.
+ *
+ * Like the MQTT client, the connection comes up from the library's
+ * network thread.  loopbackDisconnect() drops it, and the library's
+ * normal reconnect logic brings it back.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define LOOP_OK     0
+#define LOOP_DOWN   1
+
+enum loop_state {
+	LOOP_IDLE,         /* connect() not called yet */
+	LOOP_CONNECTING,   /* on_connect is called on the next loop() */
+	LOOP_UP,
+	LOOP_DROPPING,     /* on_disconnect is called on the next loop() */
+	LOOP_LOST,         /* waiting for reconnect() */
+};
+
+static pthread_mutex_t lb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lb_cond = PTHREAD_COND_INITIALIZER;
+static enum loop_state lb_state = LOOP_IDLE;
+static int lb_ready;                /* on_connect has run */
+static char lb_topic[64];
+
+static void (*lb_receiver)(const char *topic, const char *msg, int len,
+		void *arg);
+static void *lb_receiver_arg;
+
+static int lb_connect(struct iface_transport *t, const char *host, int port)
+{
+	(void)t;
+	(void)host;
+	(void)port;
+
+	pthread_mutex_lock(&lb_lock);
+	__atomic_store_n(&lb_state, LOOP_CONNECTING, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&lb_cond);
+	pthread_mutex_unlock(&lb_lock);
+
+	return LOOP_OK;
+}
+
+static int lb_reconnect(struct iface_transport *t)
+{
+	return lb_connect(t, NULL, 0);
+}
+
+/*
+ * Run the connection state changes on the network thread the way
+ * mosquitto_loop() does, otherwise wait up to timeout ms for one.
+ */
+static int lb_loop(struct iface_transport *t, int timeout)
+{
+	struct timespec ts;
+	enum loop_state state;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&lb_lock);
+	while (lb_state == LOOP_UP || lb_state == LOOP_IDLE)
+		if (pthread_cond_timedwait(&lb_cond, &lb_lock, &ts) == ETIMEDOUT)
+			break;
+
+	state = lb_state;
+	if (state == LOOP_CONNECTING)
+		__atomic_store_n(&lb_state, LOOP_UP, __ATOMIC_RELEASE);
+	else if (state == LOOP_DROPPING)
+		__atomic_store_n(&lb_state, LOOP_LOST, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lb_lock);
+
+	switch (state) {
+		case LOOP_CONNECTING:
+			t->on_connect(t);
+			pthread_mutex_lock(&lb_lock);
+			lb_ready = 1;
+			pthread_cond_broadcast(&lb_cond);
+			pthread_mutex_unlock(&lb_lock);
+			return LOOP_OK;
+		case LOOP_DROPPING:
+			t->on_disconnect(t);
+			return LOOP_DOWN;
+		case LOOP_LOST:
+			return LOOP_DOWN;
+		default:
+			return LOOP_OK;
+	}
+}
+
+static int lb_subscribe(struct iface_transport *t, const char *topic)
+{
+	(void)t;
+
+	/* The node server's input topic is the one messages arrive on */
+	if (strncmp(topic, "udi/polyglot/ns/", 16) == 0)
+		snprintf(lb_topic, sizeof(lb_topic), "%s", topic);
+
+	return LOOP_OK;
+}
+
+static int lb_publish(struct iface_transport *t, const char *topic,
+		const void *payload, int len)
+{
+	(void)t;
+
+	if (__atomic_load_n(&lb_state, __ATOMIC_ACQUIRE) != LOOP_UP)
+		return LOOP_DOWN;
+
+	if (lb_receiver)
+		lb_receiver(topic, (const char *)payload, len, lb_receiver_arg);
+
+	return LOOP_OK;
+}
+
+static const char *lb_strerror(int err)
+{
+	switch (err) {
+		case LOOP_OK:
+			return "success";
+		case LOOP_DOWN:
+			return "loopback connection is down";
+		default:
+			return "invalid arguments";
+	}
+}
+
+static struct iface_transport loopback_transport = {
+	.connect = lb_connect,
+	.reconnect = lb_reconnect,
+	.loop = lb_loop,
+	.subscribe = lb_subscribe,
+	.publish = lb_publish,
+	.strerror = lb_strerror,
+};
+
+/*
+ * loopbackTransport
+ *
+ * Return the loopback transport to set in iface_options.
+ */
+struct iface_transport *loopbackTransport(void)
+{
+	return &loopback_transport;
+}
+
+/*
+ * loopbackReceiver
+ *
+ * Set the function that gets the messages the library publishes.
+ * Set it before initWithOptions() to see the connected message.
+ */
+void loopbackReceiver(void (*fn)(const char *topic, const char *msg,
+			int len, void *arg), void *arg)
+{
+	pthread_mutex_lock(&lb_lock);
+	lb_receiver = fn;
+	lb_receiver_arg = arg;
+	pthread_mutex_unlock(&lb_lock);
+}
+
+/*
+ * loopbackSend
+ *
+ * Deliver a message from Polyglot to the library.  msg must be nul
+ * terminated and is only used until this returns.  Returns 0, or -1
+ * if the connection is not up.
+ */
+int loopbackSend(const char *msg)
+{
+	struct iface_transport *t = &loopback_transport;
+
+	if (msg == NULL)
+		return -1;
+	if (__atomic_load_n(&lb_state, __ATOMIC_ACQUIRE) != LOOP_UP)
+		return -1;
+
+	t->on_message(t, lb_topic, msg, (int)strlen(msg));
+	return 0;
+}
+
+/*
+ * loopbackConnected
+ *
+ * Wait up to timeout ms for the connection to come up and the
+ * library to finish its connect handling.  Returns 0 once it is up
+ * or -1 on timeout.
+ */
+int loopbackConnected(int timeout)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&lb_lock);
+	while (!lb_ready && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&lb_cond, &lb_lock, &ts);
+	ret = lb_ready ? 0 : -1;
+	pthread_mutex_unlock(&lb_lock);
+
+	return ret;
+}
+
+/*
+ * loopbackDisconnect
+ *
+ * Drop the connection as if the broker went away.
+ */
+void loopbackDisconnect(void)
+{
+	pthread_mutex_lock(&lb_lock);
+	if (lb_state == LOOP_UP || lb_state == LOOP_CONNECTING) {
+		__atomic_store_n(&lb_state, LOOP_DROPPING, __ATOMIC_RELEASE);
+		lb_ready = 0;
+		pthread_cond_broadcast(&lb_cond);
+	}
+	pthread_mutex_unlock(&lb_lock);
+}
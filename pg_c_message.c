@@ -0,0 +1,323 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_message.c
+ *
+ * Message serializer for the fixed format messages that get sent
+ * often (status, command, addnode).  These are written directly into
+ * a per thread buffer instead of building a cJSON tree and printing
+ * it.  The buffer is reused for every message sent from the thread
+ * and only grows when a message doesn't fit, so once it has grown to
+ * its working size, sending a message doesn't allocate any memory.
+ *
+ * The publish topic and the '"node": N' suffix that every message
+ * ends with are built once by msg_init().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+#define MSGBUF_MIN 256
+
+static __thread struct msgbuf tbuf;
+
+static const char hex[] = "0123456789abcdef";
+
+/*
+ * msg_init
+ *
+ * Build the publish topic and message suffix for this profile.
+ */
+void msg_init(int profile)
+{
+	snprintf(poly->topic, sizeof(poly->topic),
+			"udi/polyglot/connections/%d", profile);
+	poly->node_suffix_len = snprintf(poly->node_suffix,
+			sizeof(poly->node_suffix), ",\"node\":%d}", profile);
+}
+
+/*
+ * Make sure there is room for len more bytes in the buffer.
+ */
+static int msg_reserve(struct msgbuf *mb, size_t len)
+{
+	size_t size;
+	char *nb;
+
+	if (mb->error)
+		return -1;
+
+	if (mb->len + len <= mb->size)
+		return 0;
+
+	size = mb->size ? mb->size : MSGBUF_MIN;
+	while (size < mb->len + len)
+		size *= 2;
+
+	nb = realloc(mb->buf, size);
+	if (nb == NULL) {
+		mb->error = 1;
+		return -1;
+	}
+	mb->buf = nb;
+	mb->size = size;
+
+	return 0;
+}
+
+/*
+ * msg_buffer
+ *
+ * Return the calling thread's message buffer, emptied.
+ */
+struct msgbuf *msg_buffer(void)
+{
+	tbuf.len = 0;
+	tbuf.error = 0;
+	return &tbuf;
+}
+
+void msg_append(struct msgbuf *mb, const char *s, size_t len)
+{
+	if (msg_reserve(mb, len) != 0)
+		return;
+	memcpy(mb->buf + mb->len, s, len);
+	mb->len += len;
+}
+
+/*
+ * Append s as a quoted and escaped JSON string. A NULL string is
+ * written as "".
+ */
+void msg_append_string(struct msgbuf *mb, const char *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *run;
+	char *out;
+
+	/* worst case every character becomes \u00XX */
+	if (msg_reserve(mb, (s ? strlen(s) * 6 : 0) + 2) != 0)
+		return;
+
+	out = mb->buf + mb->len;
+	*out++ = '"';
+	while (p && *p) {
+		/* copy runs that don't need escaping in one go */
+		run = p;
+		while (*p >= 0x20 && *p != '"' && *p != '\\')
+			p++;
+		memcpy(out, run, p - run);
+		out += p - run;
+		if (*p == '\0')
+			break;
+
+		*out++ = '\\';
+		switch (*p) {
+			case '"':  *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '\b': *out++ = 'b'; break;
+			case '\f': *out++ = 'f'; break;
+			case '\n': *out++ = 'n'; break;
+			case '\r': *out++ = 'r'; break;
+			case '\t': *out++ = 't'; break;
+			default:
+				*out++ = 'u';
+				*out++ = '0';
+				*out++ = '0';
+				*out++ = hex[*p >> 4];
+				*out++ = hex[*p & 0x0f];
+				break;
+		}
+		p++;
+	}
+	*out++ = '"';
+	mb->len = out - mb->buf;
+}
+
+void msg_append_int(struct msgbuf *mb, int value)
+{
+	char digits[12];
+	unsigned int v;
+	int i = sizeof(digits);
+
+	v = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+	do {
+		digits[--i] = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	if (value < 0)
+		digits[--i] = '-';
+
+	msg_append(mb, digits + i, sizeof(digits) - i);
+}
+
+/*
+ * Append a driver status object:
+ *   {"address":..,"driver":..,"value":..,"uom":..}
+ */
+void msg_append_status(struct msgbuf *mb, const char *address,
+		const char *driver, const char *value, int uom)
+{
+	msg_literal(mb, "{\"address\":");
+	msg_append_string(mb, address);
+	msg_literal(mb, ",\"driver\":");
+	msg_append_string(mb, driver);
+	msg_literal(mb, ",\"value\":");
+	msg_append_string(mb, value);
+	msg_literal(mb, ",\"uom\":");
+	msg_append_int(mb, uom);
+	msg_literal(mb, "}");
+}
+
+/*
+ * msg_finish
+ *
+ * Terminate the message with the node suffix.  Returns 0 if the
+ * message is ready to send or -1 if memory ran out building it.
+ */
+int msg_finish(struct msgbuf *mb)
+{
+	msg_append(mb, poly->node_suffix, poly->node_suffix_len);
+	if (mb->error) {
+		logger(ERROR, "Failed to allocate memory for message\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * msg_send
+ *
+ * Terminate the message and queue it to be sent.  Returns the send
+ * queue depth or -1 if the message was dropped.
+ */
+int msg_send(struct msgbuf *mb)
+{
+	if (msg_finish(mb) != 0)
+		return -1;
+	return poly_send_raw(mb->buf, mb->len);
+}
+
+/*
+ * msg_status
+ *
+ * Send a single driver status message.  This replaces any status for
+ * the same address and driver that is still waiting in the send queue.
+ */
+int msg_status(const char *address, const char *driver,
+		const char *value, int uom)
+{
+	struct msgbuf *mb = msg_buffer();
+	struct span_ctx trace = span_get();
+	long long start = trace.id ? metrics_now() : 0;
+
+	msg_literal(mb, "{\"status\":");
+	msg_append_status(mb, address, driver, value, uom);
+	if (msg_finish(mb) != 0)
+		return -1;
+	if (trace.id)
+		span_record(trace.id, "serialize", driver, start, metrics_now());
+	return poly_send_status(mb->buf, mb->len, address, driver);
+}
+
+/*
+ * msg_command
+ *
+ * Send a command (reportCmd) message. value may be NULL.
+ */
+void msg_command(const char *address, const char *command,
+		const char *value, int uom)
+{
+	struct msgbuf *mb = msg_buffer();
+
+	msg_literal(mb, "{\"command\":{\"address\":");
+	msg_append_string(mb, address);
+	msg_literal(mb, ",\"command\":");
+	msg_append_string(mb, command);
+	msg_literal(mb, ",\"uom\":");
+	msg_append_int(mb, uom);
+	if (value) {
+		msg_literal(mb, ",\"value\":");
+		msg_append_string(mb, value);
+	}
+	msg_literal(mb, "}}");
+	msg_send(mb);
+}
+
+/*
+ * msg_append_node
+ *
+ * Append the node object used in the addnode message.
+ */
+void msg_append_node(struct msgbuf *mb, struct node *n)
+{
+	int cnt;
+
+	msg_literal(mb, "{\"address\":");
+	msg_append_string(mb, n->address);
+	msg_literal(mb, ",\"name\":");
+	msg_append_string(mb, n->name);
+	msg_literal(mb, ",\"node_def_id\":");
+	msg_append_string(mb, n->id);
+	msg_literal(mb, ",\"primary\":");
+	msg_append_string(mb, n->primary);
+	msg_literal(mb, ",\"hint\":[");
+	for (cnt = 0; cnt < 3; cnt++) {
+		if (cnt)
+			msg_literal(mb, ",");
+		msg_append_int(mb, n->hint[cnt]);
+	}
+	msg_literal(mb, "],\"drivers\":[");
+	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
+		if (cnt)
+			msg_literal(mb, ",");
+		msg_literal(mb, "{\"driver\":");
+		msg_append_string(mb, n->drivers[cnt].driver);
+		msg_literal(mb, ",\"value\":");
+		msg_append_string(mb, n->drivers[cnt].value);
+		msg_literal(mb, ",\"uom\":");
+		msg_append_int(mb, n->drivers[cnt].uom);
+		msg_literal(mb, "}");
+	}
+	msg_literal(mb, "]}");
+}
+
+/*
+ * msg_addnode
+ *
+ * Send an addnode message for a single node.
+ */
+void msg_addnode(struct node *n)
+{
+	struct msgbuf *mb = msg_buffer();
+
+	msg_literal(mb, "{\"addnode\":{\"nodes\":[");
+	msg_append_node(mb, n);
+	msg_literal(mb, "]}");
+	msg_send(mb);
+}
@@ -0,0 +1,326 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_metrics.c
+ *
+ * Library metrics.  Every thread that records a metric gets its own
+ * block of counters and histograms.  Only that thread writes to it,
+ * so recording is a plain load and store with no locks or atomic
+ * read-modify-write.  getStats() adds up the blocks of all threads.
+ *
+ * Histograms are in microseconds with power of two buckets: bucket 0
+ * counts values under 1 us and bucket i values from 2^(i-1) up to
+ * 2^i us.  The last bucket also holds everything larger.
+ *
+ * If the stats_interval option is set, a line of JSON with the
+ * current stats is appended to logs/stats.log that often.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+struct metrics {
+	unsigned long msgs_in[STAT_MSG_CNT];
+	unsigned long bytes_in;
+	unsigned long sent;
+	unsigned long send_errors;
+	unsigned long dropped;
+	unsigned long bytes_out;
+	struct stat_hist hists[STAT_HIST_CNT];
+	struct metrics *next;
+};
+
+/* Only the owning thread changes a counter, readers may see it late */
+#define BUMP(c, n) \
+	__atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + (n), \
+			__ATOMIC_RELAXED)
+#define READ(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics *mt_all;
+static __thread struct metrics *mt_mine;
+static int mt_running;        /* callbacks running now */
+
+static const char *msg_names[STAT_MSG_CNT] = {
+	"connected", "config", "shortPoll", "longPoll", "command",
+	"query", "status", "delete", "result", "other",
+};
+
+static const char *hist_names[STAT_HIST_CNT] = {
+	"cmd_latency", "cmd_run", "queue_wait",
+};
+
+static struct metrics *metrics_mine(void)
+{
+	struct metrics *m;
+
+	if (mt_mine)
+		return mt_mine;
+
+	m = calloc(1, sizeof(struct metrics));
+	if (m == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&mt_lock);
+	m->next = mt_all;
+	__atomic_store_n(&mt_all, m, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mt_lock);
+
+	mt_mine = m;
+	return m;
+}
+
+/*
+ * metrics_now
+ *
+ * Monotonic time in ns, for measuring latencies.
+ */
+long long metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void metrics_msg_in(int type, size_t bytes)
+{
+	struct metrics *m = metrics_mine();
+
+	if (m == NULL)
+		return;
+	BUMP(m->msgs_in[type], 1);
+	BUMP(m->bytes_in, bytes);
+}
+
+/*
+ * metrics_sent
+ *
+ * Count a publish to the broker.  ok is false if it failed.
+ */
+void metrics_sent(size_t bytes, int ok)
+{
+	struct metrics *m = metrics_mine();
+
+	if (m == NULL)
+		return;
+	if (ok) {
+		BUMP(m->sent, 1);
+		BUMP(m->bytes_out, bytes);
+	} else {
+		BUMP(m->send_errors, 1);
+	}
+}
+
+void metrics_dropped(void)
+{
+	struct metrics *m = metrics_mine();
+
+	if (m)
+		BUMP(m->dropped, 1);
+}
+
+/*
+ * metrics_time
+ *
+ * Add a time in ns to one of the histograms.
+ */
+void metrics_time(int hist, long long ns)
+{
+	struct metrics *m = metrics_mine();
+	struct stat_hist *h;
+	unsigned long us;
+	int b = 0;
+
+	if (m == NULL)
+		return;
+
+	us = ns > 0 ? (unsigned long)(ns / 1000) : 0;
+	while (b < STAT_BUCKETS - 1 && us >= (1UL << b))
+		b++;
+
+	h = &m->hists[hist];
+	BUMP(h->buckets[b], 1);
+	BUMP(h->count, 1);
+	BUMP(h->total_us, us);
+	if (us > READ(h->max_us))
+		__atomic_store_n(&h->max_us, us, __ATOMIC_RELAXED);
+}
+
+void metrics_running(int delta)
+{
+	__atomic_fetch_add(&mt_running, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * statPercentile
+ *
+ * Return an upper bound in us for the pct (0 - 100) percentile of a
+ * histogram.
+ */
+unsigned long statPercentile(struct stat_hist *h, double pct)
+{
+	unsigned long want, seen = 0;
+	int b;
+
+	if (h->count == 0)
+		return 0;
+
+	want = (unsigned long)(h->count * pct / 100.0);
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < STAT_BUCKETS - 1; b++) {
+		seen += h->buckets[b];
+		if (seen >= want)
+			return (1UL << b) < h->max_us ? (1UL << b) : h->max_us;
+	}
+
+	return h->max_us;
+}
+
+/*
+ * getStats
+ *
+ * Fill in stats with the library metrics since it started.
+ */
+void getStats(struct iface_stats *stats)
+{
+	struct metrics *m;
+	int i, b;
+
+	memset(stats, 0, sizeof(struct iface_stats));
+
+	for (m = __atomic_load_n(&mt_all, __ATOMIC_ACQUIRE); m; m = m->next) {
+		for (i = 0; i < STAT_MSG_CNT; i++)
+			stats->msgs_in[i] += READ(m->msgs_in[i]);
+		stats->bytes_in += READ(m->bytes_in);
+		stats->sent += READ(m->sent);
+		stats->send_errors += READ(m->send_errors);
+		stats->dropped += READ(m->dropped);
+		stats->bytes_out += READ(m->bytes_out);
+		for (i = 0; i < STAT_HIST_CNT; i++) {
+			stats->hists[i].count += READ(m->hists[i].count);
+			stats->hists[i].total_us += READ(m->hists[i].total_us);
+			if (READ(m->hists[i].max_us) > stats->hists[i].max_us)
+				stats->hists[i].max_us = READ(m->hists[i].max_us);
+			for (b = 0; b < STAT_BUCKETS; b++)
+				stats->hists[i].buckets[b] += READ(m->hists[i].buckets[b]);
+		}
+	}
+
+	stats->callbacks_running = __atomic_load_n(&mt_running, __ATOMIC_RELAXED);
+	if (poly == NULL)
+		return;
+
+	stats->worker_queue = workq_pending(poly->workers);
+	for (i = 0; i < poly->lane_cnt; i++)
+		stats->lane_queue += workq_pending(poly->lanes[i]);
+	getSendQueue(&stats->send_queue, &stats->send_queue_bytes);
+	stats->reconnects = poly->reconnects;
+	stats->offline_ms = poly->offline_ms;
+	stats->resync_ms = poly->resync_ms;
+	getRateLimitStats(&stats->rate_delayed, &stats->rate_suppressed);
+}
+
+static void stats_dump(FILE *fp)
+{
+	struct iface_stats st;
+	struct stat_hist *h;
+	int i;
+
+	getStats(&st);
+
+	fprintf(fp, "{\"time\":%ld,\"in\":{", (long)time(NULL));
+	for (i = 0; i < STAT_MSG_CNT; i++)
+		fprintf(fp, "%s\"%s\":%lu", i ? "," : "", msg_names[i], st.msgs_in[i]);
+	fprintf(fp, "},\"bytes_in\":%lu,\"sent\":%lu,\"send_errors\":%lu,"
+			"\"dropped\":%lu,\"bytes_out\":%lu,\"running\":%d,"
+			"\"worker_queue\":%d,\"lane_queue\":%d,\"send_queue\":%d,"
+			"\"send_queue_bytes\":%d,\"reconnects\":%d,"
+			"\"rate_delayed\":%lu,\"rate_suppressed\":%lu",
+			st.bytes_in, st.sent, st.send_errors, st.dropped,
+			st.bytes_out, st.callbacks_running, st.worker_queue,
+			st.lane_queue, st.send_queue, st.send_queue_bytes,
+			st.reconnects, st.rate_delayed, st.rate_suppressed);
+	for (i = 0; i < STAT_HIST_CNT; i++) {
+		h = &st.hists[i];
+		fprintf(fp, ",\"%s\":{\"count\":%lu,\"avg_us\":%llu,\"p50_us\":%lu,"
+				"\"p99_us\":%lu,\"max_us\":%lu}",
+				hist_names[i], h->count,
+				h->count ? h->total_us / h->count : 0,
+				statPercentile(h, 50), statPercentile(h, 99), h->max_us);
+	}
+	fprintf(fp, "}\n");
+}
+
+static void *stats_thread(void *args)
+{
+	FILE *fp;
+	(void)args;
+
+	for (;;) {
+		sleep(poly->options.stats_interval);
+
+		fp = fopen("logs/stats.log", "a");
+		if (fp == NULL) {
+			loggerf(ERROR, "Failed to open stats file: stats.log (%d)\n",
+					errno);
+			continue;
+		}
+		stats_dump(fp);
+		fclose(fp);
+	}
+
+	return NULL;
+}
+
+/*
+ * metrics_start
+ *
+ * Start the periodic stats dump if stats_interval is set.
+ */
+int metrics_start(void)
+{
+	pthread_t thread;
+
+	if (poly->options.stats_interval <= 0)
+		return 0;
+
+	if (pthread_create(&thread, NULL, stats_thread, NULL) != 0) {
+		loggerf(ERROR, "Failed to start stats thread (%d)\n", errno);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
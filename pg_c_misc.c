@@ -33,13 +33,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <mosquitto.h>
 #include <mkdio.h>
 #include "cJSON.h"
 #include "c_interface.h"
 #include "c_int_interface.h"
 
-extern struct mosquitto *mosq;
 extern struct profile *poly;
 
 #define CUSTOM_CONFIG_DOCS_FILE_NAME "POLYGLOT_CONFIG.md"
@@ -55,6 +53,7 @@ extern struct profile *poly;
  */
 void setCustomParamsDoc(void)
 {
+	struct json_arena *arena;
 	FILE *fp;
 	char *buffer = NULL;
 	MMIOT *mkdown;
@@ -81,10 +80,12 @@ void setCustomParamsDoc(void)
 	fclose(fp);
 
 	// poly_send('{"customparamsdoc": doc}')
+	arena = json_arena_begin();
 	msg = cJSON_CreateObject();
 	cJSON_AddStringToObject(msg, "customparamsdoc", buffer);
 	poly_send(msg);
 	cJSON_Delete(msg);
+	json_arena_end(arena);
 	free(buffer);
 
 	return;
@@ -97,15 +98,18 @@ void setCustomParamsDoc(void)
  */
 void installProfile(void)
 {
+	struct json_arena *arena;
 	cJSON *msg, *body;
 
 	logger(DEBUG, "Sending Install Profile command to Polyglot.\n");
+	arena = json_arena_begin();
 	body = cJSON_CreateObject();
 	cJSON_AddBoolToObject(body, "reboot", 0); 
 	msg = cJSON_CreateObject();
 	cJSON_AddItemToObject(msg, "installprofile", body);
 	poly_send(msg);
 	cJSON_Delete(msg);
+	json_arena_end(arena);
 
 	return;
 }
@@ -117,14 +121,17 @@ void installProfile(void)
  */
 void restart(void)
 {
+	struct json_arena *arena;
 	cJSON *msg, *body;
 
 	logger(DEBUG, "Asking Polyglot to restart me..\n");
+	arena = json_arena_begin();
 	body = cJSON_CreateObject();
 	msg = cJSON_CreateObject();
 	cJSON_AddItemToObject(msg, "restart", body);
 	poly_send(msg);
 	cJSON_Delete(msg);
+	json_arena_end(arena);
 
 	return;
 }
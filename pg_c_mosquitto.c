@@ -0,0 +1,178 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_mosquitto.c
+ *
+ * The default transport: a mosquitto MQTT client connected to the
+ * Polyglot broker over TLS.  The mosquitto callbacks are passed on to
+ * the library through the transport's on_* callbacks.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <mosquitto.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+static struct mosquitto *mosq = NULL;
+
+static void mqtt_on_connect(struct mosquitto *m, void *ptr, int res)
+{
+	struct iface_transport *t = (struct iface_transport *)ptr;
+	(void)m;
+
+	/*
+	 * The broker refused the connection.  mosquitto_loop() returns
+	 * the error and the reconnect backoff carries on from there.
+	 */
+	if (res != 0) {
+		loggerf(ERROR, "MQTT connection refused (%d)\n", res);
+		return;
+	}
+
+	t->on_connect(t);
+}
+
+static void mqtt_on_disconnect(struct mosquitto *m, void *ptr, int res)
+{
+	struct iface_transport *t = (struct iface_transport *)ptr;
+	(void)m;
+	(void)res;
+
+	t->on_disconnect(t);
+}
+
+static void mqtt_on_message(struct mosquitto *m, void *ptr,
+		const struct mosquitto_message *msg)
+{
+	struct iface_transport *t = (struct iface_transport *)ptr;
+	(void)m;
+
+	if (msg == NULL) {
+		printf("-- got NULL message\n");
+		return;
+	}
+
+	t->on_message(t, msg->topic, msg->payload, msg->payloadlen);
+}
+
+static int mqtt_connect(struct iface_transport *t, const char *host, int port)
+{
+	int ret;
+
+	/* Create runtime instance with random client ID */
+	/*  client name, true, priv_data */
+	mosq = mosquitto_new(NULL, true, (void *)t);
+	if (!mosq) {
+		fprintf(stderr, "Failed to initialize a MQTT instance.\n");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* Set callbacks */
+	logger(DEBUG, "Configure MQTT callbacks\n");
+	mosquitto_connect_callback_set(mosq, mqtt_on_connect);
+	mosquitto_message_callback_set(mosq, mqtt_on_message);
+	mosquitto_disconnect_callback_set(mosq, mqtt_on_disconnect);
+
+	/*
+	 * This will be a secure connection.  The certificate files
+	 * will either come from stdin or from home directory of the
+	 * user running this.
+	 */
+	//mosquitto_tls_insecure_set(mosq, 1);
+	ret = mosquitto_tls_set(mosq,
+			  "/usr/home/bpaauwe/ssl/polyglot.crt",
+			  NULL,
+			  "/usr/home/bpaauwe/ssl/client.crt",
+			  "/usr/home/bpaauwe/ssl/client_private.key",
+			  NULL);
+	if (ret == 3) {
+		ret = mosquitto_tls_set(mosq,
+				"/var/polyglot/ssl/polyglot.crt",
+				NULL,
+				"/var/polyglot/ssl/client.crt",
+				"/var/polyglot/ssl/client_private.key",
+				NULL);
+	}
+	mosquitto_tls_opts_set(mosq, 0, NULL, NULL);
+
+	return mosquitto_connect_async(mosq, host, port, 10);
+}
+
+static int mqtt_reconnect(struct iface_transport *t)
+{
+	(void)t;
+	return mosquitto_reconnect(mosq);
+}
+
+static int mqtt_loop(struct iface_transport *t, int timeout)
+{
+	(void)t;
+	return mosquitto_loop(mosq, timeout, 1);
+}
+
+static int mqtt_subscribe(struct iface_transport *t, const char *topic)
+{
+	(void)t;
+	return mosquitto_subscribe(mosq, NULL, topic, 0);
+}
+
+static int mqtt_publish(struct iface_transport *t, const char *topic,
+		const void *payload, int len)
+{
+	(void)t;
+	return mosquitto_publish(mosq, NULL, topic, len, payload, 0, 0);
+}
+
+static const char *mqtt_strerror(int err)
+{
+	if (err == MOSQ_ERR_ERRNO)
+		return strerror(errno);
+	if (err == MOSQ_ERR_INVAL)
+		return "invalid arguments";
+	return mosquitto_strerror(err);
+}
+
+static struct iface_transport mqtt_transport = {
+	.connect = mqtt_connect,
+	.reconnect = mqtt_reconnect,
+	.loop = mqtt_loop,
+	.subscribe = mqtt_subscribe,
+	.publish = mqtt_publish,
+	.strerror = mqtt_strerror,
+};
+
+/*
+ * mqttTransport
+ *
+ * Return the mosquitto MQTT transport.  This is what the library
+ * uses when no transport is set in the options.
+ */
+struct iface_transport *mqttTransport(void)
+{
+	return &mqtt_transport;
+}
@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <math.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -33,153 +35,324 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <mosquitto.h>
 #include "cJSON.h"
 #include "c_interface.h"
 #include "c_int_interface.h"
 
-extern struct mosquitto *mosq;
 extern struct profile *poly;
 
 static void free_node(struct node *n)
 {
+	int i;
+
+	for (i = 0; i < n->driver_cnt; i++)
+		free(n->drivers[i].reported_value);
 	if (n->drivers)
 		free(n->drivers);
 	if (n->commands)
 		free(n->commands);
 	if (n->sends)
 		free(n->sends);
+	free(n->slots);
+	rate_forget(n);
 
-	loggerf(DEBUG, "Freeing node %s\n", n->name);
+	LOGF(LOGSYS_NODES, DEBUG, "Freeing node %s\n", n->name);
+	free(n->primary);
+	free(n->address);
 	free(n);
 
 	return;
 }
 
-static void node_set_driver(struct node *n, char *driver, char *value, int report, int force, int uom)
+static long long now_ms(void)
 {
-	struct driver *d;
-	int cnt;
-	int changed = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Parse a driver value as a number. Returns NAN if it isn't one.
+ */
+static double driver_number(const char *value)
+{
+	char *end;
+	double v;
+
+	if (value == NULL || *value == '\0')
+		return NAN;
+	v = strtod(value, &end);
+	while (isspace((unsigned char)*end))
+		end++;
+
+	return *end == '\0' ? v : NAN;
+}
 
-	d = n->drivers;
-	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
-		if (strcmp(d->driver, driver) == 0) {
-			if (strcmp(d->value, value) != 0 || d->uom != uom)
-				changed = 1;
-			d->value = value;
-			d->uom = uom;
-			if (report)
-				n->ops.reportDriver(n, d->driver, changed, force);
-			return;
+/*
+ * Remember what was last reported for a filtered driver, and when.
+ * The value is copied since the caller owns d->value.
+ */
+static void driver_reported(struct driver *d, long long at)
+{
+	char *v;
+
+	if (!d->filtered)
+		return;
+	if (d->reported_value == NULL || strcmp(d->reported_value, d->value) != 0) {
+		v = strdup(d->value);
+		if (v) {
+			free(d->reported_value);
+			d->reported_value = v;
 		}
-		d++;
 	}
-	return;
+	d->reported = driver_number(d->value);
+	d->reported_uom = d->uom;
+	d->reported_at = at;
+	d->has_reported = 1;
 }
 
-static char *node_get_driver(struct node *n, char *driver)
+/*
+ * Decide if a new value for a filtered driver has changed enough from
+ * what was last reported to be worth reporting.  Numeric values are
+ * compared against the last reported value, so a value drifting
+ * slowly is reported once it has moved a full deadband, not never.
+ */
+static int driver_changed(struct driver *d, const char *value, int uom)
 {
-	struct driver *d;
+	double v;
+	double band;
+
+	if (!d->has_reported || d->reported_uom != uom)
+		return 1;
+
+	v = driver_number(value);
+	if (isnan(v) || isnan(d->reported))
+		return d->reported_value == NULL ||
+			strcmp(d->reported_value, value) != 0;
+
+	band = d->filter.deadband;
+	if (d->filter.flags & DEADBAND_PERCENT)
+		band = fabs(d->reported) * band / 100;
+
+	return fabs(v - d->reported) > band;
+}
+
+/*
+ * A changed value within min_interval of the last report is held and
+ * sent once the interval is up, so the last change in an interval is
+ * always reported.  reported_at is set to when it will be sent; a
+ * reported_at in the future means a value is already being held and
+ * this one replaces it.  Returns 1 if the value is held.
+ */
+static int driver_defer(struct node *n, struct driver *d)
+{
+	long long now, due;
+
+	if (!d->filter.min_interval)
+		return 0;
+
+	now = now_ms();
+	if (d->reported_at > now)
+		due = d->reported_at;
+	else
+		due = d->reported_at + d->filter.min_interval;
+	if (due <= now)
+		return 0;
+
+	driver_reported(d, due);
+	rate_defer(n, d, (long)(due - now));
+
+	return 1;
+}
+
+/*
+ * Make sure the node's slot map has room for handle.
+ */
+static int slot_reserve(struct node *n, int handle)
+{
+	struct node_slot *ns;
 	int cnt;
 
-	d = n->drivers;
-	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
-		if (strcmp(d->driver, driver) == 0) {
-			return d->value;
-		}
-		d++;
-	}
-	return "";
+	if (handle < n->slot_cnt)
+		return 0;
+
+	cnt = n->slot_cnt ? n->slot_cnt : 16;
+	while (cnt <= handle)
+		cnt *= 2;
+
+	ns = realloc(n->slots, cnt * sizeof(struct node_slot));
+	if (ns == NULL)
+		return -1;
+	memset(ns + n->slot_cnt, 0, (cnt - n->slot_cnt) * sizeof(struct node_slot));
+	n->slots = ns;
+	n->slot_cnt = cnt;
+
+	return 0;
 }
 
+static struct driver *driver_by_handle(struct node *n, int handle)
+{
+	if (handle < 0 || handle >= n->slot_cnt || !n->slots[handle].driver)
+		return NULL;
+	return &n->drivers[n->slots[handle].driver - 1];
+}
 
-static void node_report_driver(struct node *n, char *drv, int changed, int force)
+static struct command *command_by_handle(struct node *n, int handle)
+{
+	if (handle < 0 || handle >= n->slot_cnt || !n->slots[handle].command)
+		return NULL;
+	return &n->commands[n->slots[handle].command - 1];
+}
+
+static struct send *send_by_handle(struct node *n, int handle)
+{
+	if (handle < 0 || handle >= n->slot_cnt || !n->slots[handle].send)
+		return NULL;
+	return &n->sends[n->slots[handle].send - 1];
+}
+
+static void report_driver(struct node *n, struct driver *d, int changed,
+		int force);
+static void node_report_driver(struct node *n, char *drv, int changed, int force);
+
+/*
+ * setDriverH
+ *
+ * Like setDriver, but the driver is given by its handle (see getHandle).
+ */
+void setDriverH(struct node *n, int handle, char *value, int report,
+		int force, int uom)
 {
 	struct driver *d;
-	int cnt;
-	cJSON *obj;
-	cJSON *status;
-
-	d = n->drivers;
-	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
-		if (strcmp(d->driver, drv) == 0) {
-			if (changed || force) {
-				/* Create message and send */
-				status = cJSON_CreateObject();
-				cJSON_AddStringToObject(status, "address", n->address);
-				cJSON_AddStringToObject(status, "driver", d->driver);
-				cJSON_AddStringToObject(status, "value", d->value);
-				cJSON_AddNumberToObject(status, "uom", d->uom);
-
-				obj = cJSON_CreateObject();
-				cJSON_AddItemToObject(obj, "status", status);
-
-				poly_send(obj);
-
-				cJSON_Delete(obj);
-			}
-			return;
-		}
-		d++;
-	}
-	return;
+	int changed = 0;
+
+	d = driver_by_handle(n, handle);
+	if (d == NULL)
+		return;
+
+	if (d->filtered)
+		changed = driver_changed(d, value, uom);
+	else if (strcmp(d->value, value) != 0 || d->uom != uom)
+		changed = 1;
+	d->value = value;
+	d->uom = uom;
+	if (!report)
+		return;
+	if (changed && d->filtered && driver_defer(n, d))
+		return;
+
+	/* skip the name lookup unless reportDriver was replaced */
+	if (n->ops.reportDriver == node_report_driver)
+		report_driver(n, d, changed, force);
+	else
+		n->ops.reportDriver(n, d->driver, changed, force);
 }
 
-static void node_report_drivers(struct node *n)
+/*
+ * getDriverH
+ *
+ * Like getDriver, but the driver is given by its handle.
+ */
+char *getDriverH(struct node *n, int handle)
 {
-	int cnt;
-	cJSON *obj;
-	cJSON *status;
+	struct driver *d;
 
-	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
-		/* Create message and send */
-		status = cJSON_CreateObject();
-		cJSON_AddStringToObject(status, "address", n->address);
-		cJSON_AddStringToObject(status, "driver", n->drivers[cnt].driver);
-		cJSON_AddStringToObject(status, "value", n->drivers[cnt].value);
-		cJSON_AddNumberToObject(status, "uom", n->drivers[cnt].uom);
+	d = driver_by_handle(n, handle);
+	return d ? d->value : "";
+}
+
+static void node_set_driver(struct node *n, char *driver, char *value, int report, int force, int uom)
+{
+	setDriverH(n, intern_find(driver), value, report, force, uom);
+}
 
-		obj = cJSON_CreateObject();
-		cJSON_AddItemToObject(obj, "status", status);
+static char *node_get_driver(struct node *n, char *driver)
+{
+	return getDriverH(n, intern_find(driver));
+}
 
-		poly_send(obj);
 
-		cJSON_Delete(obj);
-	}
-	return;
+/*
+ * Send a single driver status report to Polyglot, or hand it to the
+ * status coalescer when that is enabled.
+ */
+void status_send(const char *address, const char *driver,
+		const char *value, int uom)
+{
+	if (coalesce_status(address, driver, value, uom) == 0)
+		return;
+
+	msg_status(address, driver, value, uom);
 }
 
-static void node_report_cmd(struct node *n, char *sends, char *value, int uom)
+/*
+ * Report a driver, unless a rate limit holds it back to be sent
+ * later.
+ */
+static void send_status(struct node *n, struct driver *d)
+{
+	driver_reported(d, now_ms());
+	if (rate_status(n, d) != 0)
+		return;
+
+	status_send(n->address, d->driver, d->value, d->uom);
+}
+
+static void report_driver(struct node *n, struct driver *d, int changed,
+		int force)
+{
+	if (changed || force)
+		send_status(n, d);
+}
+
+/*
+ * reportDriverH
+ *
+ * Like reportDriver, but the driver is given by its handle.
+ */
+void reportDriverH(struct node *n, int handle, int changed, int force)
+{
+	struct driver *d;
+
+	d = driver_by_handle(n, handle);
+	if (d)
+		report_driver(n, d, changed, force);
+}
+
+static void node_report_driver(struct node *n, char *drv, int changed, int force)
+{
+	reportDriverH(n, intern_find(drv), changed, force);
+}
+
+static void node_report_drivers(struct node *n)
 {
-	struct send *s;
 	int cnt;
-	cJSON *obj;
-	cJSON *cmd;
-
-	s = n->sends;
-	/* look up command in sends array */
-	for (cnt = 0; cnt < n->send_cnt; cnt++) {
-		if (strcmp(s->id, sends) == 0) {
-			/* Create message and send */
-			cmd = cJSON_CreateObject();
-			cJSON_AddStringToObject(cmd, "address", n->address);
-			cJSON_AddStringToObject(cmd, "command", s->id);
-			cJSON_AddNumberToObject(cmd, "uom", uom);
-			if (value) 
-				cJSON_AddStringToObject(cmd, "value", value);
-
-			obj = cJSON_CreateObject();
-			cJSON_AddItemToObject(obj, "command", cmd);
-			poly_send(obj);
-			cJSON_Delete(obj);
-			return;
-		}
-		s++;
-	}
+
+	for (cnt = 0; cnt < n->driver_cnt; cnt++)
+		send_status(n, &n->drivers[cnt]);
 	return;
 }
 
+/*
+ * reportCmdH
+ *
+ * Like reportCmd, but the command is given by its handle.
+ */
+void reportCmdH(struct node *n, int handle, char *value, int uom)
+{
+	struct send *s;
+
+	s = send_by_handle(n, handle);
+	if (s)
+		msg_command(n->address, s->id, value, uom);
+}
+
+static void node_report_cmd(struct node *n, char *sends, char *value, int uom)
+{
+	reportCmdH(n, intern_find(sends), value, uom);
+}
+
 static void node_query(struct node *n)
 {
 	node_report_drivers(n);
@@ -239,6 +412,7 @@ struct node *allocNode(char *id, char *primary, char *address, char *name)
 	new_node->send_cnt = 0;
 	new_node->drivers = NULL;
 	new_node->next = NULL;
+	new_node->refs = 1;
 
 	return new_node;
 }
@@ -256,7 +430,7 @@ void addDriver(struct node *n, char *driver, char *init, int uom)
 
 	/* 1. Count how many drivers are in current node driver array */
 	cnt = n->driver_cnt;
-	loggerf(DEBUG, "node %s has %d drivers\n", n->name, n->driver_cnt);
+	LOGF(LOGSYS_NODES, DEBUG, "node %s has %d drivers\n", n->name, n->driver_cnt);
 
 	/* 2. Allocate a new array sized to include new driver */
 	nd = calloc(cnt + 1, sizeof(struct driver));
@@ -268,40 +442,91 @@ void addDriver(struct node *n, char *driver, char *init, int uom)
 	nd[cnt].driver = driver;
 	nd[cnt].value = init;
 	nd[cnt].uom = uom;
+	nd[cnt].handle = intern_id(driver);
+	if (nd[cnt].handle >= 0 && slot_reserve(n, nd[cnt].handle) == 0 &&
+			!n->slots[nd[cnt].handle].driver)
+		n->slots[nd[cnt].handle].driver = cnt + 1;
 
 	/* 5. Replace node's driver array with new one */
 	free(n->drivers);
 	n->drivers = nd;
 	n->driver_cnt++;
 
-	d = n->drivers;
-	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
-		loggerf(DEBUG, "%s, %s, %d\n", d->driver, d->value, d->uom);
-		d++;
+	if (logger_on(LOGSYS_NODES, DEBUG)) {
+		d = n->drivers;
+		for (cnt = 0; cnt < n->driver_cnt; cnt++) {
+			loggerf_sub(LOGSYS_NODES, DEBUG, "%s, %s, %d\n",
+					d->driver, d->value, d->uom);
+			d++;
+		}
 	}
 
 	return;
 }
 
+/*
+ * addDriverFiltered
+ *
+ * Add a driver like addDriver, with a deadband and/or a minimum
+ * interval between reports.  A new value is only reported once it
+ * differs from the last reported value by more than the deadband
+ * (or by a percent of it with DEADBAND_PERCENT).  A change within
+ * min_interval ms of the last report is held and sent when the
+ * interval is up, the newest value replacing any held before it.
+ * Values that aren't numbers are reported on any change, subject to
+ * min_interval.
+ */
+void addDriverFiltered(struct node *n, char *driver, char *init, int uom,
+		struct driver_filter *filter)
+{
+	struct driver *d;
+
+	addDriver(n, driver, init, uom);
+
+	d = &n->drivers[n->driver_cnt - 1];
+	if (filter == NULL)
+		return;
+
+	d->filter = *filter;
+	d->filtered = 1;
+
+	/* the initial value is reported by addNode */
+	driver_reported(d, 0);
+}
+
 /*
  * addCommand
  *
- * add a command to the node's command list.
+ * add a command to the node's command list.  A command received for
+ * the node calls every command added with its id, in the order added.
  */
 void addCommand(struct node *n, char *cmd_id,
 		void (*callback)(struct node *n, char *cmd, char *value, int uom))
 {
 	struct command *nc;
 	int cnt = 0;
+	int i;
 
 	cnt = n->command_cnt;
-	loggerf(DEBUG, "node %s has %d commands\n", n->name, n->command_cnt);
+	LOGF(LOGSYS_NODES, DEBUG, "node %s has %d commands\n", n->name, n->command_cnt);
 
 	nc = calloc(cnt + 1, sizeof(struct command));
 	memcpy(nc, n->commands, (cnt * sizeof(struct command)));
 
 	nc[cnt].id = cmd_id;
 	nc[cnt].callback = callback;
+	nc[cnt].handle = intern_id(cmd_id);
+	if (nc[cnt].handle >= 0 && slot_reserve(n, nc[cnt].handle) == 0) {
+		/* commands with the same id are chained, each one is called */
+		i = n->slots[nc[cnt].handle].command;
+		if (i == 0) {
+			n->slots[nc[cnt].handle].command = cnt + 1;
+		} else {
+			while (nc[i - 1].next)
+				i = nc[i - 1].next;
+			nc[i - 1].next = cnt + 1;
+		}
+	}
 	
 	free(n->commands);
 	n->commands = nc;
@@ -322,13 +547,17 @@ void addSend(struct node *n, char *cmd_id,
 	int cnt = 0;
 
 	cnt = n->send_cnt;
-	loggerf(DEBUG, "node %s has %d sends\n", n->name, n->send_cnt);
+	LOGF(LOGSYS_NODES, DEBUG, "node %s has %d sends\n", n->name, n->send_cnt);
 
 	nc = calloc(cnt + 1, sizeof(struct send));
 	memcpy(nc, n->sends, (cnt * sizeof(struct send)));
 
 	nc[cnt].id = cmd_id;
 	nc[cnt].callback = callback;
+	nc[cnt].handle = intern_id(cmd_id);
+	if (nc[cnt].handle >= 0 && slot_reserve(n, nc[cnt].handle) == 0 &&
+			!n->slots[nc[cnt].handle].send)
+		n->slots[nc[cnt].handle].send = cnt + 1;
 	
 	free(n->sends);
 	n->sends = nc;
@@ -339,66 +568,270 @@ void addSend(struct node *n, char *cmd_id,
 
 
 /*
- * addNode
+ * Node index
  *
- * Add a node to the node server's node list
+ * The node list (poly->nodelist) is kept in the order the nodes were
+ * added since getNodes() hands it out.  Alongside it, a hash table
+ * keyed on the node address makes lookups O(1), the list is doubly
+ * linked so a node can be removed without a walk, and the tail is
+ * kept so adding a node doesn't walk the list either.
+ *
+ * node_lock protects the list and the index.
+ *
+ * A node starts with one reference, held by the node list.  Work on a
+ * lane takes its own with node_find() or node_list_get(), so a node
+ * deleted while a command or report for it is running is freed when
+ * that work drops its reference rather than under it.
  */
-void addNode(struct node *n)
+#define NODE_INDEX_MIN 64
+
+static pthread_rwlock_t node_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct node **node_index;
+static unsigned int index_size;
+static unsigned int node_cnt;
+static struct node *node_tail;
+
+static unsigned int address_hash(const char *address)
 {
-	struct node *tmp;
-	cJSON *node;
-	cJSON *obj;
-	cJSON *drv;
-	cJSON *drv_array;
-	cJSON *node_array;
-	cJSON *hint_array;
-	cJSON *node_array_obj;
-	int cnt;
+	unsigned int hash = 2166136261u;
 
-	n->next = NULL;  /* Just to be safe */
+	while (*address) {
+		hash ^= (unsigned char)*address++;
+		hash *= 16777619u;
+	}
 
-	if (!poly->nodelist) {
-		poly->nodelist = n;
-	} else {
-		tmp = poly->nodelist;
-		while (tmp->next)
-			tmp = tmp->next;
+	return hash;
+}
 
-		tmp->next = n;
+/*
+ * Double the size of the index and rehash, keeping list order within
+ * each chain so the first node added with an address is found first.
+ */
+static int index_grow(void)
+{
+	struct node **ni;
+	struct node **link;
+	struct node *n;
+	unsigned int size;
+
+	size = index_size ? index_size * 2 : NODE_INDEX_MIN;
+	ni = calloc(size, sizeof(struct node *));
+	if (ni == NULL)
+		return -1;
+
+	for (n = poly->nodelist; n; n = n->next) {
+		n->hnext = NULL;
+		link = &ni[address_hash(n->address) & (size - 1)];
+		while (*link)
+			link = &(*link)->hnext;
+		*link = n;
 	}
 
-	/* Send node info to Polyglot */
+	free(node_index);
+	node_index = ni;
+	index_size = size;
+
+	return 0;
+}
+
+static void index_insert(struct node *n)
+{
+	struct node **link;
+
+	n->hnext = NULL;
+	link = &node_index[address_hash(n->address) & (index_size - 1)];
+	while (*link)
+		link = &(*link)->hnext;
+	*link = n;
+}
+
+static void index_remove(struct node *n)
+{
+	struct node **link;
+
+	link = &node_index[address_hash(n->address) & (index_size - 1)];
+	while (*link && *link != n)
+		link = &(*link)->hnext;
+	if (*link)
+		*link = n->hnext;
+}
+
+/* Caller must hold node_lock */
+static struct node *index_find(const char *address)
+{
+	struct node *n;
+
+	if (index_size == 0)
+		return NULL;
+
+	n = node_index[address_hash(address) & (index_size - 1)];
+	while (n && strcmp(n->address, address) != 0)
+		n = n->hnext;
+
+	return n;
+}
+
+/*
+ * node_find
+ *
+ * Look up a node by address and take a reference to it.  Returns NULL
+ * if there isn't one.  Release the node with node_put().
+ */
+struct node *node_find(const char *address)
+{
+	struct node *n;
+
+	pthread_rwlock_rdlock(&node_lock);
+	n = index_find(address);
+	if (n)
+		__sync_fetch_and_add(&n->refs, 1);
+	pthread_rwlock_unlock(&node_lock);
+
+	return n;
+}
+
+void node_put(struct node *n)
+{
+	if (n && __sync_sub_and_fetch(&n->refs, 1) == 0)
+		free_node(n);
+}
 
-	node = cJSON_CreateObject();
-	cJSON_AddStringToObject(node, "address", n->address);
-	cJSON_AddStringToObject(node, "name", n->name);
-	cJSON_AddStringToObject(node, "node_def_id", n->id);
-	cJSON_AddStringToObject(node, "primary", n->primary);
-	hint_array = cJSON_AddArrayToObject(node, "hint");
-	for (cnt = 0; cnt < 3; cnt++)
-		cJSON_AddItemToArray(hint_array, cJSON_CreateNumber((double)n->hint[cnt]));
-	drv_array = cJSON_AddArrayToObject(node, "drivers");
-	for (cnt = 0; cnt < n->driver_cnt; cnt++) {
-		drv = cJSON_CreateObject();
-		cJSON_AddStringToObject(drv, "driver", n->drivers[cnt].driver);
-		cJSON_AddStringToObject(drv, "value", n->drivers[cnt].value);
-		cJSON_AddNumberToObject(drv, "uom", n->drivers[cnt].uom);
-		cJSON_AddItemToArray(drv_array, drv);
+/*
+ * node_list_get
+ *
+ * Return the nodes in the node list, in order, each with a reference
+ * taken, so the caller can walk them without holding node_lock.
+ * Returns NULL if the list is empty or on failure.  Release the nodes
+ * with node_list_put().
+ */
+struct node **node_list_get(int *cnt)
+{
+	struct node **nodes;
+	struct node *n;
+	int i = 0;
+
+	pthread_rwlock_rdlock(&node_lock);
+	nodes = node_cnt ? malloc(node_cnt * sizeof(struct node *)) : NULL;
+	if (nodes) {
+		for (n = poly->nodelist; n; n = n->next) {
+			__sync_fetch_and_add(&n->refs, 1);
+			nodes[i++] = n;
+		}
 	}
+	pthread_rwlock_unlock(&node_lock);
 
-	node_array_obj = cJSON_CreateObject();
-	node_array = cJSON_AddArrayToObject(node_array_obj, "nodes");
-	cJSON_AddItemToArray(node_array, node);
+	*cnt = i;
+	return nodes;
+}
 
-	obj = cJSON_CreateObject();
-	cJSON_AddItemToObject(obj, "addnode", node_array_obj);
+void node_list_put(struct node **nodes, int cnt)
+{
+	int i;
 
-	poly_send(obj);
-	cJSON_Delete(obj);
+	for (i = 0; i < cnt; i++)
+		node_put(nodes[i]);
+	free(nodes);
+}
+
+/* Caller must hold node_lock for writing */
+static void node_link(struct node *n)
+{
+	n->next = NULL;  /* Just to be safe */
+	n->prev = node_tail;
+
+	if (!poly->nodelist)
+		poly->nodelist = n;
+	else
+		node_tail->next = n;
+	node_tail = n;
+	node_cnt++;
+
+	/* keep the index at most 3/4 full, growing it indexes n too */
+	if (node_cnt * 4 <= index_size * 3 || index_grow() != 0) {
+		if (index_size)
+			index_insert(n);
+	}
+}
+
+/*
+ * addNode
+ *
+ * Add a node to the node server's node list
+ */
+void addNode(struct node *n)
+{
+	pthread_rwlock_wrlock(&node_lock);
+	node_link(n);
+	pthread_rwlock_unlock(&node_lock);
+
+	/* Send node info to Polyglot */
+	msg_addnode(n);
 
 	return;
 }
 
+/*
+ * addNodes
+ *
+ * Add a group of nodes, such as the result of a discovery, to the
+ * node list.  The nodes are registered with Polyglot in the background,
+ * add_batch nodes per addnode message, and no more than add_window
+ * messages are sent ahead of Polyglot's results.  Use
+ * getAddNodesProgress() to follow the registration.
+ *
+ * Returns 0, or -1 if some nodes could not be queued for registration.
+ */
+int addNodes(struct node **nodes, int cnt)
+{
+	int i;
+
+	pthread_rwlock_wrlock(&node_lock);
+	for (i = 0; i < cnt; i++)
+		node_link(nodes[i]);
+	pthread_rwlock_unlock(&node_lock);
+
+	return reg_queue(nodes, cnt);
+}
+
+/*
+ * node_add_batch
+ *
+ * Send one addnode message for the nodes at these addresses.  Nodes
+ * that have been deleted since they were queued are skipped.  Returns
+ * the number of nodes sent; their addresses are moved to the front of
+ * addresses, ahead of the ones skipped.
+ */
+int node_add_batch(char **addresses, int cnt)
+{
+	struct msgbuf *mb;
+	struct node *n;
+	char *tmp;
+	int sent = 0;
+	int i;
+
+	mb = msg_buffer();
+	msg_literal(mb, "{\"addnode\":{\"nodes\":[");
+	pthread_rwlock_rdlock(&node_lock);
+	for (i = 0; i < cnt; i++) {
+		n = index_find(addresses[i]);
+		if (n == NULL)
+			continue;
+		if (sent)
+			msg_literal(mb, ",");
+		msg_append_node(mb, n);
+		tmp = addresses[sent];
+		addresses[sent++] = addresses[i];
+		addresses[i] = tmp;
+	}
+	pthread_rwlock_unlock(&node_lock);
+	msg_literal(mb, "]}");
+
+	if (sent == 0 || msg_send(mb) < 0)
+		return 0;
+
+	return sent;
+}
+
 /*
  * delNode
  *
@@ -407,38 +840,47 @@ void addNode(struct node *n)
  */
 void delNode(char *address)
 {
+	struct json_arena *arena;
 	struct node *tmp;
-	struct node *prev;
+	struct node *gone = NULL;
 	cJSON *obj, *addr;
 
 	/* Ask polyglot to delete the node */
+	arena = json_arena_begin();
 	obj = cJSON_CreateObject();
 	addr = cJSON_CreateObject();
 	cJSON_AddStringToObject(addr, "address", address);
 	cJSON_AddItemToObject(obj, "removenode", addr);
-	loggerf(DEBUG, "Calling polyglot to delete node %s\n", address);
+	LOGF(LOGSYS_NODES, DEBUG, "Calling polyglot to delete node %s\n", address);
 	poly_send(obj);
 	cJSON_Delete(obj);
+	json_arena_end(arena);
 
 
-	/* Delete node from internal node list */
-	if (poly->nodelist) {
-		tmp = poly->nodelist;
-		if (strcmp(tmp->address, address) == 0) {
+	/* Delete node(s) with this address from internal node list */
+	pthread_rwlock_wrlock(&node_lock);
+	while ((tmp = index_find(address)) != NULL) {
+		index_remove(tmp);
+		if (tmp->prev)
+			tmp->prev->next = tmp->next;
+		else
 			poly->nodelist = tmp->next;
-			free_node(tmp);
-		} else {
-			prev = tmp;
-			tmp = tmp->next;
-			while (tmp) {
-				if (strcmp(tmp->address, address) == 0) {
-					prev->next = tmp->next;
-					free_node(tmp);
-				}
-				tmp = tmp->next;
-			}
-		}
+		if (tmp->next)
+			tmp->next->prev = tmp->prev;
+		else
+			node_tail = tmp->prev;
+		node_cnt--;
+		tmp->next = gone;
+		gone = tmp;
+	}
+	pthread_rwlock_unlock(&node_lock);
+
+	/* Drop the list's references, work still using a node keeps it */
+	while ((tmp = gone) != NULL) {
+		gone = tmp->next;
+		node_put(tmp);
 	}
+
 	return;
 }
 
@@ -450,19 +892,18 @@ void delNode(char *address)
  * Python version returns the node 'dictionary' from the config. I think
  * this should return a pointer to the node structure.
  *
- * Returns pointer to node structure.
+ * Returns pointer to node structure, with a reference held so that a
+ * delNode() on another thread can't free it while it is in use.
+ * Release it with putNode().
  */
 struct node *getNode(char *address)
 {
 	struct node *tmp;
 
 	if (poly->nodelist) {
-		tmp = poly->nodelist;
-		while (tmp) {
-			if (strcmp(tmp->address, address) == 0)
-				return tmp;
-			tmp = tmp->next;
-		}
+		tmp = node_find(address);
+		if (tmp)
+			return tmp;
 		loggerf(ERROR, "Node address %s does not exist in node list\n", address);
 	} else {
 		logger(ERROR, "Node list does not exist.\n");
@@ -471,6 +912,17 @@ struct node *getNode(char *address)
 	return NULL;
 }
 
+/*
+ * putNode
+ *
+ * Release a node returned by getNode().  A node deleted while it was
+ * held is freed here.
+ */
+void putNode(struct node *n)
+{
+	node_put(n);
+}
+
 /*
  * getNodes
  *
@@ -481,6 +933,76 @@ struct node *getNodes(void)
 	return poly->nodelist;
 }
 
+#define RESYNC_NODE_BATCH 10
+
+/*
+ * node_resync
+ *
+ * Send every node in the node list to Polyglot again, followed by
+ * the current value of every driver.  Nodes are sent up to
+ * RESYNC_NODE_BATCH per addnode message and drivers status_batch per
+ * status message.
+ *
+ * Returns the number of nodes sent.
+ */
+int node_resync(void)
+{
+	struct msgbuf *mb;
+	struct node *n;
+	int nodes = 0;
+	int cnt;
+	int i;
+
+	pthread_rwlock_rdlock(&node_lock);
+	for (n = poly->nodelist; n; ) {
+		mb = msg_buffer();
+		msg_literal(mb, "{\"addnode\":{\"nodes\":[");
+		for (cnt = 0; n && cnt < RESYNC_NODE_BATCH; cnt++, n = n->next) {
+			if (cnt)
+				msg_literal(mb, ",");
+			msg_append_node(mb, n);
+		}
+		msg_literal(mb, "]}");
+		msg_send(mb);
+		nodes += cnt;
+	}
+
+	if (poly->options.status_batch <= 1) {
+		for (n = poly->nodelist; n; n = n->next)
+			for (i = 0; i < n->driver_cnt; i++)
+				msg_status(n->address, n->drivers[i].driver,
+						n->drivers[i].value, n->drivers[i].uom);
+		pthread_rwlock_unlock(&node_lock);
+		return nodes;
+	}
+
+	mb = msg_buffer();
+	cnt = 0;
+	for (n = poly->nodelist; n; n = n->next) {
+		for (i = 0; i < n->driver_cnt; i++) {
+			if (cnt == 0)
+				msg_literal(mb, "{\"status\":[");
+			else
+				msg_literal(mb, ",");
+			msg_append_status(mb, n->address, n->drivers[i].driver,
+					n->drivers[i].value, n->drivers[i].uom);
+			if (++cnt == poly->options.status_batch) {
+				msg_literal(mb, "]");
+				msg_send(mb);
+				mb = msg_buffer();
+				cnt = 0;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&node_lock);
+	if (cnt) {
+		msg_literal(mb, "]");
+		msg_send(mb);
+	}
+
+	return nodes;
+}
+
 /*
  * setNodeHint
  *
@@ -538,94 +1060,114 @@ void setNodeStatus(struct node *n, void (*funct)(struct node *n))
  *
  * An internal function that executes a node command by
  * looking up the command in the node's command list and
- * calling the command callback.
+ * calling the command callback.  args is the struct cmd_work
+ * with the detached tape of the command message.
  */
 void *node_cmd_exec(void *args)
 {
-	cJSON *msg = (cJSON *)args;
-	cJSON *addr, *cmd, *value, *uom;
+	static char no_value[] = "";
+	struct cmd_work *w = (struct cmd_work *)args;
+	struct jtape *msg = w->msg;
+	const char *addr, *cmd, *uom;
+	char *value;
 	struct node *tmp;
-	int i;
-
-	addr = cJSON_GetObjectItem(msg, "address");
-	cmd = cJSON_GetObjectItem(msg, "cmd");
-	if (!cJSON_HasObjectItem(msg, "value"))
-		cJSON_AddStringToObject(msg, "value", "");
-	value = cJSON_GetObjectItem(msg, "value");
-
-	if (!cJSON_HasObjectItem(msg, "uom"))
-		cJSON_AddStringToObject(msg, "uom", "0");
-	uom = cJSON_GetObjectItem(msg, "uom");
-
-	loggerf(DEBUG, "Process command %s\n", cJSON_Print(msg));
+	struct command *c;
+	int obj;
+
+	obj = tape_get(msg, TAPE_ROOT, "command");
+	addr = tape_cstr(msg, tape_get(msg, obj, "address"));
+	cmd = tape_cstr(msg, tape_get(msg, obj, "cmd"));
+	value = (char *)tape_cstr(msg, tape_get(msg, obj, "value"));
+	uom = tape_cstr(msg, tape_get(msg, obj, "uom"));
+	if (value == NULL)
+		value = no_value;
+
+	LOGF(LOGSYS_NODES, DEBUG, "Process command %s %s value=%s uom=%s\n",
+			addr ? addr : "-", cmd ? cmd : "-", value, uom ? uom : "-");
+
+	/* look up the node with this address */
+	if (addr == NULL || (tmp = node_find(addr)) == NULL)
+		return NULL;
 
-	if (poly->nodelist) {
-		tmp = poly->nodelist;
-		while (tmp) {
-			/* look up the node with this address */
-			if (strcmp(tmp->address, addr->valuestring) == 0) {
-				/*
-				 * call command callback with cmd->valuestring,
-				 * value->valuestring, and uom->valuestring
-				 */
-				for (i = 0; i < tmp->command_cnt; i++) {
-					if (strcmp(tmp->commands[i].id, cmd->valuestring) == 0) {
-						int iuom = 0;
-
-						if (uom->valuestring)
-							iuom = atoi(uom->valuestring);
-
-						loggerf(DEBUG, "callback(%s, %s, %d)\n",
-								cmd->valuestring,
-								value->valuestring,
-								iuom);
-						tmp->commands[i].callback(tmp, cmd->valuestring,
-								value->valuestring, iuom);
-					}
-				}
-				return NULL;
-			}
-			tmp = tmp->next;
+	/* call command callback with cmd, value and uom */
+	if (cmd == NULL) {
+		node_put(tmp);
+		return NULL;
+	}
+	c = command_by_handle(tmp, intern_find(cmd));
+	if (c) {
+		struct span_ctx trace;
+		long long start, end;
+		char label[32];
+		int iuom = 0;
+
+		if (uom)
+			iuom = atoi(uom);
+
+		LOGF(LOGSYS_NODES, DEBUG, "callback(%s, %s, %d)\n",
+				cmd,
+				value,
+				iuom);
+		/* every command added with this id, in the order added */
+		start = metrics_now();
+		for (;;) {
+			c->callback(tmp, (char *)cmd, value, iuom);
+			if (c->next == 0)
+				break;
+			c = &tmp->commands[c->next - 1];
+		}
+		end = metrics_now();
+		metrics_time(STAT_CMD_RUN, end - start);
+		metrics_time(STAT_CMD_LATENCY, end - w->rx);
+
+		trace = span_get();
+		if (trace.id) {
+			snprintf(label, sizeof(label), "%s %s", tmp->address, cmd);
+			span_record(trace.id, "callback", label, start, end);
+			span_record(trace.id, "command", label, trace.rx, end);
 		}
 	}
+	node_put(tmp);
 
 	return NULL;
 }
 
-void *node_query_exec(void *args)
+/*
+ * Report the drivers for the node with this address, or for every
+ * node if the address is "all".
+ */
+static void report_nodes(const char *addr)
 {
-	char *addr = (char *)args;
+	struct node **nodes;
 	struct node *tmp;
+	int cnt, i;
+
+	if (strcmp(addr, "all") != 0) {
+		tmp = node_find(addr);
+		if (tmp && tmp->ops.reportDrivers != NULL)
+			tmp->ops.reportDrivers(tmp);
+		node_put(tmp);
+		return;
+	}
 
-	if (poly->nodelist) {
-		tmp = poly->nodelist;
-		while (tmp) {
-			if (strcmp(addr, "all") == 0 ||
-					strcmp(addr, tmp->address) == 0) {
-				if (tmp->ops.reportDrivers != NULL)
-					tmp->ops.reportDrivers(tmp);
-			}
-		}
+	nodes = node_list_get(&cnt);
+	for (i = 0; i < cnt; i++) {
+		if (nodes[i]->ops.reportDrivers != NULL)
+			nodes[i]->ops.reportDrivers(nodes[i]);
 	}
+	node_list_put(nodes, cnt);
+}
+
+void *node_query_exec(void *args)
+{
+	report_nodes((char *)args);
 
 	return NULL;
 }
 
 void *node_status_exec(void *args)
 {
-	char *addr = (char *)args;
-	struct node *tmp;
-
-	if (poly->nodelist) {
-		tmp = poly->nodelist;
-		while (tmp) {
-			if (strcmp(addr, "all") == 0 ||
-					strcmp(addr, tmp->address) == 0) {
-				if (tmp->ops.reportDrivers != NULL)
-					tmp->ops.reportDrivers(tmp);
-			}
-		}
-	}
+	report_nodes((char *)args);
 
 	return NULL;
 }
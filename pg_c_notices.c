@@ -33,12 +33,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <mosquitto.h>
 #include "cJSON.h"
 #include "c_interface.h"
 #include "c_int_interface.h"
 
-extern struct mosquitto *mosq;
 extern struct profile *poly;
 
 /*
@@ -48,19 +46,27 @@ extern struct profile *poly;
  */
 void addNotice(char *key, char *notice)
 {
+	struct json_arena *arena;
 	cJSON *msg;
 	cJSON *data;
 	// message = {'addnotice': {'key': key, 'value': notice}}
 	
+	arena = json_arena_begin();
 	data = cJSON_CreateObject();
 	cJSON_AddStringToObject(data, "key", key);
 	cJSON_AddStringToObject(data, "value", notice);
 	msg = cJSON_CreateObject();
 	cJSON_AddItemToObject(msg, "addnotice", data);
-	loggerf(DEBUG, "Adding notice: %s\n", cJSON_Print(msg));
+	if (logger_on(LOGSYS_NOTICES, DEBUG)) {
+		char *text = cJSON_Print(msg);
+
+		loggerf_sub(LOGSYS_NOTICES, DEBUG, "Adding notice: %s\n", text);
+		cJSON_free(text);
+	}
 	poly_send(msg);
 
 	cJSON_Delete(msg);
+	json_arena_end(arena);
 
 	return;
 }
@@ -72,16 +78,19 @@ void addNotice(char *key, char *notice)
  */
 void removeNotice(char *key)
 {
+	struct json_arena *arena;
 	cJSON *msg;
 	cJSON *data;
 	// message = {'removenotice': {'key': key}}
 
+	arena = json_arena_begin();
 	data = cJSON_CreateObject();
 	cJSON_AddStringToObject(data, "key", key);
 	msg = cJSON_CreateObject();
 	cJSON_AddItemToObject(msg, "removenotice", data);
 	poly_send(msg);
 	cJSON_Delete(msg);
+	json_arena_end(arena);
 
 	return;
 
@@ -94,21 +103,7 @@ void removeNotice(char *key)
  */
 void removeNoticesAll(void)
 {
-	cJSON *cfg;
-	cJSON *notices;
-	cJSON *item;
-	int i;
-	
-	cfg = cJSON_Parse(poly->config);
-	notices = cJSON_GetObjectItem(cfg, "notices");
-
-	if (notices) {
-		// list of string objects
-		for (i = 0; i < cJSON_GetArraySize(notices); i++) {
-			item = cJSON_GetArrayItem(notices, i);
-			removeNotice(item->string);
-		}
-	}
+	config_keys(CFG_NOTICES, removeNotice);
 
 	return;
 }
@@ -122,26 +117,5 @@ void removeNoticesAll(void)
  */
 struct pair *getNotices(void)
 {
-	cJSON *cfg;
-	cJSON *notices;
-	cJSON *item;
-	struct pair *p = NULL, *tmp;
-	int i;
-
-	cfg = cJSON_Parse(poly->config);
-	notices = cJSON_GetObjectItem(cfg, "notices");
-
-	if (notices) {
-		for (i = 0; i < cJSON_GetArraySize(notices); i++) {
-			item = cJSON_GetArrayItem(notices, i);
-			tmp = malloc(sizeof(struct pair));
-			tmp->key = strdup(item->string);
-			tmp->value = strdup(item->valuestring);
-			tmp->flags = 0;
-			tmp->next = p;
-			p = tmp;
-		}
-	}
-
-	return p;
+	return config_pairs(CFG_NOTICES);
 }
@@ -0,0 +1,483 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_outq.c
+ *
+ * Outbound message queue.  Every message sent to Polyglot is copied
+ * into a fixed size ring buffer and published, in order, by a sender
+ * thread.  While the MQTT connection is down the messages stay in the
+ * ring and are sent once the connection comes back.
+ *
+ * Status messages carry a key (address and driver).  If a status
+ * message for the same key is still waiting in the queue, it is
+ * replaced by the new one rather than sending both.
+ *
+ * The ring size (send_queue_bytes) bounds the memory used.  When the
+ * ring is full, new messages are dropped.  Once the ring is more than
+ * 3/4 full, getSendQueue() reports backpressure so the node server can
+ * slow down.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+#define OUTQ_ALIGN    8
+#define OUTQ_BUCKETS  1024
+
+#define REC_DEAD      0x01   /* replaced by a newer status, skip it */
+#define REC_WRAP      0x02   /* padding to the end of the ring */
+#define REC_KEYED     0x04   /* status message in the key index */
+
+/*
+ * Each record in the ring is a header followed by the key (if any)
+ * and then the message.  Records are padded to OUTQ_ALIGN.
+ */
+struct outq_rec {
+	uint32_t size;       /* total record size, including header */
+	uint32_t len;        /* message length */
+	uint32_t hash;       /* key hash */
+	int32_t hnext;       /* next record in hash bucket, -1 = end */
+	uint16_t key_len;
+	uint16_t flags;
+	uint32_t trace;      /* trace ID of the command that sent this */
+	int64_t queued_at;   /* when traced */
+};
+
+static pthread_mutex_t oq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t oq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t oq_sent = PTHREAD_COND_INITIALIZER;
+static char *oq_ring;
+static size_t oq_size;
+static size_t oq_head;       /* oldest record */
+static size_t oq_tail;       /* where the next record goes */
+static size_t oq_used;       /* bytes in use, including padding */
+static int oq_depth;         /* messages waiting */
+static unsigned long oq_dropped;
+static unsigned long oq_added;      /* records ever queued */
+static unsigned long oq_finished;   /* records sent or replaced */
+static int32_t oq_buckets[OUTQ_BUCKETS];
+
+#define REC(off) ((struct outq_rec *)(oq_ring + (off)))
+#define REC_KEY(r) ((char *)(r) + sizeof(struct outq_rec))
+#define REC_MSG(r) (REC_KEY(r) + (r)->key_len)
+
+static uint32_t key_hash(const char *key, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Find the waiting record with this key.  Returns the offset of the
+ * record or -1.
+ */
+static int32_t key_find(const char *key, size_t len, uint32_t hash)
+{
+	int32_t off;
+	struct outq_rec *r;
+
+	for (off = oq_buckets[hash % OUTQ_BUCKETS]; off >= 0; off = r->hnext) {
+		r = REC(off);
+		if (r->hash == hash && r->key_len == len &&
+				memcmp(REC_KEY(r), key, len) == 0)
+			return off;
+	}
+
+	return -1;
+}
+
+static void key_unlink(int32_t target)
+{
+	struct outq_rec *r = REC(target);
+	int32_t *link;
+
+	link = &oq_buckets[r->hash % OUTQ_BUCKETS];
+	while (*link >= 0) {
+		if (*link == target) {
+			*link = r->hnext;
+			break;
+		}
+		link = &REC(*link)->hnext;
+	}
+	r->flags &= ~REC_KEYED;
+}
+
+/*
+ * Reserve need bytes in the ring.  Returns the offset or -1 if there
+ * isn't enough free space.
+ */
+static long ring_alloc(size_t need)
+{
+	size_t off;
+
+	if (oq_used == 0) {
+		oq_head = 0;
+		oq_tail = 0;
+	}
+
+	if (oq_used == 0 || oq_tail > oq_head) {
+		/* free space is [tail, size) and [0, head) */
+		if (oq_size - oq_tail >= need) {
+			off = oq_tail;
+		} else if (oq_used != 0 && oq_head >= need) {
+			/* skip the end of the ring and start over at 0 */
+			if (oq_size - oq_tail >= sizeof(struct outq_rec)) {
+				REC(oq_tail)->size = oq_size - oq_tail;
+				REC(oq_tail)->flags = REC_WRAP;
+			}
+			oq_used += oq_size - oq_tail;
+			off = 0;
+		} else {
+			return -1;
+		}
+	} else if (oq_tail < oq_head && oq_head - oq_tail >= need) {
+		off = oq_tail;
+	} else {
+		return -1;
+	}
+
+	oq_tail = off + need;
+	if (oq_tail == oq_size)
+		oq_tail = 0;
+	oq_used += need;
+
+	return (long)off;
+}
+
+/*
+ * Drop any padding or dead records at the head of the ring and
+ * return the first record that needs to be sent, or NULL.
+ */
+static struct outq_rec *ring_peek(void)
+{
+	struct outq_rec *r;
+	size_t skip;
+
+	while (oq_used) {
+		if (oq_size - oq_head < sizeof(struct outq_rec)) {
+			skip = oq_size - oq_head;
+		} else {
+			r = REC(oq_head);
+			if (!(r->flags & (REC_DEAD | REC_WRAP)))
+				return r;
+			skip = r->size;
+		}
+		oq_used -= skip;
+		oq_head += skip;
+		if (oq_head >= oq_size)
+			oq_head = 0;
+	}
+
+	return NULL;
+}
+
+static void ring_pop(void)
+{
+	struct outq_rec *r = REC(oq_head);
+
+	oq_used -= r->size;
+	oq_head += r->size;
+	if (oq_head >= oq_size)
+		oq_head = 0;
+	oq_depth--;
+	oq_finished++;
+	pthread_cond_broadcast(&oq_sent);
+}
+
+static void *outq_thread(void *args)
+{
+	struct iface_transport *t = poly->options.transport;
+	struct outq_rec *r;
+	struct timespec retry;
+	int ret;
+	(void)args;
+
+	pthread_mutex_lock(&oq_lock);
+	for (;;) {
+		while (!poly->connected || (r = ring_peek()) == NULL)
+			pthread_cond_wait(&oq_cond, &oq_lock);
+
+		/*
+		 * Once the record is out of the key index, nothing else
+		 * touches it, so it can be published without the lock.
+		 */
+		if (r->flags & REC_KEYED)
+			key_unlink(oq_head);
+		pthread_mutex_unlock(&oq_lock);
+
+		ret = t->publish(t, poly->topic, REC_MSG(r), (int)r->len);
+
+		metrics_sent(r->len, ret == 0);
+		if (r->trace && ret == 0)
+			span_record(r->trace, "publish", NULL, r->queued_at,
+					metrics_now());
+		pthread_mutex_lock(&oq_lock);
+		if (ret == 0) {
+			ring_pop();
+			continue;
+		}
+
+		/* Leave it at the head and try again in a bit */
+		loggerf(ERROR, "Failed to publish message to Polyglot (%d)\n", ret);
+		clock_gettime(CLOCK_REALTIME, &retry);
+		retry.tv_sec++;
+		pthread_cond_timedwait(&oq_cond, &oq_lock, &retry);
+	}
+
+	return NULL;
+}
+
+/*
+ * outq_start
+ *
+ * Allocate the ring buffer and start the sender thread.
+ */
+int outq_start(size_t bytes)
+{
+	pthread_t thread;
+	int i;
+
+	oq_size = (bytes + OUTQ_ALIGN - 1) & ~(size_t)(OUTQ_ALIGN - 1);
+	oq_ring = malloc(oq_size);
+	if (oq_ring == NULL) {
+		logger(ERROR, "Failed to allocate the send queue\n");
+		return -1;
+	}
+
+	for (i = 0; i < OUTQ_BUCKETS; i++)
+		oq_buckets[i] = -1;
+
+	if (pthread_create(&thread, NULL, outq_thread, NULL) != 0) {
+		loggerf(ERROR, "Failed to start send queue thread (%d)\n", errno);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * outq_wake
+ *
+ * Called when the connection state changes so the sender thread
+ * can start (or stop) draining the queue.
+ */
+void outq_wake(void)
+{
+	pthread_mutex_lock(&oq_lock);
+	pthread_cond_broadcast(&oq_cond);
+	pthread_mutex_unlock(&oq_lock);
+}
+
+/*
+ * outq_put
+ *
+ * Queue a message to be published.  If address and driver are not
+ * NULL, this is a status message and replaces any waiting status
+ * message for the same address and driver.
+ *
+ * Returns the number of messages waiting or -1 if the message was
+ * dropped because the queue is full.  A message too large for the
+ * queue is published directly if connected, otherwise it is dropped.
+ */
+int outq_put(const char *msg, size_t len, const char *address,
+		const char *driver)
+{
+	struct outq_rec *r;
+	char key[256];
+	size_t key_len = 0;
+	uint32_t hash = 0;
+	int32_t old = -1;
+	size_t need;
+	struct span_ctx trace = span_get();
+	struct iface_transport *t = poly->options.transport;
+	long off;
+	int depth;
+
+	if (address && driver) {
+		key_len = snprintf(key, sizeof(key), "%s/%s", address, driver);
+		if (key_len >= sizeof(key))
+			key_len = 0;
+		else
+			hash = key_hash(key, key_len);
+	}
+
+	need = sizeof(struct outq_rec) + key_len + len;
+	need = (need + OUTQ_ALIGN - 1) & ~(size_t)(OUTQ_ALIGN - 1);
+
+	if (need > oq_size) {
+		/* Too big to ever fit, send it now if we can */
+		if (!poly->connected || t->publish(t, poly->topic, msg,
+					(int)len) != 0) {
+			logger(ERROR, "Message too large for send queue, dropped\n");
+			metrics_dropped();
+			return -1;
+		}
+		metrics_sent(len, 1);
+		getSendQueue(&depth, NULL);
+		return depth;
+	}
+
+	pthread_mutex_lock(&oq_lock);
+	if (key_len) {
+		old = key_find(key, key_len, hash);
+		if (old >= 0 && REC(old)->size >= need) {
+			/* replace the waiting status in place */
+			r = REC(old);
+			r->len = len;
+			r->trace = trace.id;
+			r->queued_at = trace.id ? metrics_now() : 0;
+			memcpy(REC_MSG(r), msg, len);
+			depth = oq_depth;
+			pthread_mutex_unlock(&oq_lock);
+			return depth;
+		}
+	}
+
+	off = ring_alloc(need);
+	if (off < 0) {
+		oq_dropped++;
+		pthread_mutex_unlock(&oq_lock);
+		metrics_dropped();
+		loggerf(ERROR, "Send queue full, dropping message (%lu dropped)\n",
+				oq_dropped);
+		return -1;
+	}
+
+	if (old >= 0) {
+		key_unlink(old);
+		REC(old)->flags |= REC_DEAD;
+		oq_depth--;
+		oq_finished++;
+	}
+
+	r = REC(off);
+	r->size = need;
+	r->len = len;
+	r->hash = hash;
+	r->key_len = key_len;
+	r->flags = 0;
+	r->hnext = -1;
+	r->trace = trace.id;
+	r->queued_at = trace.id ? metrics_now() : 0;
+	memcpy(REC_KEY(r), key, key_len);
+	memcpy(REC_MSG(r), msg, len);
+	if (key_len) {
+		r->hnext = oq_buckets[hash % OUTQ_BUCKETS];
+		oq_buckets[hash % OUTQ_BUCKETS] = off;
+		r->flags |= REC_KEYED;
+	}
+	oq_depth++;
+	oq_added++;
+	depth = oq_depth;
+
+	pthread_cond_signal(&oq_cond);
+	pthread_mutex_unlock(&oq_lock);
+
+	return depth;
+}
+
+/*
+ * outq_mark
+ *
+ * Return a mark for everything queued so far, to pass to outq_wait().
+ */
+unsigned long outq_mark(void)
+{
+	unsigned long mark;
+
+	pthread_mutex_lock(&oq_lock);
+	mark = oq_added;
+	pthread_mutex_unlock(&oq_lock);
+
+	return mark;
+}
+
+/*
+ * outq_wait
+ *
+ * Wait up to timeout_ms for everything queued before mark to be sent
+ * (or replaced by a newer status).  Returns 0 once it has been sent
+ * or -1 on timeout.
+ */
+int outq_wait(unsigned long mark, int timeout_ms)
+{
+	struct timespec deadline;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&oq_lock);
+	while ((long)(oq_finished - mark) < 0 && ret == 0)
+		ret = pthread_cond_timedwait(&oq_sent, &oq_lock, &deadline);
+	ret = (long)(oq_finished - mark) < 0 ? -1 : 0;
+	pthread_mutex_unlock(&oq_lock);
+
+	return ret;
+}
+
+/*
+ * getSendQueue
+ *
+ * Return the number of messages and bytes waiting to be sent to
+ * Polyglot.  Either pointer may be NULL.
+ *
+ * Returns true when the queue is more than 3/4 full and the node
+ * server should slow down.
+ */
+int getSendQueue(int *depth, int *bytes)
+{
+	int busy;
+
+	pthread_mutex_lock(&oq_lock);
+	if (depth)
+		*depth = oq_depth;
+	if (bytes)
+		*bytes = (int)oq_used;
+	busy = oq_used > (oq_size / 4) * 3;
+	pthread_mutex_unlock(&oq_lock);
+
+	return busy;
+}
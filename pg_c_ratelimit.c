@@ -0,0 +1,569 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_ratelimit.c
+ *
+ * Driver status rate limiting using token buckets.  There is one
+ * global bucket (rate_limit/rate_burst options) and optional buckets
+ * per node or per driver, set with setRateLimit().  A status report
+ * takes one token from each bucket that applies.
+ *
+ * When a bucket is empty the report is held.  Only the newest value
+ * for each address/driver is kept and it is sent once all of its
+ * buckets have refilled.  Each held value that gets replaced before
+ * it was sent counts as suppressed.
+ *
+ * The same table holds the trailing report of a driver with a
+ * minimum report interval (see addDriverFiltered), which waits for
+ * its due time as well as its buckets.
+ *
+ * A held value stays in the table, marked as sending, until it has
+ * been sent.  A report for that driver in the meantime is held behind
+ * it, so an older value can never be sent after a newer one.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+#define RATE_BUCKETS 256
+
+struct bucket {
+	double rate;          /* tokens per second, 0 = no limit */
+	double burst;
+	double tokens;
+	struct timespec last;
+};
+
+struct driver_limit {
+	char *driver;
+	struct bucket b;
+};
+
+struct rate_limit {
+	struct bucket node;
+	struct driver_limit *drivers;
+	int driver_cnt;
+};
+
+struct held_status {
+	struct node *n;
+	char *address;
+	char *driver;
+	char *value;
+	int uom;
+	long long due;               /* monotonic ms to send at, 0 = now */
+	int sending;                 /* taken by rate_thread, not queued */
+	struct held_status *hnext;   /* hash chain */
+	struct held_status *next;    /* send order */
+};
+
+static pthread_mutex_t rl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rl_cond = PTHREAD_COND_INITIALIZER;
+static struct bucket rl_global;
+static struct held_status *rl_table[RATE_BUCKETS];
+static struct held_status *rl_head;
+static struct held_status *rl_tail;
+static unsigned long rl_delayed;
+static unsigned long rl_suppressed;
+
+static unsigned int rl_hash(const char *address, const char *driver)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*address) {
+		hash ^= (unsigned char)*address++;
+		hash *= 16777619u;
+	}
+	hash ^= '/';
+	hash *= 16777619u;
+	while (*driver) {
+		hash ^= (unsigned char)*driver++;
+		hash *= 16777619u;
+	}
+
+	return hash % RATE_BUCKETS;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void bucket_init(struct bucket *b, int rate, int burst)
+{
+	b->rate = rate > 0 ? rate : 0;
+	b->burst = burst > 0 ? burst : 1;
+	b->tokens = b->burst;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+static void bucket_refill(struct bucket *b, struct timespec *now)
+{
+	double secs;
+
+	secs = (now->tv_sec - b->last.tv_sec) +
+		(now->tv_nsec - b->last.tv_nsec) / 1e9;
+	b->tokens += secs * b->rate;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last = *now;
+}
+
+/*
+ * ms until the bucket has a token, 0 if it has one now.
+ */
+static long bucket_wait(struct bucket *b, struct timespec *now)
+{
+	if (b->rate == 0)
+		return 0;
+	bucket_refill(b, now);
+	if (b->tokens >= 1)
+		return 0;
+	return (long)((1 - b->tokens) * 1000 / b->rate) + 1;
+}
+
+static struct bucket *driver_bucket(struct rate_limit *rl, const char *driver)
+{
+	int i;
+
+	for (i = 0; i < rl->driver_cnt; i++)
+		if (strcmp(rl->drivers[i].driver, driver) == 0)
+			return &rl->drivers[i].b;
+
+	return NULL;
+}
+
+/*
+ * Collect the buckets that apply to a driver status.  Returns the
+ * number of buckets.
+ */
+static int status_buckets(struct node *n, const char *driver,
+		struct bucket *b[3])
+{
+	int cnt = 0;
+
+	if (rl_global.rate)
+		b[cnt++] = &rl_global;
+	if (n->limit) {
+		if (n->limit->node.rate)
+			b[cnt++] = &n->limit->node;
+		if ((b[cnt] = driver_bucket(n->limit, driver)) != NULL &&
+				b[cnt]->rate)
+			cnt++;
+	}
+
+	return cnt;
+}
+
+/*
+ * Take a token from every bucket, or none of them.  Returns 0 if the
+ * tokens were taken, otherwise the ms until they will be available.
+ */
+static long take_tokens(struct bucket **b, int cnt)
+{
+	struct timespec now;
+	long wait = 0;
+	long w;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < cnt; i++) {
+		w = bucket_wait(b[i], &now);
+		if (w > wait)
+			wait = w;
+	}
+	if (wait)
+		return wait;
+
+	for (i = 0; i < cnt; i++)
+		b[i]->tokens -= 1;
+
+	return 0;
+}
+
+static void free_held(struct held_status *h)
+{
+	free(h->address);
+	free(h->driver);
+	free(h->value);
+	free(h);
+}
+
+static void unlink_held(struct held_status *h)
+{
+	struct held_status **link;
+
+	link = &rl_table[rl_hash(h->address, h->driver)];
+	while (*link != h)
+		link = &(*link)->hnext;
+	*link = h->hnext;
+}
+
+static void *rate_thread(void *args)
+{
+	struct held_status *h, **link, *send, **send_tail;
+	struct bucket *b[3];
+	struct timespec deadline;
+	long long now;
+	long wait, w;
+	(void)args;
+
+	pthread_mutex_lock(&rl_lock);
+	for (;;) {
+		while (rl_head == NULL)
+			pthread_cond_wait(&rl_cond, &rl_lock);
+
+		/* Pull out everything that can go now, in the order held */
+		send = NULL;
+		send_tail = &send;
+		wait = 1000;
+		rl_tail = NULL;
+		now = now_ms();
+		for (link = &rl_head; (h = *link) != NULL; ) {
+			if (h->due > now)
+				w = (long)(h->due - now);
+			else
+				w = take_tokens(b, status_buckets(h->n, h->driver, b));
+			if (w == 0) {
+				*link = h->next;
+				h->sending = 1;
+				h->next = NULL;
+				*send_tail = h;
+				send_tail = &h->next;
+				continue;
+			}
+			if (w < wait)
+				wait = w;
+			rl_tail = h;
+			link = &h->next;
+		}
+
+		pthread_mutex_unlock(&rl_lock);
+		for (h = send; h; h = h->next)
+			status_send(h->address, h->driver, h->value, h->uom);
+		pthread_mutex_lock(&rl_lock);
+
+		while (send) {
+			h = send;
+			send = h->next;
+			unlink_held(h);
+			free_held(h);
+		}
+
+		if (rl_head == NULL)
+			continue;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += wait / 1000;
+		deadline.tv_nsec += (wait % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&rl_cond, &rl_lock, &deadline);
+	}
+
+	return NULL;
+}
+
+/*
+ * rate_start
+ *
+ * Set up the global bucket and start the thread that sends held
+ * status reports.
+ */
+int rate_start(void)
+{
+	pthread_t thread;
+
+	bucket_init(&rl_global, poly->options.rate_limit,
+			poly->options.rate_burst);
+
+	if (pthread_create(&thread, NULL, rate_thread, NULL) != 0) {
+		loggerf(ERROR, "Failed to start rate limit thread (%d)\n", errno);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * Find the held value for a driver that hasn't been taken for
+ * sending yet, noting in *sending if one is being sent.  Caller must
+ * hold rl_lock.
+ */
+static struct held_status *held_find(struct node *n, struct driver *d,
+		unsigned int hv, int *sending)
+{
+	struct held_status *h;
+
+	for (h = rl_table[hv]; h; h = h->hnext) {
+		if (h->n != n || strcmp(h->driver, d->driver) != 0)
+			continue;
+		if (!h->sending)
+			return h;
+		*sending = 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Replace a held value with the driver's current one.
+ */
+static void held_replace(struct held_status *h, struct driver *d)
+{
+	char *v;
+
+	v = strdup(d->value);
+	if (v) {
+		free(h->value);
+		h->value = v;
+		h->uom = d->uom;
+	}
+}
+
+/*
+ * Hold the driver's current value.  Returns NULL if there is no memory
+ * for it.  Caller must hold rl_lock.
+ */
+static struct held_status *held_add(struct node *n, struct driver *d,
+		unsigned int hv)
+{
+	struct held_status *h;
+
+	h = calloc(1, sizeof(struct held_status));
+	if (h == NULL || (h->address = strdup(n->address)) == NULL ||
+			(h->driver = strdup(d->driver)) == NULL ||
+			(h->value = strdup(d->value)) == NULL) {
+		if (h)
+			free_held(h);
+		return NULL;
+	}
+	h->n = n;
+	h->uom = d->uom;
+
+	h->hnext = rl_table[hv];
+	rl_table[hv] = h;
+	if (rl_tail)
+		rl_tail->next = h;
+	else
+		rl_head = h;
+	rl_tail = h;
+
+	pthread_cond_signal(&rl_cond);
+
+	return h;
+}
+
+/*
+ * rate_status
+ *
+ * Check a driver status report against the rate limits.  Returns 0
+ * if the report can be sent now or -1 if it is being held and will
+ * be sent later.
+ */
+int rate_status(struct node *n, struct driver *d)
+{
+	struct held_status *h;
+	struct bucket *b[3];
+	unsigned int hv;
+	int sending = 0;
+	int cnt;
+
+	/* A filtered driver can have a trailing report held */
+	if (rl_global.rate == 0 && n->limit == NULL && !d->filtered)
+		return 0;
+
+	hv = rl_hash(n->address, d->driver);
+
+	pthread_mutex_lock(&rl_lock);
+	/* Already holding a value for this driver, replace it */
+	h = held_find(n, d, hv, &sending);
+	if (h) {
+		held_replace(h, d);
+		rl_suppressed++;
+		pthread_mutex_unlock(&rl_lock);
+		return -1;
+	}
+
+	/* An older value is being sent, this one has to wait for it */
+	cnt = status_buckets(n, d->driver, b);
+	if (!sending && (cnt == 0 || take_tokens(b, cnt) == 0)) {
+		pthread_mutex_unlock(&rl_lock);
+		return 0;
+	}
+
+	if (held_add(n, d, hv) == NULL) {
+		/* can't hold it, so just send it */
+		pthread_mutex_unlock(&rl_lock);
+		return 0;
+	}
+	rl_delayed++;
+	pthread_mutex_unlock(&rl_lock);
+
+	return -1;
+}
+
+/*
+ * rate_defer
+ *
+ * Hold the driver's current value and send it in ms, subject to the
+ * rate limits.  If a value is already held for the driver it is
+ * replaced and keeps its place.
+ */
+void rate_defer(struct node *n, struct driver *d, long ms)
+{
+	struct held_status *h;
+	unsigned int hv;
+	int sending = 0;
+
+	hv = rl_hash(n->address, d->driver);
+
+	pthread_mutex_lock(&rl_lock);
+	h = held_find(n, d, hv, &sending);
+	if (h) {
+		held_replace(h, d);
+	} else if ((h = held_add(n, d, hv)) != NULL) {
+		h->due = now_ms() + ms;
+	} else {
+		/* can't hold it, so just send it */
+		pthread_mutex_unlock(&rl_lock);
+		status_send(n->address, d->driver, d->value, d->uom);
+		return;
+	}
+	pthread_mutex_unlock(&rl_lock);
+}
+
+/*
+ * rate_forget
+ *
+ * Drop any held reports and the rate limits for a node that is
+ * being deleted.
+ */
+void rate_forget(struct node *n)
+{
+	struct held_status *h, **link;
+	int i;
+
+	pthread_mutex_lock(&rl_lock);
+	rl_tail = NULL;
+	for (link = &rl_head; (h = *link) != NULL; ) {
+		if (h->n == n) {
+			*link = h->next;
+			unlink_held(h);
+			free_held(h);
+			continue;
+		}
+		rl_tail = h;
+		link = &h->next;
+	}
+
+	if (n->limit) {
+		for (i = 0; i < n->limit->driver_cnt; i++)
+			free(n->limit->drivers[i].driver);
+		free(n->limit->drivers);
+		free(n->limit);
+		n->limit = NULL;
+	}
+	pthread_mutex_unlock(&rl_lock);
+}
+
+/*
+ * setRateLimit
+ *
+ * Limit driver status reports for a node to rate per second, with
+ * bursts of up to burst reports.  If driver is not NULL, the limit
+ * applies only to that driver.  A rate of 0 removes the limit.
+ *
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int setRateLimit(struct node *n, char *driver, int rate, int burst)
+{
+	struct driver_limit *dl;
+	struct bucket *b;
+	int ret = 0;
+
+	pthread_mutex_lock(&rl_lock);
+	if (n->limit == NULL) {
+		n->limit = calloc(1, sizeof(struct rate_limit));
+		if (n->limit == NULL) {
+			pthread_mutex_unlock(&rl_lock);
+			return -1;
+		}
+	}
+
+	if (driver == NULL) {
+		bucket_init(&n->limit->node, rate, burst);
+	} else if ((b = driver_bucket(n->limit, driver)) != NULL) {
+		bucket_init(b, rate, burst);
+	} else {
+		dl = realloc(n->limit->drivers,
+				(n->limit->driver_cnt + 1) * sizeof(struct driver_limit));
+		if (dl == NULL) {
+			ret = -1;
+		} else {
+			n->limit->drivers = dl;
+			dl += n->limit->driver_cnt;
+			dl->driver = strdup(driver);
+			if (dl->driver == NULL) {
+				ret = -1;
+			} else {
+				bucket_init(&dl->b, rate, burst);
+				n->limit->driver_cnt++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&rl_lock);
+
+	return ret;
+}
+
+/*
+ * getRateLimitStats
+ *
+ * Return the number of status reports that were held back by a rate
+ * limit (delayed) and the number that were replaced by a newer value
+ * before they could be sent (suppressed).  Either pointer may be NULL.
+ */
+void getRateLimitStats(unsigned long *delayed, unsigned long *suppressed)
+{
+	pthread_mutex_lock(&rl_lock);
+	if (delayed)
+		*delayed = rl_delayed;
+	if (suppressed)
+		*suppressed = rl_suppressed;
+	pthread_mutex_unlock(&rl_lock);
+}
@@ -0,0 +1,313 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_register.c
+ *
+ * Paced node registration for addNodes().  Queued node addresses are
+ * sent to Polyglot add_batch nodes per addnode message.  Polyglot
+ * answers each node with a result message, and new batches are only
+ * sent while fewer than add_window batches worth of nodes are waiting
+ * for their results, so a large discovery goes out as fast as
+ * Polyglot and the ISY can take it instead of all at once.
+ *
+ * Results are matched by address against the nodes in flight, so a
+ * result for a node added with addNode(), or for one written off in
+ * an earlier registration, doesn't count toward this one.
+ *
+ * If no result arrives for ADD_RESULT_TIMEOUT ms, the nodes in flight
+ * are written off so that registration can't stall forever.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+extern struct profile *poly;
+
+#define ADD_RESULT_TIMEOUT 10000   /* ms to wait for addnode results */
+#define ADD_POLL           250     /* ms between checks while waiting */
+
+struct reg_entry {
+	char *address;
+	struct reg_entry *next;
+};
+
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reg_cond = PTHREAD_COND_INITIALIZER;
+static struct reg_entry *reg_head;
+static struct reg_entry *reg_tail;
+static struct reg_entry *reg_flight;   /* sent, waiting for a result */
+static int reg_queued;        /* waiting to be sent */
+static int reg_inflight;      /* entries on reg_flight */
+static int reg_sent;
+static int reg_added;
+static int reg_failed;
+static long long reg_last;    /* last send or result */
+static long long reg_begin;   /* start of the current registration */
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Caller must hold reg_lock */
+static void reg_wait(long ms)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&reg_cond, &reg_lock, &deadline);
+}
+
+/*
+ * Remove the in flight entry for address and free it, matching the
+ * address string itself if same is set.  Returns 0, or -1 if address
+ * isn't in flight.  Caller must hold reg_lock.
+ */
+static int flight_remove(const char *address, int same)
+{
+	struct reg_entry *e, **link;
+
+	for (link = &reg_flight; (e = *link) != NULL; link = &e->next) {
+		if (same ? e->address == address :
+				strcmp(e->address, address) == 0) {
+			*link = e->next;
+			free(e->address);
+			free(e);
+			reg_inflight--;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Can another batch be sent?  Caller must hold reg_lock.
+ */
+static int reg_ready(void)
+{
+	int batch = poly->options.add_batch;
+	int window = poly->options.add_window * batch;
+
+	if (reg_queued == 0 || !poly->connected)
+		return 0;
+
+	if (reg_inflight > 0 && reg_inflight + batch > window) {
+		if (now_ms() - reg_last < ADD_RESULT_TIMEOUT)
+			return 0;
+		loggerf(WARNING, "No addnode result for %d nodes after %d ms\n",
+				reg_inflight, ADD_RESULT_TIMEOUT);
+		reg_failed += reg_inflight;
+		while (reg_flight)
+			flight_remove(reg_flight->address, 1);
+	}
+
+	return 1;
+}
+
+static void *reg_thread(void *args)
+{
+	struct reg_entry *e;
+	char **batch;
+	int cnt;
+	int sent;
+	int i;
+	(void)args;
+
+	batch = malloc(poly->options.add_batch * sizeof(char *));
+	if (batch == NULL) {
+		logger(ERROR, "Failed to allocate memory for node registration\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&reg_lock);
+	for (;;) {
+		if (reg_queued == 0 && reg_inflight == 0) {
+			if (reg_begin) {
+				loggerf(INFO, "Registered %d nodes (%d failed) in %lld ms\n",
+						reg_added, reg_failed, now_ms() - reg_begin);
+				reg_begin = 0;
+			}
+			pthread_cond_wait(&reg_cond, &reg_lock);
+			continue;
+		}
+		if (!reg_ready()) {
+			reg_wait(ADD_POLL);
+			continue;
+		}
+
+		/* In flight before it is sent, a result can come back at once */
+		for (cnt = 0; cnt < poly->options.add_batch && reg_head; cnt++) {
+			e = reg_head;
+			reg_head = e->next;
+			batch[cnt] = e->address;
+			e->next = reg_flight;
+			reg_flight = e;
+		}
+		if (reg_head == NULL)
+			reg_tail = NULL;
+		reg_queued -= cnt;
+		reg_inflight += cnt;
+		reg_last = now_ms();
+		pthread_mutex_unlock(&reg_lock);
+
+		sent = node_add_batch(batch, cnt);
+
+		/* The nodes that weren't sent won't get a result */
+		pthread_mutex_lock(&reg_lock);
+		for (i = sent; i < cnt; i++)
+			flight_remove(batch[i], 1);
+		reg_sent += sent;
+		LOGF(LOGSYS_NODES, DEBUG, "addnode sent %d nodes, %d waiting, %d in flight\n",
+				sent, reg_queued, reg_inflight);
+	}
+
+	return NULL;
+}
+
+/*
+ * reg_start
+ *
+ * Start the node registration thread.
+ */
+int reg_start(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, reg_thread, NULL) != 0) {
+		loggerf(ERROR, "Failed to start node registration thread (%d)\n",
+				errno);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * reg_queue
+ *
+ * Queue nodes to be registered with Polyglot.  Returns 0, or -1 if
+ * memory ran out and only some of the nodes were queued.
+ */
+int reg_queue(struct node **nodes, int cnt)
+{
+	struct reg_entry *head = NULL;
+	struct reg_entry *last = NULL;
+	struct reg_entry *e;
+	int ret = 0;
+	int queued;
+
+	for (queued = 0; queued < cnt; queued++) {
+		e = malloc(sizeof(struct reg_entry));
+		if (e == NULL || (e->address = strdup(nodes[queued]->address)) == NULL) {
+			logger(ERROR, "Failed to allocate memory for node registration\n");
+			free(e);
+			ret = -1;
+			break;
+		}
+		e->next = NULL;
+		if (last)
+			last->next = e;
+		else
+			head = e;
+		last = e;
+	}
+	if (head == NULL)
+		return ret;
+
+	pthread_mutex_lock(&reg_lock);
+	if (reg_queued == 0 && reg_inflight == 0) {
+		reg_begin = now_ms();
+		reg_sent = 0;
+		reg_added = 0;
+		reg_failed = 0;
+	}
+	if (reg_tail)
+		reg_tail->next = head;
+	else
+		reg_head = head;
+	reg_tail = last;
+	reg_queued += queued;
+	pthread_cond_signal(&reg_cond);
+	pthread_mutex_unlock(&reg_lock);
+
+	return ret;
+}
+
+/*
+ * reg_result
+ *
+ * Called for each addnode result from Polyglot.  Results for nodes
+ * that aren't in flight are ignored.
+ */
+void reg_result(const char *address, int success)
+{
+	pthread_mutex_lock(&reg_lock);
+	if (flight_remove(address, 0) == 0) {
+		if (success)
+			reg_added++;
+		else
+			reg_failed++;
+		reg_last = now_ms();
+		pthread_cond_signal(&reg_cond);
+	}
+	pthread_mutex_unlock(&reg_lock);
+}
+
+/*
+ * getAddNodesProgress
+ *
+ * Report how far the current (or last) addNodes() registration has
+ * got: nodes still waiting to be sent, nodes sent, and nodes Polyglot
+ * has added or failed to add.  Any pointer may be NULL.
+ */
+void getAddNodesProgress(int *queued, int *sent, int *added, int *failed)
+{
+	pthread_mutex_lock(&reg_lock);
+	if (queued)
+		*queued = reg_queued;
+	if (sent)
+		*sent = reg_sent;
+	if (added)
+		*added = reg_added;
+	if (failed)
+		*failed = reg_failed;
+	pthread_mutex_unlock(&reg_lock);
+}
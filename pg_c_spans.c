@@ -0,0 +1,225 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_spans.c
+ *
+ * Command latency tracing.  Each command received from Polyglot gets
+ * a trace ID and its receive time.  The ID follows the command to the
+ * worker that runs it (workq items carry it) and on into any status
+ * messages its callback sends, so the time can be split into spans:
+ *
+ *   command    receive until the callback returns
+ *   queue      waiting for the node's lane
+ *   callback   the node server's command callback
+ *   serialize  building a status message
+ *   publish    waiting in the send queue and publishing
+ *
+ * Spans go into a fixed ring (the trace_spans option) that overwrites
+ * the oldest spans, and exportTrace() writes the ring in the Chrome
+ * trace event format (chrome://tracing, Perfetto).
+ *
+ * Reports that are held by the coalescer or a rate limit are sent
+ * from another thread and lose their trace ID.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define SPAN_LABEL 32
+
+struct span {
+	unsigned long seq;        /* index + 1 when valid, 0 while written */
+	unsigned int id;
+	unsigned int thread;
+	const char *name;
+	long long start;
+	long long end;
+	char label[SPAN_LABEL];
+};
+
+static struct span *sp_ring;
+static unsigned long sp_mask;
+static unsigned long sp_head;
+static unsigned int sp_next_id;
+static unsigned int sp_threads;
+
+static __thread unsigned int sp_thread;   /* 1 based, 0 = not set */
+static __thread struct span_ctx sp_ctx;   /* trace of the running work */
+
+/*
+ * span_start
+ *
+ * Allocate the span ring.  Tracing is off if spans is 0.
+ */
+int span_start(int spans)
+{
+	unsigned long cnt = 16;
+
+	if (spans <= 0)
+		return 0;
+
+	while (cnt < (unsigned long)spans)
+		cnt *= 2;
+	sp_ring = calloc(cnt, sizeof(struct span));
+	if (sp_ring == NULL) {
+		logger(ERROR, "Failed to allocate memory for trace spans\n");
+		return -1;
+	}
+	sp_mask = cnt - 1;
+
+	return 0;
+}
+
+int span_enabled(void)
+{
+	return sp_ring != NULL;
+}
+
+/*
+ * span_new
+ *
+ * Start a trace for a command received at rx.  It becomes the calling
+ * thread's current trace, which workq_submit() passes on to the work
+ * it queues.
+ */
+void span_new(long long rx)
+{
+	if (sp_ring == NULL)
+		return;
+
+	sp_ctx.id = __atomic_add_fetch(&sp_next_id, 1, __ATOMIC_RELAXED);
+	if (sp_ctx.id == 0)
+		sp_ctx.id = __atomic_add_fetch(&sp_next_id, 1, __ATOMIC_RELAXED);
+	sp_ctx.rx = rx;
+}
+
+struct span_ctx span_get(void)
+{
+	return sp_ctx;
+}
+
+void span_set(struct span_ctx ctx)
+{
+	sp_ctx = ctx;
+}
+
+/*
+ * span_record
+ *
+ * Add a span for trace id to the ring.  label may be NULL.
+ */
+void span_record(unsigned int id, const char *name, const char *label,
+		long long start, long long end)
+{
+	struct span *s;
+	unsigned long idx;
+
+	if (sp_ring == NULL || id == 0)
+		return;
+
+	if (sp_thread == 0)
+		sp_thread = __atomic_add_fetch(&sp_threads, 1, __ATOMIC_RELAXED);
+
+	idx = __atomic_fetch_add(&sp_head, 1, __ATOMIC_RELAXED);
+	s = &sp_ring[idx & sp_mask];
+	__atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->id = id;
+	s->thread = sp_thread;
+	s->name = name;
+	s->start = start;
+	s->end = end;
+	if (label)
+		snprintf(s->label, sizeof(s->label), "%s", label);
+	else
+		s->label[0] = '\0';
+	__atomic_store_n(&s->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * exportTrace
+ *
+ * Write the spans in the trace ring to file in the Chrome trace event
+ * JSON format.  Returns the number of spans written or -1 if the file
+ * could not be written.
+ */
+int exportTrace(const char *file)
+{
+	unsigned long head, first, idx, seq;
+	struct span s;
+	cJSON *label;
+	char *text;
+	int cnt = 0;
+	FILE *fp;
+
+	if (sp_ring == NULL)
+		return 0;
+
+	fp = fopen(file, "w");
+	if (fp == NULL) {
+		loggerf(ERROR, "Failed to open trace export %s (%d)\n", file, errno);
+		return -1;
+	}
+
+	head = __atomic_load_n(&sp_head, __ATOMIC_ACQUIRE);
+	first = head > sp_mask + 1 ? head - (sp_mask + 1) : 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (idx = first; idx < head; idx++) {
+		seq = __atomic_load_n(&sp_ring[idx & sp_mask].seq, __ATOMIC_ACQUIRE);
+		if (seq != idx + 1)
+			continue;
+		memcpy(&s, &sp_ring[idx & sp_mask], sizeof(s));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&sp_ring[idx & sp_mask].seq,
+					__ATOMIC_RELAXED) != seq)
+			continue;
+		s.label[SPAN_LABEL - 1] = '\0';
+
+		label = cJSON_CreateString(s.label);
+		text = label ? cJSON_PrintUnformatted(label) : NULL;
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"command\",\"ph\":\"X\","
+				"\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+				"\"args\":{\"id\":%u,\"label\":%s}}",
+				cnt ? "," : "", s.name, s.start / 1000.0,
+				(s.end - s.start) / 1000.0, s.thread, s.id,
+				text ? text : "\"\"");
+		cJSON_free(text);
+		cJSON_Delete(label);
+		cnt++;
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) != 0) {
+		loggerf(ERROR, "Failed to write trace export %s (%d)\n", file, errno);
+		return -1;
+	}
+
+	return cnt;
+}
@@ -0,0 +1,586 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_tape.c
+ *
+ * A read-only parser for messages from Polyglot.  Instead of building
+ * a tree of cJSON nodes, the message is validated in one pass into a
+ * flat tape: one fixed size entry per value, in document order, with
+ * the offset and length of the value in the message text.  Strings
+ * are views into the text and are only unescaped when asked for, so
+ * parsing allocates nothing once a thread's tape has grown to the
+ * size of its messages.  The text is bounded by its length and need
+ * not be nul terminated.
+ *
+ * Each entry also has the index of the entry after it, past all its
+ * children, so an object or array can be stepped over in one move.
+ * An object's entries are its keys, each followed by its value.
+ *
+ * The text is only borrowed.  To hand a message to another thread,
+ * tape_detach() copies the tape and text into an arena, unescaping
+ * and nul terminating every scalar along the way so tape_cstr() can
+ * hand them out as C strings.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define TAPE_DEPTH    64     /* deepest nesting accepted */
+#define TAPE_INITIAL  64     /* entries in a new tape */
+#define TAPE_KEY_MAX  256    /* longest escaped key compared */
+
+struct tape_parser {
+	struct jtape *t;
+	const char *text;
+	const char *p;
+	const char *end;
+};
+
+static __thread struct jtape tp_mine;
+
+static int parse_value(struct tape_parser *tp, int depth);
+
+static int ent_add(struct tape_parser *tp, int type)
+{
+	struct jtape *t = tp->t;
+	struct tape_ent *e;
+
+	if (t->cnt == t->cap) {
+		int cap = t->cap ? t->cap * 2 : TAPE_INITIAL;
+
+		e = realloc(t->ent, sizeof(struct tape_ent) * cap);
+		if (e == NULL)
+			return -1;
+		t->ent = e;
+		t->cap = cap;
+	}
+
+	e = &t->ent[t->cnt];
+	e->off = (uint32_t)(tp->p - tp->text);
+	e->len = 0;
+	e->next = (uint32_t)t->cnt + 1;
+	e->type = (uint8_t)type;
+	e->flags = 0;
+
+	return t->cnt++;
+}
+
+static void skip_ws(struct tape_parser *tp)
+{
+	while (tp->p < tp->end && (*tp->p == ' ' || *tp->p == '\t' ||
+				*tp->p == '\n' || *tp->p == '\r'))
+		tp->p++;
+}
+
+static int is_hex(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+		(c >= 'A' && c <= 'F');
+}
+
+/* The entry covers the characters between the quotes */
+static int parse_string(struct tape_parser *tp, int type)
+{
+	const char *p;
+	int i;
+	int n;
+
+	tp->p++;
+	i = ent_add(tp, type);
+	if (i < 0)
+		return -1;
+
+	for (p = tp->p; p < tp->end; p++) {
+		if (*p == '"')
+			break;
+		if ((unsigned char)*p < 0x20)
+			return -1;
+		if (*p != '\\')
+			continue;
+
+		tp->t->ent[i].flags |= TAPE_ESCAPED;
+		if (++p == tp->end)
+			return -1;
+		switch (*p) {
+			case '"': case '\\': case '/': case 'b':
+			case 'f': case 'n': case 'r': case 't':
+				break;
+			case 'u':
+				if (tp->end - p < 5)
+					return -1;
+				for (n = 1; n <= 4; n++)
+					if (!is_hex(p[n]))
+						return -1;
+				p += 4;
+				break;
+			default:
+				return -1;
+		}
+	}
+	if (p == tp->end)
+		return -1;
+
+	tp->t->ent[i].len = (uint32_t)(p - tp->p);
+	tp->p = p + 1;
+
+	return 0;
+}
+
+static int digits(struct tape_parser *tp)
+{
+	const char *start = tp->p;
+
+	while (tp->p < tp->end && *tp->p >= '0' && *tp->p <= '9')
+		tp->p++;
+
+	return tp->p > start ? 0 : -1;
+}
+
+static int parse_number(struct tape_parser *tp)
+{
+	int i;
+
+	i = ent_add(tp, TAPE_NUMBER);
+	if (i < 0)
+		return -1;
+
+	if (*tp->p == '-')
+		tp->p++;
+	if (tp->p < tp->end && *tp->p == '0')
+		tp->p++;
+	else if (digits(tp) != 0)
+		return -1;
+	if (tp->p < tp->end && *tp->p == '.') {
+		tp->p++;
+		if (digits(tp) != 0)
+			return -1;
+	}
+	if (tp->p < tp->end && (*tp->p == 'e' || *tp->p == 'E')) {
+		tp->p++;
+		if (tp->p < tp->end && (*tp->p == '+' || *tp->p == '-'))
+			tp->p++;
+		if (digits(tp) != 0)
+			return -1;
+	}
+
+	tp->t->ent[i].len = (uint32_t)(tp->p - tp->text) - tp->t->ent[i].off;
+	return 0;
+}
+
+static int parse_literal(struct tape_parser *tp, const char *word, int type)
+{
+	size_t len = strlen(word);
+	int i;
+
+	if ((size_t)(tp->end - tp->p) < len || memcmp(tp->p, word, len) != 0)
+		return -1;
+
+	i = ent_add(tp, type);
+	if (i < 0)
+		return -1;
+	tp->t->ent[i].len = (uint32_t)len;
+	tp->p += len;
+
+	return 0;
+}
+
+/* Arrays and objects, the entry covers the brackets */
+static int parse_container(struct tape_parser *tp, int depth)
+{
+	int object = *tp->p == '{';
+	char close = object ? '}' : ']';
+	int i;
+
+	if (depth >= TAPE_DEPTH)
+		return -1;
+
+	i = ent_add(tp, object ? TAPE_OBJECT : TAPE_ARRAY);
+	if (i < 0)
+		return -1;
+	tp->p++;
+
+	skip_ws(tp);
+	if (tp->p < tp->end && *tp->p == close)
+		goto done;
+
+	for (;;) {
+		if (object) {
+			if (tp->p == tp->end || *tp->p != '"' ||
+					parse_string(tp, TAPE_STRING) != 0)
+				return -1;
+			skip_ws(tp);
+			if (tp->p == tp->end || *tp->p != ':')
+				return -1;
+			tp->p++;
+			skip_ws(tp);
+		}
+		if (parse_value(tp, depth + 1) != 0)
+			return -1;
+		skip_ws(tp);
+		if (tp->p == tp->end)
+			return -1;
+		if (*tp->p == close)
+			break;
+		if (*tp->p != ',')
+			return -1;
+		tp->p++;
+		skip_ws(tp);
+	}
+
+done:
+	tp->p++;
+	tp->t->ent[i].len = (uint32_t)(tp->p - tp->text) - tp->t->ent[i].off;
+	tp->t->ent[i].next = (uint32_t)tp->t->cnt;
+
+	return 0;
+}
+
+static int parse_value(struct tape_parser *tp, int depth)
+{
+	if (tp->p == tp->end)
+		return -1;
+
+	switch (*tp->p) {
+		case '{':
+		case '[':
+			return parse_container(tp, depth);
+		case '"':
+			return parse_string(tp, TAPE_STRING);
+		case 't':
+			return parse_literal(tp, "true", TAPE_TRUE);
+		case 'f':
+			return parse_literal(tp, "false", TAPE_FALSE);
+		case 'n':
+			return parse_literal(tp, "null", TAPE_NULL);
+		default:
+			if (*tp->p == '-' || (*tp->p >= '0' && *tp->p <= '9'))
+				return parse_number(tp);
+			return -1;
+	}
+}
+
+/*
+ * tape_parse
+ *
+ * Parse len bytes of JSON text into the tape t.  The tape's entry
+ * array is reused from earlier parses.  Returns 0, or -1 if the text
+ * is not valid JSON.
+ */
+int tape_parse(struct jtape *t, const char *text, size_t len)
+{
+	struct tape_parser tp;
+
+	t->cnt = 0;
+	t->text = text;
+	t->len = len;
+	t->detached = 0;
+
+	tp.t = t;
+	tp.text = text;
+	tp.p = text;
+	tp.end = text + len;
+
+	skip_ws(&tp);
+	if (parse_value(&tp, 0) != 0)
+		return -1;
+	skip_ws(&tp);
+	if (tp.p != tp.end)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * tape_thread
+ *
+ * A tape for this thread to parse into, kept for the life of the
+ * thread so its entries are reused.
+ */
+struct jtape *tape_thread(void)
+{
+	return &tp_mine;
+}
+
+/* Append code point cp as UTF-8 */
+static char *put_utf8(char *out, unsigned long cp)
+{
+	if (cp < 0x80) {
+		*out++ = (char)cp;
+	} else if (cp < 0x800) {
+		*out++ = (char)(0xc0 | (cp >> 6));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		*out++ = (char)(0xe0 | (cp >> 12));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	} else {
+		*out++ = (char)(0xf0 | (cp >> 18));
+		*out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	}
+
+	return out;
+}
+
+static unsigned long hex4(const char *s)
+{
+	unsigned long v = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		char c = s[i];
+
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= (unsigned long)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			v |= (unsigned long)(c - 'a' + 10);
+		else
+			v |= (unsigned long)(c - 'A' + 10);
+	}
+
+	return v;
+}
+
+/*
+ * Unescape len bytes of a validated string into out and return the
+ * new length.  The result is never longer than the input, so out may
+ * be the same as s.
+ */
+static size_t unescape(const char *s, size_t len, char *out)
+{
+	const char *end = s + len;
+	char *o = out;
+	unsigned long cp;
+	unsigned long lo;
+
+	while (s < end) {
+		if (*s != '\\') {
+			*o++ = *s++;
+			continue;
+		}
+		s++;
+		switch (*s++) {
+			case 'b': *o++ = '\b'; break;
+			case 'f': *o++ = '\f'; break;
+			case 'n': *o++ = '\n'; break;
+			case 'r': *o++ = '\r'; break;
+			case 't': *o++ = '\t'; break;
+			case 'u':
+				cp = hex4(s);
+				s += 4;
+				if (cp >= 0xd800 && cp < 0xdc00 && end - s >= 6 &&
+						s[0] == '\\' && s[1] == 'u') {
+					lo = hex4(s + 2);
+					if (lo >= 0xdc00 && lo < 0xe000) {
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+						s += 6;
+					}
+				}
+				o = put_utf8(o, cp);
+				break;
+			default:
+				*o++ = s[-1];
+				break;
+		}
+	}
+
+	return (size_t)(o - out);
+}
+
+static int str_eq(const struct jtape *t, int i, const char *s, size_t len)
+{
+	const struct tape_ent *e = &t->ent[i];
+	char buf[TAPE_KEY_MAX];
+
+	if (!(e->flags & TAPE_ESCAPED))
+		return e->len == len && memcmp(t->text + e->off, s, len) == 0;
+
+	if (e->len > sizeof(buf))
+		return 0;
+
+	return unescape(t->text + e->off, e->len, buf) == len &&
+		memcmp(buf, s, len) == 0;
+}
+
+/*
+ * tape_get
+ *
+ * Return the index of the value for key in the object at index obj,
+ * or -1 if obj isn't an object or doesn't have key.  Keys are
+ * matched exactly.
+ */
+int tape_get(const struct jtape *t, int obj, const char *key)
+{
+	size_t len = strlen(key);
+	int i;
+
+	if (obj < 0 || t->ent[obj].type != TAPE_OBJECT)
+		return -1;
+
+	for (i = obj + 1; i < (int)t->ent[obj].next;
+			i = (int)t->ent[i + 1].next) {
+		if (str_eq(t, i, key, len))
+			return i + 1;
+	}
+
+	return -1;
+}
+
+/*
+ * tape_type
+ *
+ * The type of the value at index i, or -1 for no value (i < 0).
+ */
+int tape_type(const struct jtape *t, int i)
+{
+	if (i < 0)
+		return -1;
+
+	return t->ent[i].type;
+}
+
+/*
+ * tape_streq
+ *
+ * True if the value at index i is the string s.
+ */
+int tape_streq(const struct jtape *t, int i, const char *s)
+{
+	if (i < 0 || t->ent[i].type != TAPE_STRING)
+		return 0;
+
+	return str_eq(t, i, s, strlen(s));
+}
+
+/*
+ * tape_view
+ *
+ * The text of the value at index i, as it is in the message.  For a
+ * string this is between the quotes, still escaped.
+ */
+struct jview tape_view(const struct jtape *t, int i)
+{
+	struct jview v = { NULL, 0 };
+
+	if (i >= 0) {
+		v.ptr = t->text + t->ent[i].off;
+		v.len = t->ent[i].len;
+	}
+
+	return v;
+}
+
+/*
+ * tape_string
+ *
+ * Copy the scalar value at index i into buf as a nul terminated
+ * string, unescaping strings.  Returns the length, or -1 if it is
+ * not a scalar or doesn't fit.
+ */
+int tape_string(const struct jtape *t, int i, char *buf, size_t size)
+{
+	const struct tape_ent *e;
+	size_t len;
+
+	if (i < 0)
+		return -1;
+	e = &t->ent[i];
+	if (e->type == TAPE_OBJECT || e->type == TAPE_ARRAY || e->len >= size)
+		return -1;
+
+	if (e->flags & TAPE_ESCAPED) {
+		len = unescape(t->text + e->off, e->len, buf);
+	} else {
+		len = e->len;
+		memcpy(buf, t->text + e->off, len);
+	}
+	buf[len] = '\0';
+
+	return (int)len;
+}
+
+/*
+ * tape_detach
+ *
+ * Copy a tape and its text into arena a so it can outlive the text
+ * it was parsed from.  Every scalar in the copy is unescaped and nul
+ * terminated in place, overwriting the quote or delimiter after it.
+ * Returns NULL if the arena is out of memory.
+ */
+struct jtape *tape_detach(const struct jtape *t, struct json_arena *a)
+{
+	struct jtape *d;
+	struct tape_ent *e;
+	char *text;
+	int i;
+
+	d = json_arena_alloc(a, sizeof(struct jtape) +
+			sizeof(struct tape_ent) * t->cnt + t->len + 1);
+	if (d == NULL)
+		return NULL;
+
+	d->ent = (struct tape_ent *)(d + 1);
+	d->cnt = d->cap = t->cnt;
+	text = (char *)(d->ent + t->cnt);
+	memcpy(d->ent, t->ent, sizeof(struct tape_ent) * t->cnt);
+	memcpy(text, t->text, t->len);
+	text[t->len] = '\0';
+	d->text = text;
+	d->len = t->len;
+	d->detached = 1;
+
+	for (i = 0; i < d->cnt; i++) {
+		e = &d->ent[i];
+		if (e->type == TAPE_OBJECT || e->type == TAPE_ARRAY)
+			continue;
+		if (e->flags & TAPE_ESCAPED) {
+			e->len = (uint32_t)unescape(text + e->off, e->len, text + e->off);
+			e->flags &= ~TAPE_ESCAPED;
+		}
+		text[e->off + e->len] = '\0';
+	}
+
+	return d;
+}
+
+/*
+ * tape_cstr
+ *
+ * The scalar value at index i of a detached tape as a C string, or
+ * NULL if there is no such value.
+ */
+const char *tape_cstr(const struct jtape *t, int i)
+{
+	if (i < 0 || !t->detached || t->ent[i].type == TAPE_OBJECT ||
+			t->ent[i].type == TAPE_ARRAY)
+		return NULL;
+
+	return t->text + t->ent[i].off;
+}
@@ -0,0 +1,535 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_c_trace.c
+ *
+ * Binary trace log.  Instead of formatting a log message, the format
+ * string pointer, a timestamp and the raw arguments are copied into a
+ * buffer owned by the calling thread.  Full buffers are appended to
+ * logs/trace.bin and tools/pg_tracedump turns that into text later.
+ *
+ * Each format string is written to the trace once (an 'F' record)
+ * the first time it is used; events ('E' records) refer to it by its
+ * address.  Strings are copied, up to TRACE_STR_MAX bytes, since they
+ * may be gone by the time the trace is decoded.
+ *
+ * Every run, and every file after a rotation, starts with a header.
+ * Format ids are only unique within a run, since the strings can be
+ * at different addresses each time the program is started, so the
+ * decoder starts a new format table at each header.
+ *
+ * Records are in host byte order:
+ *   header  "PGTRACE" NUL, u32 version
+ *   'F'     u64 id, u16 len, format text
+ *   'E'     u64 id, u64 ns, u32 thread, u8 level, u16 len, arguments
+ * Integer arguments (and '*' widths) are stored as 8 bytes, floating
+ * point as a double and strings as u16 len + bytes.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+#define TRACE_VERSION  1
+#define TRACE_BUF      (32 * 1024)  /* per thread */
+#define TRACE_STR_MAX  128
+#define TRACE_REC_MAX  1024         /* largest event record */
+#define TRACE_FMTS     4096         /* format strings remembered */
+#define TRACE_FILE_MAX (16 * 1024 * 1024)
+
+struct trace_buf {
+	pthread_mutex_t lock;
+	unsigned int thread;
+	unsigned int gen;           /* file generation of the contents */
+	size_t len;
+	struct trace_buf *next;
+	unsigned char data[TRACE_BUF];
+};
+
+struct trace_fmt {
+	const char *fmt;
+	unsigned int gen;
+};
+
+int trace_level = -1;         /* highest level traced, -1 = off */
+
+static pthread_mutex_t tr_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *tr_bufs;
+static unsigned int tr_threads;
+static int tr_fd = -1;
+static size_t tr_size;
+static unsigned int tr_gen = 1;     /* bumped when the file is rotated */
+static struct trace_fmt tr_fmts[TRACE_FMTS];
+static __thread struct trace_buf *tr_mine;
+static struct sigaction tr_old[5];
+static const int tr_signals[5] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static void trace_write(const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(tr_fd, p, len);
+		if (n <= 0)
+			return;
+		p += n;
+		len -= n;
+	}
+}
+
+static void trace_header(void)
+{
+	unsigned int version = TRACE_VERSION;
+
+	trace_write("PGTRACE", 8);
+	trace_write(&version, sizeof(version));
+	tr_size += 8 + sizeof(version);
+}
+
+static int fmt_known(const char *fmt, unsigned int gen);
+
+/*
+ * A buffer filled before the file was rotated can have events whose
+ * format was only written to the old file.  The ids are the format
+ * strings themselves, so write any the new file is missing.  Caller
+ * holds tr_lock.
+ */
+static void trace_refmt(struct trace_buf *b)
+{
+	unsigned char rec[1 + 8 + 2];
+	unsigned long long id;
+	unsigned short len;
+	const char *fmt;
+	size_t off = 0;
+	size_t flen;
+
+	while (off < b->len) {
+		if (b->data[off] == 'F') {
+			memcpy(&len, b->data + off + 9, sizeof(len));
+			off += 1 + 8 + 2 + len;
+			continue;
+		}
+		memcpy(&id, b->data + off + 1, sizeof(id));
+		memcpy(&len, b->data + off + 22, sizeof(len));
+		off += 1 + 8 + 8 + 4 + 1 + 2 + len;
+
+		fmt = (const char *)(uintptr_t)id;
+		if (fmt_known(fmt, tr_gen))
+			continue;
+		flen = strlen(fmt);
+		if (flen > 0xffff)
+			flen = 0xffff;
+		len = flen;
+		rec[0] = 'F';
+		memcpy(rec + 1, &id, sizeof(id));
+		memcpy(rec + 9, &len, sizeof(len));
+		trace_write(rec, sizeof(rec));
+		trace_write(fmt, flen);
+		tr_size += sizeof(rec) + flen;
+	}
+}
+
+/*
+ * Append a thread's buffer to the trace file.  Caller holds the
+ * buffer's lock.
+ */
+static void trace_spill(struct trace_buf *b)
+{
+	if (b->len == 0)
+		return;
+
+	pthread_mutex_lock(&tr_lock);
+	if (tr_size + b->len > TRACE_FILE_MAX) {
+		/* the new file needs its own copy of every format */
+		__atomic_fetch_add(&tr_gen, 1, __ATOMIC_RELAXED);
+		close(tr_fd);
+		rename("logs/trace.bin", "logs/trace.bin.1");
+		tr_fd = open("logs/trace.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		tr_size = 0;
+		trace_header();
+	}
+	if (b->gen != tr_gen)
+		trace_refmt(b);
+	trace_write(b->data, b->len);
+	tr_size += b->len;
+	pthread_mutex_unlock(&tr_lock);
+
+	b->len = 0;
+}
+
+static struct trace_buf *trace_buffer(void)
+{
+	struct trace_buf *b;
+
+	if (tr_mine)
+		return tr_mine;
+
+	b = calloc(1, sizeof(struct trace_buf));
+	if (b == NULL)
+		return NULL;
+	pthread_mutex_init(&b->lock, NULL);
+
+	pthread_mutex_lock(&tr_lock);
+	b->thread = tr_threads++;
+	b->next = tr_bufs;
+	tr_bufs = b;
+	pthread_mutex_unlock(&tr_lock);
+
+	tr_mine = b;
+	return b;
+}
+
+/*
+ * Has this format been written to the trace file of generation gen?
+ * Marks it as written if not.
+ */
+static int fmt_known(const char *fmt, unsigned int gen)
+{
+	unsigned int i = ((uintptr_t)fmt >> 3) & (TRACE_FMTS - 1);
+	const char *cur;
+	int n;
+
+	for (n = 0; n < TRACE_FMTS; n++, i = (i + 1) & (TRACE_FMTS - 1)) {
+		cur = __atomic_load_n(&tr_fmts[i].fmt, __ATOMIC_ACQUIRE);
+		if (cur == NULL) {
+			if (!__atomic_compare_exchange_n(&tr_fmts[i].fmt, &cur, fmt,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+					cur != fmt)
+				continue;
+		} else if (cur != fmt) {
+			continue;
+		}
+		if (__atomic_exchange_n(&tr_fmts[i].gen, gen,
+					__ATOMIC_RELAXED) == gen)
+			return 1;
+		return 0;
+	}
+
+	/* table full, write the format every time */
+	return 0;
+}
+
+/*
+ * Copy len bytes to *p if they fit before end.  Returns 0, or -1 if
+ * they don't fit.
+ */
+static int put(unsigned char **p, unsigned char *end, const void *v,
+		size_t len)
+{
+	if (*p + len > end)
+		return -1;
+	memcpy(*p, v, len);
+	*p += len;
+
+	return 0;
+}
+
+/* A string that doesn't fit is recorded as empty */
+static int put_string(unsigned char **p, unsigned char *end, const char *s)
+{
+	unsigned short len;
+
+	if (s == NULL)
+		s = "(null)";
+	len = strnlen(s, TRACE_STR_MAX);
+	if (*p + sizeof(len) + len > end)
+		len = 0;
+	if (put(p, end, &len, sizeof(len)) != 0)
+		return -1;
+
+	return put(p, end, s, len);
+}
+
+/*
+ * Copy the arguments for fmt into p, stopping at the first one that
+ * doesn't fit before end.  Returns the end of the arguments.
+ */
+static unsigned char *put_args(unsigned char *p, unsigned char *end,
+		const char *fmt, va_list args)
+{
+	long long ival;
+	double dval;
+	int lng;
+
+	while ((fmt = strchr(fmt, '%')) != NULL) {
+		fmt++;
+		if (*fmt == '%') {
+			fmt++;
+			continue;
+		}
+		fmt += strspn(fmt, "-+ #0'");
+		if (*fmt == '*') {
+			ival = va_arg(args, int);
+			if (put(&p, end, &ival, sizeof(ival)) != 0)
+				return p;
+			fmt++;
+		}
+		fmt += strspn(fmt, "0123456789");
+		if (*fmt == '.') {
+			fmt++;
+			if (*fmt == '*') {
+				ival = va_arg(args, int);
+				if (put(&p, end, &ival, sizeof(ival)) != 0)
+					return p;
+				fmt++;
+			}
+			fmt += strspn(fmt, "0123456789");
+		}
+
+		/* 0 = int, 1 = long, 2 = long long, 3 = size_t, 4 = intmax_t, 5 = ptrdiff_t */
+		lng = 0;
+		switch (*fmt) {
+		case 'h':
+			fmt += (fmt[1] == 'h') ? 2 : 1;
+			break;
+		case 'l':
+			lng = (fmt[1] == 'l') ? 2 : 1;
+			fmt += lng;
+			break;
+		case 'q': case 'L':
+			lng = 2; fmt++;
+			break;
+		case 'z':
+			lng = 3; fmt++;
+			break;
+		case 'j':
+			lng = 4; fmt++;
+			break;
+		case 't':
+			lng = 5; fmt++;
+			break;
+		}
+
+		switch (*fmt) {
+		case 'd': case 'i':
+		case 'u': case 'o': case 'x': case 'X': case 'c':
+			switch (lng) {
+			case 1: ival = va_arg(args, long); break;
+			case 2: ival = va_arg(args, long long); break;
+			case 3: ival = va_arg(args, size_t); break;
+			case 4: ival = va_arg(args, intmax_t); break;
+			case 5: ival = va_arg(args, ptrdiff_t); break;
+			default: ival = va_arg(args, int); break;
+			}
+			if (put(&p, end, &ival, sizeof(ival)) != 0)
+				return p;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (fmt[-1] == 'L')
+				dval = (double)va_arg(args, long double);
+			else
+				dval = va_arg(args, double);
+			if (put(&p, end, &dval, sizeof(dval)) != 0)
+				return p;
+			break;
+		case 's':
+			if (put_string(&p, end, va_arg(args, const char *)) != 0)
+				return p;
+			break;
+		case 'p':
+			ival = (long long)(uintptr_t)va_arg(args, void *);
+			if (put(&p, end, &ival, sizeof(ival)) != 0)
+				return p;
+			break;
+		case 'n':
+			(void)va_arg(args, void *);
+			break;
+		case '\0':
+			return p;
+		}
+		fmt++;
+	}
+
+	return p;
+}
+
+/*
+ * trace_vrecord
+ *
+ * Add a log message to the calling thread's trace buffer.
+ */
+void trace_vrecord(enum LOGLEVELS level, const char *fmt, va_list args)
+{
+	unsigned char rec[TRACE_REC_MAX];
+	unsigned char *p, *end;
+	struct trace_buf *b;
+	unsigned long long id = (uintptr_t)fmt;
+	unsigned long long ns;
+	unsigned short len;
+	unsigned char lvl = level;
+	struct timespec ts;
+	size_t flen;
+
+	b = trace_buffer();
+	if (b == NULL || tr_fd < 0)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	/* 'E', id, ns, thread, level, len, then the arguments */
+	p = rec;
+	end = rec + sizeof(rec);
+	*p++ = 'E';
+	put(&p, end, &id, sizeof(id));
+	put(&p, end, &ns, sizeof(ns));
+	put(&p, end, &b->thread, sizeof(b->thread));
+	put(&p, end, &lvl, sizeof(lvl));
+	p += sizeof(len);
+	p = put_args(p, end, fmt, args);
+	len = p - (rec + 1 + 8 + 8 + 4 + 1 + sizeof(len));
+	memcpy(rec + 1 + 8 + 8 + 4 + 1, &len, sizeof(len));
+
+	pthread_mutex_lock(&b->lock);
+	/*
+	 * The buffer keeps the generation its formats were checked
+	 * against until it is spilled, even if a record below spills it.
+	 */
+	if (b->len == 0)
+		b->gen = __atomic_load_n(&tr_gen, __ATOMIC_RELAXED);
+	if (!fmt_known(fmt, b->gen)) {
+		flen = strlen(fmt);
+		if (flen > 0xffff)
+			flen = 0xffff;
+		if (b->len + 1 + 8 + 2 + flen > TRACE_BUF)
+			trace_spill(b);
+		if (1 + 8 + 2 + flen <= TRACE_BUF) {
+			b->data[b->len++] = 'F';
+			memcpy(b->data + b->len, &id, 8);
+			b->len += 8;
+			len = flen;
+			memcpy(b->data + b->len, &len, 2);
+			b->len += 2;
+			memcpy(b->data + b->len, fmt, flen);
+			b->len += flen;
+		}
+	}
+	if (b->len + (p - rec) > TRACE_BUF)
+		trace_spill(b);
+	memcpy(b->data + b->len, rec, p - rec);
+	b->len += p - rec;
+	pthread_mutex_unlock(&b->lock);
+}
+
+void trace_record(enum LOGLEVELS level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	trace_vrecord(level, fmt, args);
+	va_end(args);
+}
+
+/*
+ * logger_trace_flush
+ *
+ * Write every thread's trace buffer to the trace file.
+ */
+void logger_trace_flush(void)
+{
+	struct trace_buf *b;
+
+	pthread_mutex_lock(&tr_lock);
+	b = tr_bufs;
+	pthread_mutex_unlock(&tr_lock);
+
+	for (; b; b = b->next) {
+		pthread_mutex_lock(&b->lock);
+		trace_spill(b);
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+/*
+ * On a crash, write what is in the buffers without taking any locks
+ * and pass the signal on.
+ */
+static void trace_crash(int sig)
+{
+	struct trace_buf *b;
+	int i;
+
+	for (b = tr_bufs; b; b = b->next) {
+		trace_write(b->data, b->len);
+		b->len = 0;
+	}
+
+	for (i = 0; i < 5; i++) {
+		if (tr_signals[i] == sig)
+			sigaction(sig, &tr_old[i], NULL);
+	}
+	raise(sig);
+}
+
+/*
+ * logger_set_trace
+ *
+ * Record log messages that are above the log level, up to level, in
+ * the binary trace log logs/trace.bin.  Returns 0 on success or -1 if
+ * the trace file could not be opened.
+ */
+int logger_set_trace(enum LOGLEVELS level)
+{
+	struct sigaction sa;
+	struct stat st;
+	int i;
+
+	if (tr_fd < 0) {
+		tr_fd = open("logs/trace.bin", O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (tr_fd < 0) {
+			loggerf(ERROR, "Failed to open trace file: trace.bin (%d)\n",
+					errno);
+			return -1;
+		}
+		/* a new run, appended to what earlier runs wrote */
+		if (fstat(tr_fd, &st) == 0)
+			tr_size = st.st_size;
+		trace_header();
+
+		atexit(logger_trace_flush);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = trace_crash;
+		sigemptyset(&sa.sa_mask);
+		for (i = 0; i < 5; i++)
+			sigaction(tr_signals[i], &sa, &tr_old[i]);
+	}
+
+	trace_level = level;
+	logger_update_gates();
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+/*
+ * pg_c_workq.c
+ *
+ * A small fixed size thread pool with a bounded queue of work.  The
+ * MQTT message handler uses this to run the node server callbacks
+ * instead of creating a new thread for every message.
+ *
+ * When the queue is full, workq_submit() blocks until one of the
+ * worker threads takes an item off the queue.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include "cJSON.h"
+#include "c_interface.h"
+#include "c_int_interface.h"
+
+struct work_item {
+	void *(*fn)(void *args);
+	void *arg;
+	void (*release)(void *args);
+	void *release_arg;
+	long long queued_at;
+	struct span_ctx trace;
+};
+
+struct workq {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct work_item *ring;
+	int depth;
+	int head;
+	int count;
+	int shutdown;
+	int thread_cnt;
+	pthread_t *threads;
+};
+
+static void *workq_thread(void *args)
+{
+	struct workq *q = (struct workq *)args;
+	struct span_ctx no_trace = { 0, 0 };
+	struct work_item item;
+	long long now;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->count == 0 && !q->shutdown)
+			pthread_cond_wait(&q->not_empty, &q->lock);
+
+		if (q->count == 0 && q->shutdown)
+			break;
+
+		item = q->ring[q->head];
+		q->head = (q->head + 1) % q->depth;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+
+		now = metrics_now();
+		metrics_time(STAT_QUEUE_WAIT, now - item.queued_at);
+		span_set(item.trace);
+		span_record(item.trace.id, "queue", NULL, item.queued_at, now);
+		metrics_running(1);
+		item.fn(item.arg);
+		metrics_running(-1);
+		span_set(no_trace);
+		if (item.release)
+			item.release(item.release_arg);
+
+		pthread_mutex_lock(&q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ * workq_create
+ *
+ * Create a queue that holds up to depth pending items and start
+ * thread_cnt threads to service it.
+ *
+ * Returns the new queue or NULL on failure.
+ */
+struct workq *workq_create(int thread_cnt, int depth)
+{
+	struct workq *q;
+	int i;
+
+	if (thread_cnt < 1 || depth < 1)
+		return NULL;
+
+	q = calloc(1, sizeof(struct workq));
+	if (q == NULL)
+		return NULL;
+
+	q->ring = calloc(depth, sizeof(struct work_item));
+	q->threads = calloc(thread_cnt, sizeof(pthread_t));
+	if (q->ring == NULL || q->threads == NULL) {
+		free(q->ring);
+		free(q->threads);
+		free(q);
+		return NULL;
+	}
+
+	q->depth = depth;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+
+	for (i = 0; i < thread_cnt; i++) {
+		if (pthread_create(&q->threads[i], NULL, workq_thread, q) != 0) {
+			loggerf(ERROR, "workq: failed to start worker thread (%d)\n", errno);
+			break;
+		}
+	}
+	q->thread_cnt = i;
+
+	if (q->thread_cnt == 0) {
+		workq_destroy(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/*
+ * workq_submit
+ *
+ * Queue fn(arg) to run on one of the worker threads.  Once fn returns,
+ * release(release_arg) is called (if release is not NULL) so the caller
+ * can hand off ownership of any memory that fn needs.
+ *
+ * Returns 0 on success or -1 if the queue is shutting down. On failure
+ * nothing is queued and release is not called.
+ */
+int workq_submit(struct workq *q, void *(*fn)(void *), void *arg,
+		void (*release)(void *), void *release_arg)
+{
+	struct work_item *item;
+	long long now = metrics_now();
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->depth && !q->shutdown)
+		pthread_cond_wait(&q->not_full, &q->lock);
+
+	if (q->shutdown) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+
+	item = &q->ring[(q->head + q->count) % q->depth];
+	item->fn = fn;
+	item->arg = arg;
+	item->release = release;
+	item->release_arg = release_arg;
+	item->queued_at = now;
+	item->trace = span_get();
+	q->count++;
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+/*
+ * workq_pending
+ *
+ * Return the number of items waiting for a thread.
+ */
+int workq_pending(struct workq *q)
+{
+	int cnt;
+
+	pthread_mutex_lock(&q->lock);
+	cnt = q->count;
+	pthread_mutex_unlock(&q->lock);
+
+	return cnt;
+}
+
+/*
+ * workq_destroy
+ *
+ * Stop accepting new work, let the worker threads finish anything
+ * already queued and then free the queue.
+ */
+void workq_destroy(struct workq *q)
+{
+	int i;
+
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->shutdown = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 0; i < q->thread_cnt; i++)
+		pthread_join(q->threads[i], NULL);
+
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+	free(q->threads);
+	free(q->ring);
+	free(q);
+}
@@ -32,35 +32,128 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <mosquitto.h>
 #include "cJSON.h"
 #include "c_interface.h"
 #include "c_int_interface.h"
 
-struct mosquitto *mosq = NULL;
 struct profile *poly = NULL;
 
-static void on_connect(struct mosquitto *m, void *ptr, int res);
-static void on_message(struct mosquitto *m, void *ptr,
-		const struct mosquitto_message *msg);
-static void on_disconnect(struct mosquitto *m, void *ptr, int res);
-static void on_publish(struct mosquitto *m, void *ptr, int mid);
-static void on_subscribe(struct mosquitto *m, void *ptr, int mid, int qos, const int *granted);
+static void on_connect(struct iface_transport *t);
+static void on_message(struct iface_transport *t, const char *topic,
+		const void *payload, int len);
+static void on_disconnect(struct iface_transport *t);
 static int get_stdin_info(char **host, int *port, int *profile);
 static int get_stdin_info_test(char **host, int *port, int *profile);
 extern void initialize_logging(void);
 
 
+/*
+ * Node commands, queries and status requests are run in lanes.  Each
+ * lane is a queue with a single thread so everything for one node
+ * address runs in the order it was received, while different nodes
+ * are spread across the lanes and run in parallel.  Config changes
+ * get a lane of their own so they are applied in order.
+ */
+static int start_lanes(void)
+{
+	int cnt;
+	int i;
+
+	cnt = poly->options.dispatch_lanes;
+	if (cnt <= 0)
+		cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (cnt <= 0)
+		cnt = 1;
+
+	poly->lanes = calloc(cnt, sizeof(struct workq *));
+	if (poly->lanes == NULL)
+		return -1;
+
+	for (i = 0; i < cnt; i++) {
+		poly->lanes[i] = workq_create(1, poly->options.lane_queue);
+		if (poly->lanes[i] == NULL)
+			return -1;
+	}
+	poly->lane_cnt = cnt;
+
+	poly->config_lane = workq_create(1, poly->options.lane_queue);
+	if (poly->config_lane == NULL)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Map a node address to its dispatch lane (FNV-1a hash).
+ */
+static struct workq *node_lane(const char *address)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*address) {
+		hash ^= (unsigned char)*address++;
+		hash *= 16777619u;
+	}
+
+	return poly->lanes[hash % poly->lane_cnt];
+}
+
+#define DEFAULT_WORKER_THREADS 4
+#define DEFAULT_WORKER_QUEUE   64
+#define DEFAULT_LANE_QUEUE     64
+#define DEFAULT_STATUS_BATCH   20
+#define DEFAULT_SEND_QUEUE     (256 * 1024)
+#define DEFAULT_RECONNECT_MIN  1000
+#define DEFAULT_RECONNECT_MAX  60000
+#define DEFAULT_RATE_BURST     10
+#define DEFAULT_ADD_BATCH      25
+#define DEFAULT_ADD_WINDOW     2
+
+/*
+ * Fill in the default library options.
+ */
+void getDefaultOptions(struct iface_options *opts)
+{
+	memset(opts, 0, sizeof(struct iface_options));
+	opts->worker_threads = DEFAULT_WORKER_THREADS;
+	opts->worker_queue = DEFAULT_WORKER_QUEUE;
+	opts->dispatch_lanes = 0;
+	opts->lane_queue = DEFAULT_LANE_QUEUE;
+	opts->status_window = 0;
+	opts->status_batch = DEFAULT_STATUS_BATCH;
+	opts->send_queue_bytes = DEFAULT_SEND_QUEUE;
+	opts->reconnect_min = DEFAULT_RECONNECT_MIN;
+	opts->reconnect_max = DEFAULT_RECONNECT_MAX;
+	opts->rate_limit = 0;
+	opts->rate_burst = DEFAULT_RATE_BURST;
+	opts->add_batch = DEFAULT_ADD_BATCH;
+	opts->add_window = DEFAULT_ADD_WINDOW;
+}
+
 /*
  * Initialize the link to Polyglot
  */
 int init(struct iface_ops *ns_ops, struct cmdline *cmd)
 {
+	return initWithOptions(ns_ops, cmd, NULL);
+}
+
+/*
+ * Initialize the link to Polyglot using the library options in opts.
+ * If opts is NULL, the default options are used.
+ */
+int initWithOptions(struct iface_ops *ns_ops, struct cmdline *cmd,
+		struct iface_options *opts)
+{
+	struct iface_transport *t;
 	int ret;
 	char *host;
 	int port;
 	int profile;
 
+	/* cJSON allocates through the message arenas from here on */
+	json_arena_init();
+
 	if (cmd != NULL) {
 		host = cmd->host;
 		port = cmd->port;
@@ -80,86 +173,105 @@ int init(struct iface_ops *ns_ops, struct cmdline *cmd)
 
 	memset(poly, 0, sizeof(struct profile));
 	poly->num = profile;
-	poly->config = NULL;
 	poly->connected = 0;
 	poly->custom_config_doc_sent = 0;
 	poly->mqtt_info.profile_num = profile;
 	poly->mqtt_info.ns_ops = ns_ops;
 	poly->nodelist = NULL;
+	msg_init(profile);
+
+	if (opts)
+		poly->options = *opts;
+	else
+		getDefaultOptions(&poly->options);
+
+	if (poly->options.log_buffer > 0 &&
+			logger_set_async(poly->options.log_buffer) != 0)
+		logger(ERROR, "Failed to start async logging.\n");
+
+	/* Start the threads that run the node server callbacks */
+	poly->workers = workq_create(poly->options.worker_threads,
+			poly->options.worker_queue);
+	if (poly->workers == NULL) {
+		logger(ERROR, "Failed to start the callback worker threads.\n");
+		return -3;
+	}
 
-	/* Create runtime instance with random client ID */
-	/*  client name, true, priv_data */
-	mosq = mosquitto_new(NULL, true, (void *)&poly->mqtt_info);
-	if (!mosq) {
-		fprintf(stderr, "Failed to initialize a MQTT instance.\n");
-		return -1;
+	/* Start the per node dispatch lanes */
+	if (start_lanes() != 0) {
+		logger(ERROR, "Failed to start the node dispatch lanes.\n");
+		return -3;
 	}
 
-	/* Set callbacks */
-	logger(DEBUG, "Configure MQTT callbacks\n");
-	mosquitto_connect_callback_set(mosq, on_connect);
-	mosquitto_message_callback_set(mosq, on_message);
-	mosquitto_disconnect_callback_set(mosq, on_disconnect);
-	mosquitto_subscribe_callback_set(mosq, on_subscribe);
-	mosquitto_publish_callback_set(mosq, on_publish);
+	/* Messages are sent from the send queue */
+	if (poly->options.send_queue_bytes <= 0)
+		poly->options.send_queue_bytes = DEFAULT_SEND_QUEUE;
+	if (outq_start(poly->options.send_queue_bytes) != 0)
+		return -3;
 
-	/*
-	 * This will be a secure connection.  The certificate files
-	 * will either come from stdin or from home directory of the
-	 * user running this.
-	 */
-	//mosquitto_tls_insecure_set(mosq, 1);
-	ret = mosquitto_tls_set(mosq,
-			  "/usr/home/bpaauwe/ssl/polyglot.crt",
-			  NULL,
-			  "/usr/home/bpaauwe/ssl/client.crt",
-			  "/usr/home/bpaauwe/ssl/client_private.key",
-			  NULL);
-	if (ret == 3) {
-		ret = mosquitto_tls_set(mosq,
-				"/var/polyglot/ssl/polyglot.crt",
-				NULL,
-				"/var/polyglot/ssl/client.crt",
-				"/var/polyglot/ssl/client_private.key",
-				NULL);
-	}
-	mosquitto_tls_opts_set(mosq, 0, NULL, NULL);
+	if (poly->options.reconnect_min <= 0)
+		poly->options.reconnect_min = DEFAULT_RECONNECT_MIN;
+	if (poly->options.reconnect_max < poly->options.reconnect_min)
+		poly->options.reconnect_max = poly->options.reconnect_min;
+
+	if (rate_start() != 0)
+		return -3;
+
+	if (coalesce_start() != 0)
+		return -3;
+
+	if (poly->options.add_batch <= 0)
+		poly->options.add_batch = DEFAULT_ADD_BATCH;
+	if (poly->options.add_window <= 0)
+		poly->options.add_window = DEFAULT_ADD_WINDOW;
+	if (reg_start() != 0)
+		return -3;
+
+	if (metrics_start() != 0)
+		return -3;
+
+	if (span_start(poly->options.trace_spans) != 0)
+		return -3;
+
+	/* Connect through the transport's callbacks */
+	t = poly->options.transport;
+	if (t == NULL)
+		t = poly->options.transport = mqttTransport();
+	t->on_connect = on_connect;
+	t->on_message = on_message;
+	t->on_disconnect = on_disconnect;
 
 	/* Make the connection */
-	loggerf(INFO, "Connect to Polyglot via MQTT %s:%d\n", host, port);
-	ret = mosquitto_connect_async(mosq, host, port, 10);
-	switch (ret) {
-		case MOSQ_ERR_SUCCESS:
-			logger(INFO, "successful connection.\n");
-			break;
-		case MOSQ_ERR_ERRNO:
-			loggerf(ERROR, "can't connect: %s\n", strerror(errno));
-			return -1;
-		case MOSQ_ERR_INVAL:
-			logger(ERROR, "can't connect: invalid arguments\n");
-			return -1;
-		default:
-			loggerf(ERROR, "can't connect: %s (%d)\n", mosquitto_strerror(ret), ret);
-			return -1;
+	loggerf(INFO, "Connect to Polyglot at %s:%d\n", host, port);
+	ret = t->connect(t, host, port);
+	if (ret != 0) {
+		loggerf(ERROR, "can't connect: %s (%d)\n", t->strerror(ret), ret);
+		return -1;
 	}
+	logger(INFO, "successful connection.\n");
 
-	/* Start a thread to monitor the connection */
-	logger(INFO, "Start mosquitto loop\n");
-	ret = mosquitto_loop_start(mosq);
-	//ret = mosquitto_loop_forever(mosq, 1000, 1000);
+	/*
+	 * Start a thread to monitor the connection.  This reconnects
+	 * when the connection drops.
+	 */
+	logger(INFO, "Start network loop\n");
+	if (conn_start() != 0)
+		return -1;
 
 	return 0;
 }
 
 #define POLYGLOT_CONNECTION  "udi/polyglot/connections/polyglot"
 #define POLYGLOT_INPUT "udi/polyglot/ns/%d"
-#define POLYGLOT_SELFCONNECTION "udi/polyglot/connections/%d"
 
-void poly_send(cJSON *msg)
+/*
+ * Queue a message to be sent to Polyglot.  Returns the number of
+ * messages waiting to be sent or -1 if the message was dropped.
+ */
+int poly_send(cJSON *msg)
 {
 	cJSON *node;
 	char *msg_str;
-	char topic[30];
 	int ret;
 
 	if (!cJSON_HasObjectItem(msg, "node")) {
@@ -167,144 +279,536 @@ void poly_send(cJSON *msg)
 		cJSON_AddItemToObject(msg, "node", node);
 	}
 
-	sprintf(topic, POLYGLOT_SELFCONNECTION, poly->num);
 	msg_str = cJSON_PrintUnformatted(msg);
-	loggerf(DEBUG, "Publishing '%s' to %s\n", msg_str, topic);
-	ret = mosquitto_publish(mosq, NULL, topic, strlen(msg_str), msg_str, 0, 0);
-	if (ret)
-		logger(ERROR, "Failed to publish message to Polyglot\n");
+	if (msg_str == NULL) {
+		logger(ERROR, "Failed to format message to Polyglot\n");
+		return -1;
+	}
+	ret = poly_send_raw(msg_str, strlen(msg_str));
+	cJSON_free(msg_str);
+
+	return ret;
+}
+
+/*
+ * Queue an already formatted message to be sent to Polyglot.
+ */
+int poly_send_raw(const char *msg, size_t len)
+{
+	LOGF(LOGSYS_MQTT, DEBUG, "Publishing '%.*s' to %s\n", (int)len, msg, poly->topic);
+	return outq_put(msg, len, NULL, NULL);
+}
+
+/*
+ * Queue a driver status message.  An older status for the same
+ * address and driver that hasn't been sent yet is replaced.
+ */
+int poly_send_status(const char *msg, size_t len, const char *address,
+		const char *driver)
+{
+	LOGF(LOGSYS_MQTT, DEBUG, "Publishing '%.*s' to %s\n", (int)len, msg, poly->topic);
+	return outq_put(msg, len, address, driver);
 }
 
 /*
  * Once the connection is established, subscribe to the necessary topics
  */
 
-static void on_connect(struct mosquitto *m, void *ptr, int res)
+static void on_connect(struct iface_transport *t)
 {
-	char msg[30];
+	struct msgbuf *mb;
 	char topic[30];
-	int ret;
-	struct mqtt_priv *p = (struct mqtt_priv *)ptr;
-	(void)res;
+	struct mqtt_priv *p = &poly->mqtt_info;
 
-	ret = mosquitto_subscribe(m, NULL, POLYGLOT_CONNECTION, 0);
+	t->subscribe(t, POLYGLOT_CONNECTION);
 
 	sprintf(topic, POLYGLOT_INPUT, p->profile_num);
-	mosquitto_subscribe(m, NULL, topic, 0);
+	t->subscribe(t, topic);
 
-	/* publish a message to kick things off */
-	sprintf(topic, POLYGLOT_SELFCONNECTION, p->profile_num);
-	sprintf(msg, "{\"node\": %d, \"connected\": true}", p->profile_num);
-	ret = mosquitto_publish(m, NULL, topic, strlen(msg), msg, 0, 0);
+	/*
+	 * publish a message to kick things off.  This goes out ahead of
+	 * anything that was queued while we were disconnected.
+	 */
+	mb = msg_buffer();
+	msg_literal(mb, "{\"connected\":true");
+	if (msg_finish(mb) == 0)
+		t->publish(t, poly->topic, mb->buf, (int)mb->len);
 
 	poly->connected = 1;
+	outq_wake();
+
+	/* After a reconnect, send all the nodes again */
+	conn_up();
 }
 
-static void on_disconnect(struct mosquitto *m, void *ptr, int res)
+static void on_disconnect(struct iface_transport *t)
 {
-	(void)m;
-	(void)ptr;
-	(void)res;
+	(void)t;
 
 	logger(INFO, "on_disconnect() called. MQTT connection has dropped\n");
 	poly->connected = 0;
+	outq_wake();
+	conn_down();
 }
 
-static void on_message(struct mosquitto *m, void *ptr,
-		const struct mosquitto_message *msg)
+/*
+ * Queue a handler on the worker threads.  If msg is not NULL, it is
+ * the arena holding the parsed message and the worker takes ownership
+ * of it, releasing it after the handler runs.
+ */
+static void dispatch(void *(*fn)(void *), void *arg, struct json_arena *msg)
 {
-	struct mqtt_priv *p = (struct mqtt_priv *)ptr;
-	pthread_t thread;
-	cJSON *jmsg;
-	cJSON *key;
-	(void)m;
+	if (workq_submit(poly->workers, fn, arg, msg ? json_arena_release : NULL,
+				msg) != 0) {
+		logger(ERROR, "Failed to queue message handler\n");
+		json_arena_release(msg);
+	}
+}
+
+/*
+ * Queue a node handler on the lane for address.  Ownership of msg
+ * is handled the same as dispatch().
+ */
+static void dispatch_node(const char *address, void *(*fn)(void *),
+		void *arg, struct json_arena *msg)
+{
+	if (workq_submit(node_lane(address), fn, arg,
+				msg ? json_arena_release : NULL, msg) != 0) {
+		logger(ERROR, "Failed to queue node handler\n");
+		json_arena_release(msg);
+	}
+}
 
-	if (msg == NULL) {
-		printf("-- got NULL message\n");
+/*
+ * Queue a query or status request.  A request for "all" is split
+ * into one request per node so that each one stays in order with
+ * the commands for that node.
+ */
+static void dispatch_report(void *(*fn)(void *), struct jtape *msg, int addr)
+{
+	struct json_arena *arena;
+	struct node **nodes;
+	struct jview v;
+	char *address;
+	int cnt, i;
+
+	if (!tape_streq(msg, addr, "all")) {
+		/* The lane gets its own copy of the address */
+		v = tape_view(msg, addr);
+		arena = json_arena_new();
+		address = arena ? json_arena_alloc(arena, v.len + 1) : NULL;
+		if (address == NULL ||
+				tape_string(msg, addr, address, v.len + 1) < 0) {
+			logger(ERROR, "Failed to allocate memory for message\n");
+			json_arena_release(arena);
+			return;
+		}
+		dispatch_node(address, fn, address, arena);
 		return;
 	}
 
-	loggerf(DEBUG, "-- got message @ %s: (%d, Qos %d, %s) '%s'\n",
-			msg->topic, msg->payloadlen, msg->qos, msg->retain ? "R" : "!r",
-			msg->payload);
+	nodes = node_list_get(&cnt);
+	for (i = 0; i < cnt; i++) {
+		address = strdup(nodes[i]->address);
+		if (address == NULL)
+			break;
+		if (workq_submit(node_lane(address), fn, address, free,
+					address) != 0) {
+			logger(ERROR, "Failed to queue node handler\n");
+			free(address);
+		}
+	}
+	node_list_put(nodes, cnt);
+}
 
-	jmsg = cJSON_Parse(msg->payload);
-	key = cJSON_GetObjectItemCaseSensitive(jmsg, "node");
-	if (strcmp(key->valuestring, "polyglot") != 0) {
-		/* ignore messsages not from polyglot */
+/*
+ * A config change for the node server: the new config for onConfig
+ * and what changed for onConfigChange.
+ */
+struct config_work {
+	struct mqtt_priv *p;
+	struct config *c;
+	struct config_delta *delta;
+};
+
+/*
+ * Run the config callbacks, onConfig first and then onConfigChange.
+ */
+static void *config_exec(void *args)
+{
+	struct config_work *w = (struct config_work *)args;
+
+	if (w->p->ns_ops->onConfig)
+		w->p->ns_ops->onConfig((void *)config_text(w->c));
+	if (w->delta)
+		w->p->ns_ops->onConfigChange(w->delta);
+
+	return NULL;
+}
+
+static void config_work_free(void *args)
+{
+	struct config_work *w = (struct config_work *)args;
+
+	if (w->delta)
+		config_delta_free(w->delta);
+	config_put(w->c);
+	free(w);
+}
+
+/*
+ * Store a new config from Polyglot.  The config is kept, so unlike
+ * the message it gets a cJSON tree on the heap.
+ */
+static void set_config(struct mqtt_priv *p, struct jview v)
+{
+	struct config_work *w;
+	struct config *old;
+	char *text;
+	cJSON *tree;
+
+	text = malloc(v.len + 1);
+	if (text == NULL) {
+		logger(ERROR, "Failed to allocate memory for config\n");
 		return;
 	}
+	memcpy(text, v.ptr, v.len);
+	text[v.len] = '\0';
+	tree = cJSON_Parse(text);
+	free(text);
 
-	/*
-	 * Parse message and invoke handlers
-	 *
-	 * most of the handlers are executed in a thread so we don't block
-	 * here.
-	 */
-	if (cJSON_HasObjectItem(jmsg, "connected")) {
-		/* call start callback */
-		if (p->ns_ops->start) {
-			int ret;
-			ret = pthread_create(&thread, NULL, p->ns_ops->start, NULL);
-		}
-	} else if (cJSON_HasObjectItem(jmsg, "config")) {
-		/* store config object and call onConfig */
-		key = cJSON_GetObjectItem(jmsg, "config");
+	/* Call setCustomParamsDoc here */
+	setCustomParamsDoc();
+
+	/* Keep the previous config to find what changed */
+	old = config_get();
 
-		/* Call setCustomParamsDoc here */
-		setCustomParamsDoc();
+	if (config_set(tree) == 0) {
+		struct config *c = config_get();
 
-		poly->config = cJSON_Print(key);
-		if (p->ns_ops->onConfig) {
-			pthread_create(&thread, NULL, p->ns_ops->onConfig, (void *)poly->config);
+		if (p->ns_ops->onConfig == NULL &&
+				p->ns_ops->onConfigChange == NULL) {
+			config_put(c);
+			config_put(old);
+			return;
 		}
-	} else if (cJSON_HasObjectItem(jmsg, "shortPoll")) {
-		/* Call the node server's shortPoll callback */
-		if (p->ns_ops->shortPoll)
-			pthread_create(&thread, NULL, p->ns_ops->shortPoll, NULL);
-	} else if (cJSON_HasObjectItem(jmsg, "longPoll")) {
-		/* Call the node server's longPoll callback */
-		if (p->ns_ops->longPoll)
-			pthread_create(&thread, NULL, p->ns_ops->longPoll, NULL);
-	} else if (cJSON_HasObjectItem(jmsg, "command")) {
-		/* Execute the node command */
-		cJSON *cmd = cJSON_GetObjectItem(jmsg, "command");
-		pthread_create(&thread, NULL, node_cmd_exec, (void *)cmd);
-	} else if (cJSON_HasObjectItem(jmsg, "query")) {
-		cJSON *query = cJSON_GetObjectItem(jmsg, "query");
-		cJSON *addr = cJSON_GetObjectItem(query, "address");
-		pthread_create(&thread, NULL, node_query_exec, (void *)addr->valuestring);
-	} else if (cJSON_HasObjectItem(jmsg, "status")) {
-		cJSON *query = cJSON_GetObjectItem(jmsg, "status");
-		cJSON *addr = cJSON_GetObjectItem(query, "address");
-		pthread_create(&thread, NULL, node_status_exec, (void *)addr->valuestring);
-	} else if (cJSON_HasObjectItem(jmsg, "delete")) {
-		if (p->ns_ops->delete)
-			p->ns_ops->delete(NULL); /* should we run this in a thread? */
-	} else {
-		// result
-		logger(DEBUG, "Message type not yet handled\n");
+
+		w = malloc(sizeof(*w));
+		if (w == NULL) {
+			logger(ERROR, "Failed to allocate memory for config\n");
+			config_put(c);
+			config_put(old);
+			return;
+		}
+		w->p = p;
+		w->c = c;
+		w->delta = p->ns_ops->onConfigChange ? config_diff(old, c) : NULL;
+
+		/*
+		 * Both callbacks run as one item on the config lane, so each
+		 * delta is applied after its onConfig and in the order the
+		 * configs arrived.  onConfig holds a reference to the config
+		 * text until the item is released.
+		 */
+		if (workq_submit(poly->config_lane, config_exec, w,
+					config_work_free, w) != 0) {
+			logger(ERROR, "Failed to queue message handler\n");
+			config_work_free(w);
+		}
+	}
+	config_put(old);
+}
+
+/*
+ * Hand a command to the lane for its node.  The lane gets a detached
+ * copy of the message since the payload is only ours until we return,
+ * and the time it was received.
+ */
+static void dispatch_command(struct jtape *msg, int addr, long long rx)
+{
+	struct span_ctx none = { 0, 0 };
+	struct json_arena *arena;
+	struct cmd_work *cmd;
+	char address[128];
+
+	if (tape_string(msg, addr, address, sizeof(address)) < 0)
+		return;
+
+	arena = json_arena_new();
+	cmd = arena ? json_arena_alloc(arena, sizeof(struct cmd_work)) : NULL;
+	if (cmd == NULL || (cmd->msg = tape_detach(msg, arena)) == NULL) {
+		logger(ERROR, "Failed to allocate memory for message\n");
+		json_arena_release(arena);
+		return;
+	}
+	cmd->rx = rx;
+
+	/* the command's trace goes with it to the lane */
+	span_new(rx);
+	dispatch_node(address, node_cmd_exec, (void *)cmd, arena);
+	span_set(none);
+}
+
+/*
+ * Message handlers
+ *
+ * Each one gets the message and the index of the value for its key.
+ * Most of them queue the work to the worker threads so we don't block
+ * the network thread.  Handlers that need part of the message get
+ * their own copy of it.
+ */
+static void on_connected(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	(void)msg; (void)val; (void)rx;
+
+	/* call start callback */
+	if (p->ns_ops->start)
+		dispatch(p->ns_ops->start, NULL, NULL);
+}
+
+static void on_config(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	(void)rx;
+
+	/* store config object and call onConfig */
+	set_config(p, tape_view(msg, val));
+}
+
+static void on_shortpoll(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	(void)msg; (void)val; (void)rx;
+
+	/* Call the node server's shortPoll callback */
+	if (p->ns_ops->shortPoll)
+		dispatch(p->ns_ops->shortPoll, NULL, NULL);
+}
+
+static void on_longpoll(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	(void)msg; (void)val; (void)rx;
+
+	/* Call the node server's longPoll callback */
+	if (p->ns_ops->longPoll)
+		dispatch(p->ns_ops->longPoll, NULL, NULL);
+}
+
+static void on_command(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	int key = tape_get(msg, val, "address");
+	(void)p;
+
+	/* Execute the node command */
+	if (tape_type(msg, key) == TAPE_STRING)
+		dispatch_command(msg, key, rx);
+}
+
+static void on_query(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	int key = tape_get(msg, val, "address");
+	(void)p; (void)rx;
+
+	if (tape_type(msg, key) == TAPE_STRING)
+		dispatch_report(node_query_exec, msg, key);
+}
+
+static void on_status(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	int key = tape_get(msg, val, "address");
+	(void)p; (void)rx;
+
+	if (tape_type(msg, key) == TAPE_STRING)
+		dispatch_report(node_status_exec, msg, key);
+}
+
+static void on_delete(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	(void)msg; (void)val; (void)rx;
+
+	if (p->ns_ops->delete)
+		p->ns_ops->delete(NULL); /* should we run this in a thread? */
+}
+
+/*
+ * One addnode result, for the node at its address.
+ */
+static void add_result(struct jtape *msg, int item)
+{
+	char address[64];
+
+	if (tape_string(msg, tape_get(msg, item, "address"), address,
+				sizeof(address)) < 0)
+		return;
+	reg_result(address,
+			tape_type(msg, tape_get(msg, item, "success")) == TAPE_TRUE);
+}
+
+static void on_result(struct mqtt_priv *p, struct jtape *msg, int val,
+		long long rx)
+{
+	int key = tape_get(msg, val, "addnode");
+	int item;
+	(void)p; (void)rx;
+
+	/* One result per node, used to pace addNodes() */
+	if (tape_type(msg, key) == TAPE_ARRAY) {
+		TAPE_FOREACH(msg, key, item)
+			add_result(msg, item);
+	} else if (key >= 0) {
+		add_result(msg, key);
 	}
 }
 
-static void on_subscribe(struct mosquitto *m, void *ptr, int mid, int qos, const int *granted)
+/*
+ * The message types, in order of precedence for the odd message
+ * that has more than one of them.
+ */
+static const struct msg_type {
+	const char *name;
+	size_t len;
+	int stat;
+	void (*handler)(struct mqtt_priv *p, struct jtape *msg, int val,
+			long long rx);
+} msg_types[] = {
+	{ "connected", 9, STAT_MSG_CONNECTED, on_connected },
+	{ "config",    6, STAT_MSG_CONFIG,    on_config },
+	{ "shortPoll", 9, STAT_MSG_SHORTPOLL, on_shortpoll },
+	{ "longPoll",  8, STAT_MSG_LONGPOLL,  on_longpoll },
+	{ "command",   7, STAT_MSG_COMMAND,   on_command },
+	{ "query",     5, STAT_MSG_QUERY,     on_query },
+	{ "status",    6, STAT_MSG_STATUS,    on_status },
+	{ "delete",    6, STAT_MSG_DELETE,    on_delete },
+	{ "result",    6, STAT_MSG_RESULT,    on_result },
+};
+#define MSG_TYPES (int)(sizeof(msg_types) / sizeof(msg_types[0]))
+
+/*
+ * Perfect hash of the message type names.  MSG_HASH() has no
+ * collisions for the names above; the slot holds the index into
+ * msg_types plus one, zero for an empty slot.  Adding a type means
+ * adding it to msg_types and, if MSG_HASH() collides, picking a new
+ * multiplier.
+ */
+#define MSG_MIN_LEN 5
+#define MSG_MAX_LEN 9
+#define MSG_HASH(k, len) \
+	(((unsigned char)(k)[1] + (unsigned char)(k)[(len) - 1] * 5 + (len)) & 15)
+
+static const unsigned char msg_hash[16] = {
+	[12] = 1,   /* connected */
+	[8]  = 2,   /* config */
+	[13] = 3,   /* shortPoll */
+	[3]  = 4,   /* longPoll */
+	[10] = 5,   /* command */
+	[7]  = 6,   /* query */
+	[9]  = 7,   /* status */
+	[4]  = 8,   /* delete */
+	[15] = 9,   /* result */
+};
+
+/*
+ * Look up a key in the message type table.  Returns the index into
+ * msg_types, or -1 if the key isn't a message type.
+ */
+static int msg_lookup(const char *key, size_t len)
 {
-	(void)m;
-	(void)ptr;
-	(void)mid;
-	(void)qos;
-	(void)granted;
+	int i;
 
-	return;
+	if (len < MSG_MIN_LEN || len > MSG_MAX_LEN)
+		return -1;
+
+	i = msg_hash[MSG_HASH(key, len)] - 1;
+	if (i < 0 || msg_types[i].len != len ||
+			memcmp(msg_types[i].name, key, len) != 0)
+		return -1;
+
+	return i;
+}
+
+/*
+ * Cheap check that the payload could be from Polyglot, before paying
+ * for a full parse.  Anything from Polyglot has "node":"polyglot", so
+ * a payload without the string "polyglot" in it is not.
+ */
+static int maybe_polyglot(const char *payload, size_t len)
+{
+	const char *p = payload;
+	const char *end = payload + len;
+
+	while (end - p >= 10 && (p = memchr(p, '"', end - p - 9)) != NULL) {
+		if (memcmp(p + 1, "polyglot\"", 9) == 0)
+			return 1;
+		p++;
+	}
+
+	return 0;
 }
 
-static void on_publish(struct mosquitto *m, void *ptr, int res)
+static void on_message(struct iface_transport *t, const char *topic,
+		const void *payload, int len)
 {
-	(void)m;
-	(void)ptr;
-	(void)res;
+	struct mqtt_priv *p = &poly->mqtt_info;
+	long long rx = metrics_now();
+	struct jtape *msg = tape_thread();
+	int from_polyglot = 0;
+	int type = MSG_TYPES;
+	int val = -1;
+	char name[MSG_MAX_LEN * 6 + 1];     /* room for every char as \uXXXX */
+	struct jview k;
+	int key;
+	int i;
+	(void)t;
+
+	LOGF(LOGSYS_MQTT, DEBUG, "-- got message @ %s: (%d) '%.*s'\n",
+			topic, len, len, (const char *)payload);
+
+	/*
+	 * The message is parsed onto this thread's tape, which only
+	 * points into the payload.
+	 */
+	if (len < 0 || !maybe_polyglot(payload, (size_t)len) ||
+			tape_parse(msg, payload, (size_t)len) != 0 ||
+			tape_type(msg, TAPE_ROOT) != TAPE_OBJECT) {
+		/* ignore messsages not from polyglot */
+		return;
+	}
+
+	/* One pass over the keys to find the sender and the message type */
+	TAPE_FOREACH_KEY(msg, TAPE_ROOT, key) {
+		k = tape_view(msg, key);
+		if (msg->ent[key].flags & TAPE_ESCAPED) {
+			if (tape_string(msg, key, name, sizeof(name)) < 0)
+				continue;
+			k.ptr = name;
+			k.len = strlen(name);
+		}
+
+		if (k.len == 4 && memcmp(k.ptr, "node", 4) == 0) {
+			from_polyglot = tape_streq(msg, key + 1, "polyglot");
+		} else if ((i = msg_lookup(k.ptr, k.len)) >= 0 && i < type) {
+			type = i;
+			val = key + 1;
+		}
+	}
+
+	if (!from_polyglot)
+		return;
+
+	if (type == MSG_TYPES) {
+		metrics_msg_in(STAT_MSG_OTHER, len);
+		logger(DEBUG, "Message type not yet handled\n");
+		return;
+	}
 
-	return;
+	metrics_msg_in(msg_types[type].stat, len);
+	msg_types[type].handler(p, msg, val, rx);
 }
 
 static int get_stdin_info(char **host, int *port, int *profile)
@@ -0,0 +1,343 @@
+/*
+  Copyright (c) 2020 Robert Paauwe
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+/*
+ * pg_tracedump
+ *
+ * Decode the binary trace log written by logger_set_trace() into
+ * text, one line per message in time order:
+ *
+ *   pg_tracedump [logs/trace.bin]
+ *
+ * The trace must be decoded on a machine with the same byte order
+ * as the one that wrote it.  Each run of the program starts with a
+ * header and has its own format ids.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_VERSION 1
+
+struct format {
+	unsigned int run;
+	unsigned long long id;
+	char *text;
+	struct format *next;
+};
+
+struct event {
+	unsigned int run;
+	unsigned long long id;
+	unsigned long long ns;
+	unsigned int thread;
+	unsigned char level;
+	unsigned short len;
+	const unsigned char *args;
+	size_t seq;
+};
+
+static const char *levels[] = {
+	"CRITICAL", "ERROR", "WARNING", "INFO", "DEBUG",
+};
+
+#define FORMAT_HASH 1024
+static struct format *formats[FORMAT_HASH];
+
+static const char *format_find(unsigned int run, unsigned long long id)
+{
+	struct format *f;
+
+	for (f = formats[(id >> 3) % FORMAT_HASH]; f; f = f->next)
+		if (f->id == id && f->run == run)
+			return f->text;
+	return NULL;
+}
+
+static void format_add(unsigned int run, unsigned long long id,
+		const unsigned char *text, unsigned short len)
+{
+	struct format *f;
+
+	if (format_find(run, id))
+		return;
+	f = malloc(sizeof(struct format));
+	f->run = run;
+	f->id = id;
+	f->text = malloc(len + 1);
+	memcpy(f->text, text, len);
+	f->text[len] = '\0';
+	f->next = formats[(id >> 3) % FORMAT_HASH];
+	formats[(id >> 3) % FORMAT_HASH] = f;
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+	const struct event *x = a;
+	const struct event *y = b;
+
+	if (x->ns != y->ns)
+		return x->ns < y->ns ? -1 : 1;
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static long long get_int(const unsigned char **p, const unsigned char *end)
+{
+	long long v = 0;
+
+	if (*p + sizeof(v) <= end) {
+		memcpy(&v, *p, sizeof(v));
+		*p += sizeof(v);
+	}
+	return v;
+}
+
+/*
+ * Print one message by walking its format the same way the library
+ * recorded the arguments and printing each conversion on its own.
+ */
+static void print_event(FILE *out, const char *fmt, const unsigned char *p,
+		const unsigned char *end)
+{
+	char spec[64], str[256];
+	const char *start;
+	unsigned short slen;
+	long long ival;
+	double dval;
+	size_t n;
+	int hh;
+
+	while (*fmt) {
+		if (*fmt != '%') {
+			fputc(*fmt++, out);
+			continue;
+		}
+		if (fmt[1] == '%') {
+			fputc('%', out);
+			fmt += 2;
+			continue;
+		}
+
+		/* copy flags, width and precision, filling in any '*' */
+		start = fmt++;
+		n = 0;
+		spec[n++] = '%';
+		while (*fmt && strchr("-+ #0'", *fmt) && n < 8)
+			spec[n++] = *fmt++;
+		if (*fmt == '*') {
+			n += snprintf(spec + n, sizeof(spec) - n, "%lld", get_int(&p, end));
+			fmt++;
+		}
+		while (*fmt >= '0' && *fmt <= '9' && n < 24)
+			spec[n++] = *fmt++;
+		if (*fmt == '.') {
+			spec[n++] = *fmt++;
+			if (*fmt == '*') {
+				n += snprintf(spec + n, sizeof(spec) - n, "%lld",
+						get_int(&p, end));
+				fmt++;
+			}
+			while (*fmt >= '0' && *fmt <= '9' && n < 48)
+				spec[n++] = *fmt++;
+		}
+
+		/* length modifiers are replaced, the value is printed as long long */
+		hh = 0;
+		if (*fmt == 'h')
+			hh = (fmt[1] == 'h') ? 2 : 1;
+		while (*fmt && strchr("hlqLzjt", *fmt))
+			fmt++;
+
+		switch (*fmt) {
+		case 'd': case 'i':
+			ival = get_int(&p, end);
+			if (hh == 1)
+				ival = (short)ival;
+			else if (hh == 2)
+				ival = (signed char)ival;
+			spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = *fmt; spec[n] = '\0';
+			fprintf(out, spec, ival);
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			ival = get_int(&p, end);
+			if (hh == 1)
+				ival = (unsigned short)ival;
+			else if (hh == 2)
+				ival = (unsigned char)ival;
+			spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = *fmt; spec[n] = '\0';
+			fprintf(out, spec, (unsigned long long)ival);
+			break;
+		case 'c':
+			spec[n++] = 'c'; spec[n] = '\0';
+			fprintf(out, spec, (int)get_int(&p, end));
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			dval = 0;
+			if (p + sizeof(dval) <= end) {
+				memcpy(&dval, p, sizeof(dval));
+				p += sizeof(dval);
+			}
+			spec[n++] = *fmt; spec[n] = '\0';
+			fprintf(out, spec, dval);
+			break;
+		case 's':
+			slen = 0;
+			if (p + sizeof(slen) <= end) {
+				memcpy(&slen, p, sizeof(slen));
+				p += sizeof(slen);
+			}
+			if (p + slen > end)
+				slen = end - p;
+			if (slen >= sizeof(str))
+				slen = sizeof(str) - 1;
+			memcpy(str, p, slen);
+			str[slen] = '\0';
+			p += slen;
+			spec[n++] = 's'; spec[n] = '\0';
+			fprintf(out, spec, str);
+			break;
+		case 'p':
+			fprintf(out, "%#llx", (unsigned long long)get_int(&p, end));
+			break;
+		case 'n':
+			break;
+		default:
+			/* not a conversion we know, print it as is */
+			fwrite(start, 1, fmt - start + (*fmt != '\0'), out);
+			break;
+		}
+		if (*fmt)
+			fmt++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : "logs/trace.bin";
+	unsigned char *data, *p, *end;
+	struct event *events = NULL;
+	size_t cnt = 0, alloc = 0, i;
+	unsigned long long id;
+	unsigned short len;
+	unsigned int version;
+	unsigned int run = 0;
+	const char *fmt;
+	char *line;
+	size_t line_len;
+	struct tm tm;
+	FILE *out;
+	time_t secs;
+	long size;
+	FILE *fp;
+
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		perror(name);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(size);
+	if (data == NULL || fread(data, 1, size, fp) != (size_t)size) {
+		fprintf(stderr, "%s: read failed\n", name);
+		return 1;
+	}
+	fclose(fp);
+
+	if (size >= 12)
+		memcpy(&version, data + 8, sizeof(version));
+	if (size < 12 || memcmp(data, "PGTRACE", 8) != 0 ||
+			version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace file\n", name);
+		return 1;
+	}
+
+	/* Formats can come after their first use, so read everything first */
+	end = data + size;
+	for (p = data; p < end; ) {
+		if (*p == 'P' && p + 12 <= end &&
+				memcmp(p, "PGTRACE", 8) == 0) {
+			/* a new run, with its own format ids */
+			run++;
+			p += 12;
+		} else if (*p == 'F' && p + 11 <= end) {
+			memcpy(&id, p + 1, 8);
+			memcpy(&len, p + 9, 2);
+			if (p + 11 + len > end)
+				break;
+			format_add(run, id, p + 11, len);
+			p += 11 + len;
+		} else if (*p == 'E' && p + 24 <= end) {
+			if (cnt == alloc) {
+				alloc = alloc ? alloc * 2 : 1024;
+				events = realloc(events, alloc * sizeof(struct event));
+			}
+			events[cnt].run = run;
+			memcpy(&events[cnt].id, p + 1, 8);
+			memcpy(&events[cnt].ns, p + 9, 8);
+			memcpy(&events[cnt].thread, p + 17, 4);
+			events[cnt].level = p[21];
+			memcpy(&events[cnt].len, p + 22, 2);
+			events[cnt].args = p + 24;
+			events[cnt].seq = cnt;
+			if (p + 24 + events[cnt].len > end)
+				break;
+			p += 24 + events[cnt].len;
+			cnt++;
+		} else {
+			fprintf(stderr, "%s: bad record at offset %ld\n", name,
+					(long)(p - data));
+			break;
+		}
+	}
+
+	qsort(events, cnt, sizeof(struct event), event_cmp);
+
+	for (i = 0; i < cnt; i++) {
+		secs = events[i].ns / 1000000000ULL;
+		localtime_r(&secs, &tm);
+		printf("%04d-%02d-%02d %02d:%02d:%02d.%06llu [%u] %s: ",
+				tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+				tm.tm_hour, tm.tm_min, tm.tm_sec,
+				(events[i].ns % 1000000000ULL) / 1000,
+				events[i].thread,
+				events[i].level < 5 ? levels[events[i].level] : "?");
+		fmt = format_find(events[i].run, events[i].id);
+		if (fmt == NULL) {
+			printf("<unknown format %#llx>\n", events[i].id);
+			continue;
+		}
+		out = open_memstream(&line, &line_len);
+		print_event(out, fmt, events[i].args, events[i].args + events[i].len);
+		fclose(out);
+		while (line_len && line[line_len - 1] == '\n')
+			line[--line_len] = '\0';
+		puts(line);
+		free(line);
+	}
+
+	return 0;
+}